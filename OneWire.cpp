@@ -142,167 +142,231 @@ sample code bearing this copyright.
 //--------------------------------------------------------------------------
 */
 
+#include "config.h"
+#ifndef FASTMILLIS_HOST
 #include <Arduino.h>
+#endif
 #include "OneWire.h"
 
-#include "config.h"
 #include "fastmillis.h"
+#include "trace.h"
 //#include "fastmillis_coro.h"
 
-// Reset LOW duration
-#define tRSTL   500
-
-// Write 0 bit LOW duration, 60-120µs
-#define tLOW0 60
-
-// Write 1 bit LOW duration, 1-15µs
-#define tLOW1 9
-
-// Active pull-up time, µs
-#define tAPU 2
-
-// Slot time, 60-120µs = maximum tLOW + tHIGH, so must be higher than both values above
-#define tSLOT 80
+#include "OneWire_timing.h"
 
-// For reads, time to drive the wire low
-#define tDRIVElow 9
+// Standard speed: the values in OneWire_timing.h, shared with OneWireAsync
+// and OneWireMultiBus.
+const OneWireTiming OneWireTiming::standard = {
+    tRSTL*1000, tAPU*1000, tPDSAMPLE*1000, tRSTH*1000,
+    tLOW0*1000, tLOW1*1000, tSLOT*1000, tDRIVElow*1000, tRDV*1000
+};
 
-// For read, time to sample, counted from the beginning of the low pulse
-#define tRDV 18
+// Overdrive, from the recommended values in Maxim AN126: reset 70µs,
+// presence sampled 8.5µs after it, 10µs slots, read sampled at 2µs. Needs
+// a short bus, the wire must be back up within 1µs of a release.
+const OneWireTiming OneWireTiming::overdrive = {
+    70000, 500, 78500, 40000,
+    7500, 1000, 10000, 1000, 2000
+};
 
-// this includes an oscilloscope
-// ace_routine::LinearHistogramCoroutineProfiler    profile_onewire( 30*CPU_FREQUENCY_MHZ );
-// ace_routine::LinearHistogramCoroutineProfiler    profile_onewire_s( 30*CPU_FREQUENCY_MHZ );
+// Standard speed for long or heavily loaded cables, within the DS18B20
+// limits: longer reset and active pull-up, presence sampled 75µs after the
+// release, and 60µs of recovery per slot for the pull-up to recharge the
+// cable. A read slot releases after 3µs and samples at 13µs, inside tRDV
+// (15µs), leaving 10µs for the rise: a slower wire needs calibrate() or
+// a line driver.
+const OneWireTiming OneWireTiming::long_line = {
+    600000, 5000, 675000, 500000,
+    60000, 6000, 120000, 3000, 13000
+};
 
 void OneWire::begin( uint8_t _pin )
+{
+    if( _pin >= 32 )
+        Serial.println( "OneWire needs pin<32, use OneWireT<pin>" );
+    init( _pin );
+}
+
+// begin() without the pin check. bitmask stays 0 for pins 32 and up,
+// which only OneWireT can drive.
+void OneWire::init( uint8_t _pin )
 {
     pin = _pin;
     pinMode(pin, INPUT);
 
-    // profile_onewire.begin("ow","run",FastClockInterface::cycles_per_second());
-    // profile_onewire_s.begin("ows","run",FastClockInterface::cycles_per_second());
+	bitmask = pin < 32 ? uint32_t(1) << pin : 0;
 
-    if( pin >= 32 )
-        Serial.println( "OneWire needs pin<32" );
+    setup_pin( pin );
+    set_timing( OneWireTiming::standard );
+#if ONEWIRE_CALIBRATE
+    calibrate();
+#endif
 
-	bitmask = 1 << pin;
+#if ONEWIRE_SEARCH
+	reset_search();
+#endif
+}
 
+// Route the pin to GPIO, with input enabled (needed to read it back
+// while we drive it) and output drive strength 2.
+void OneWire::setup_pin( uint8_t pin )
+{
+#ifndef FASTMILLIS_HOST
     uint32_t pinFunction((uint32_t)2 << FUN_DRV_S); // what are the drivers?
     pinFunction |= FUN_IE; // input enable but required for output as well?
     pinFunction |= ((uint32_t)2 << MCU_SEL_S);
 
     ESP_REG(DR_REG_IO_MUX_BASE + esp32_gpioMux[pin].reg) = pinFunction;
-
-#if ONEWIRE_SEARCH
-	reset_search();
+#else
+    (void)pin;
 #endif
 }
 
+void OneWire::set_timing( const OneWireTiming& t )
+{
+    profile_ns = t;
+    cal.ok = false;
+    apply_timing( t );
+}
 
-// Perform the onewire reset function.  We will wait for
-// the bus to come high, if it doesn't then it is broken or shorted
-// and we return a 0;
-//
-// Returns 1 if a device asserted a presence pulse, 0 otherwise.
-//
-bool OneWire::reset(void)
+void OneWire::apply_timing( const OneWireTiming& t )
 {
-    bool r;
-    unsigned retries = 125;
+    const uint32_t* ns = &t.rstl;
+    uint32_t* cycles = &timing_cycles.rstl;
+    for( unsigned i = 0; i < sizeof(OneWireTiming)/sizeof(uint32_t); i++ )
+        cycles[i] = (uint64_t)ns[i] * FASTCYCLES_MHZ / 1000;
+    timing_ns = t;
+}
 
-    pinInput();
-    // wait until the wire is high... just in case
-    do {
-        if (--retries == 0) return 0;
-        delayMicroseconds(2);
-    } while ( !pinRead() );
-
-    MultiDelay d;
-    timeCriticalEnter() {
-        d.reset();
-        pinLow();
-        pinOutput();  // drive output low
-        d.waitUntilMicros( tRSTL );       // tRSTL minimum 480µs
-        pinHigh();
-        d.waitUntilMicros( tRSTL+tAPU );  // active pullup
-        pinInput();                       // allow it to float
-        d.waitUntilMicros( tRSTL + 70 );  // aim for right after tPDL goes down
-        r = !pinRead();
-    } timeCriticalExit();
-    delayMicroseconds(410);
-    return r;
+void OneWire::set_calibration_period( uint32_t period_ms )
+{
+    calibration_period = period_ms;
+    calibration_due = fastmillis() + period_ms;
 }
 
-//
-// Write a bit. Port and bit is used to cut lookup time and provide
-// more certain timing.
-//
-void OneWire::write_bit(uint8_t v)
+int OneWire::measure_rise()
+{
+    return measure_rise_t( OneWirePinMask{ bitmask } );
+}
+
+int OneWire::measure_read_slot()
 {
-    MultiDelay d;
-    if (v & 1) {
-        timeCriticalEnter() {
-            d.reset();
-            pinLow();
-            pinOutput();  // drive output low
-            d.waitUntilMicros( tLOW1 );       
-            // pinHigh();   // drive output high
-            // d.waitUntilMicros( tLOW1 + tAPU ); // active pullup time    
-            pinInput();   // return to input mode and let the pullup do the job (safer)
-        } timeCriticalExit();
-    } else {
-        timeCriticalEnter() {
-            d.reset();
-            pinLow();
-            pinOutput();  // drive output low
-            d.waitUntilMicros( tLOW0 ); // tLOW0 is 60-120µs
-            // pinHigh();   // drive output high
-            pinInput();
-        } timeCriticalExit();
+    return measure_read_slot_t( OneWirePinMask{ bitmask } );
+}
+
+bool OneWire::calibrate( uint32_t margin_ns )
+{
+    const OneWireTiming& p = profile_ns;
+    if( !margin_ns )
+        margin_ns = p.slot / 40;
+    uint32_t margin = (uint64_t)margin_ns * FASTCYCLES_MHZ / 1000;
+
+    calibrating = true;
+    apply_timing( p );          // measure with the untouched profile
+    cal.ok = false;
+    cal.rise_ns = 0;
+    cal.hold_ns = 0;
+
+    // Rise time: write 1 slots, which devices take as a ROM command made
+    // of 1s (0xFF, matches nothing), then reset.
+    uint32_t rise = 0;
+    bool ok = reset();
+    for( int i = 0; ok && i < 8; i++ ) {
+        int r = measure_rise();
+        if( r < 0 )
+            ok = false;
+        else if( (uint32_t)r > rise )
+            rise = r;
+    }
+
+    // Hold time: the first bit of a Search ROM and its complement, one
+    // of them is a 0 from every device that has it. Twice.
+    uint32_t hold = 0xFFFFFFFF;
+    for( int i = 0; ok && i < 2; i++ ) {
+        ok = reset();
+        write( 0xF0 );
+        for( int j = 0; ok && j < 2; j++ ) {
+            int h = measure_read_slot();
+            if( h < 0 )
+                ok = false;
+            else if( (uint32_t)h > timing_cycles.drive_low + 2*rise + margin && (uint32_t)h - rise < hold )
+                hold = h - rise;        // that was a 0
+        }
     }
-    d.waitUntilMicros( tSLOT );
+    ok = reset() && ok;
+    calibrating = false;
+    if( !ok || hold == 0xFFFFFFFF )
+        return false;
+    cal.rise_ns = (uint64_t)rise * 1000 / FASTCYCLES_MHZ;
+    cal.hold_ns = (uint64_t)hold * 1000 / FASTCYCLES_MHZ;
+
+    // Sample a read slot once a 1 is up, and well before a 0 ends.
+    OneWireTiming t = p;
+    t.rdv = p.drive_low + cal.rise_ns + margin_ns;
+    if( t.rdv + margin_ns > cal.hold_ns )
+        return false;
+    // A write 1 must be up before the devices sample it. They sample about
+    // when they would release a 0, so use the hold time for that too.
+    if( p.low1 + cal.rise_ns + margin_ns > cal.hold_ns )
+        return false;
+    // End the slot once the longest low phase has risen, plus recovery.
+    uint32_t longest = p.low0 > cal.hold_ns ? p.low0 : cal.hold_ns;
+    t.slot = longest + cal.rise_ns + margin_ns;
+    apply_timing( t );
+    cal.ok = true;
+    return true;
+}
+
+// The slots themselves are in OneWire_slots.h, shared with OneWireT.
+
+bool OneWire::reset(void)
+{
+    return reset_t( OneWirePinMask{ bitmask } );
+}
+
+void OneWire::write_bit(uint8_t v)
+{
+    write_bit_t( OneWirePinMask{ bitmask }, v );
 }
 
 //
-// Read a bit. Port and bit is used to cut lookup time and provide
-// more certain timing.
+// Read a bit.
 //
-
 bool OneWire::read_bit(void)
 {
-    bool r;
-    // int transition_time;
-    MultiDelay d;
-    timeCriticalEnter() {
-        d.reset();
-        pinOutput();      // drive output low
-        pinLow();
-        d.waitUntilMicros( tDRIVElow );
-        pinInput();     // let pin float, resistor pull up only
-
-        // This is for profiling only
-        // for(;;) {
-        //     transition_time = d.elapsedCycles();
-        //     if( pinRead() || transition_time > tSLOT * CPU_FREQUENCY_MHZ ) 
-        //         break;
-        // }
-        d.waitUntilMicros( tRDV );
-        r = pinRead();
-    } timeCriticalExit();
-
-    // profile_onewire.profileRun( transition_time );
-    d.waitUntilMicros( tSLOT );
-
-    // return transition_time < tRDV * CPU_FREQUENCY_MHZ;
-    return r;
+    uint16_t crc = 0;
+    return read_bit_crc(crc, 0);
 }
 
-void OneWire::write( uint8_t v, bool parasite ) {
-    uint8_t bitMask;
+bool OneWire::read_bit_crc(uint16_t& crc, uint16_t poly)
+{
+    return read_bit_t( OneWirePinMask{ bitmask }, crc, poly );
+}
 
-    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
-	OneWire::write_bit( (bitMask & v)?1:0);
-    }
+void OneWire::write_byte(uint8_t v)
+{
+    write_byte_t( OneWirePinMask{ bitmask }, v );
+}
+
+uint8_t OneWire::read_byte(uint16_t& crc, uint16_t poly)
+{
+    return read_byte_t( OneWirePinMask{ bitmask }, crc, poly );
+}
+
+void OneWire::yield_tail(uint32_t)
+{
+#ifndef FASTMILLIS_HOST
+    taskYIELD();
+#endif
+}
+
+void OneWire::sleep_tail(uint32_t cycles)
+{
+    hybridDelayMicroseconds(cycles / FASTCYCLES_MHZ);
+}
+
+void OneWire::write( uint8_t v, bool parasite ) {
+    write_byte( v );
 	pinInput();
 	pinLow();
 }
@@ -318,13 +382,8 @@ void OneWire::write_bytes(const uint8_t *buf, uint16_t count, bool parasite ) {
 // Read a byte
 //
 uint8_t OneWire::read() {
-    uint8_t bitMask;
-    uint8_t r = 0;
-
-    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
-	if ( OneWire::read_bit()) r |= bitMask;
-    }
-    return r;
+    uint16_t crc = 0;
+    return read_byte( crc, 0 );
 }
 
 void OneWire::read_bytes(uint8_t *buf, uint16_t count) {
@@ -332,6 +391,20 @@ void OneWire::read_bytes(uint8_t *buf, uint16_t count) {
     buf[i] = read();
 }
 
+void OneWire::read_bytes_crc(uint8_t *buf, uint16_t count, OneWireCRC8& crc) {
+    uint16_t c = crc.value;
+    for (uint16_t i = 0 ; i < count ; i++)
+        buf[i] = read_byte(c, 0x8C);
+    crc.value = c;
+}
+
+void OneWire::read_bytes_crc(uint8_t *buf, uint16_t count, OneWireCRC16& crc) {
+    uint16_t c = crc.value;
+    for (uint16_t i = 0 ; i < count ; i++)
+        buf[i] = read_byte(c, 0xA001);
+    crc.value = c;
+}
+
 //
 // Do a ROM select
 //
@@ -352,6 +425,19 @@ void OneWire::skip()
     write(0xCC);           // Skip ROM
 }
 
+void OneWire::overdrive_skip()
+{
+    write(0x3C);           // Overdrive Skip ROM, at standard speed
+    set_timing( OneWireTiming::overdrive );
+}
+
+void OneWire::overdrive_select(const uint8_t rom[8])
+{
+    write(0x69);           // Overdrive Match ROM, at standard speed
+    set_timing( OneWireTiming::overdrive );
+    for (uint8_t i = 0; i < 8; i++) write(rom[i]);     // ROM at overdrive speed
+}
+
 #if ONEWIRE_SEARCH
 
 //
@@ -523,56 +609,12 @@ bool OneWire::search(uint8_t *newAddr, bool search_mode /* = true */)
 // "Understanding and Using Cyclic Redundancy Checks with Maxim iButton Products"
 //
 
-#if ONEWIRE_CRC8_TABLE
-// Dow-CRC using polynomial X^8 + X^5 + X^4 + X^0
-// Tiny 2x16 entry CRC table created by Arjen Lentz
-// See http://lentz.com.au/blog/calculating-crc-with-a-tiny-32-entry-lookup-table
-static const uint8_t PROGMEM dscrc2x16_table[] = {
-	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
-	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
-	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
-	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
-};
-
 // Compute a Dallas Semiconductor 8 bit CRC. These show up in the ROM
-// and the registers.  (Use tiny 2x16 entry CRC table)
+// and the registers.  The variant is picked by ONEWIRE_CRC8_TABLE.
 uint8_t OneWire::crc8(const uint8_t *addr, uint8_t len)
 {
-	uint8_t crc = 0;
-
-	while (len--) {
-		crc = *addr++ ^ crc;  // just re-using crc as intermediate
-		crc = pgm_read_byte(dscrc2x16_table + (crc & 0x0f)) ^
-		pgm_read_byte(dscrc2x16_table + 16 + ((crc >> 4) & 0x0f));
-	}
-
-	return crc;
+	return onewire_crc::crc8(addr, len);
 }
-#else
-//
-// Compute a Dallas Semiconductor 8 bit CRC pinly.
-// this is much slower, but a little smaller, than the lookup table.
-//
-uint8_t OneWire::crc8(const uint8_t *addr, uint8_t len)
-{
-	uint8_t crc = 0;
-
-	while (len--) {
-#if defined(__AVR__)
-		crc = _crc_ibutton_update(crc, *addr++);
-#else
-		uint8_t inbyte = *addr++;
-		for (uint8_t i = 8; i; i--) {
-			uint8_t mix = (crc ^ inbyte) & 0x01;
-			crc >>= 1;
-			if (mix) crc ^= 0x8C;
-			inbyte >>= 1;
-		}
-#endif
-	}
-	return crc;
-}
-#endif
 
 #if ONEWIRE_CRC16
 bool OneWire::check_crc16(const uint8_t* input, uint16_t len, const uint8_t* inverted_crc, uint16_t crc)
@@ -583,31 +625,7 @@ bool OneWire::check_crc16(const uint8_t* input, uint16_t len, const uint8_t* inv
 
 uint16_t OneWire::crc16(const uint8_t* input, uint16_t len, uint16_t crc)
 {
-#if defined(__AVR__)
-    for (uint16_t i = 0 ; i < len ; i++) {
-        crc = _crc16_update(crc, input[i]);
-    }
-#else
-    static const uint8_t oddparity[16] =
-        { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0 };
-
-    for (uint16_t i = 0 ; i < len ; i++) {
-      // Even though we're just copying a byte from the input,
-      // we'll be doing 16-bit computation with it.
-      uint16_t cdata = input[i];
-      cdata = (cdata ^ crc) & 0xff;
-      crc >>= 8;
-
-      if (oddparity[cdata & 0x0F] ^ oddparity[cdata >> 4])
-          crc ^= 0xC001;
-
-      cdata <<= 6;
-      crc ^= cdata;
-      cdata <<= 1;
-      crc ^= cdata;
-    }
-#endif
-    return crc;
+    return onewire_crc::crc16(input, len, crc);
 }
 #endif
 
@@ -2,8 +2,14 @@
 #define OneWire_h
 
 #include <stdint.h>
+#ifdef FASTMILLIS_HOST
+#include "OneWireSim.h"     // simulated GPIO and buses
+#else
 #include <Arduino.h>       // for delayMicroseconds, digitalPinToBitMask, etc
 #include <driver/rtc_io.h>
+#endif
+#include "OneWireCRC.h"
+#include "fastmillis.h"
 
 // You can exclude certain features from OneWire.  In theory, this
 // might save some space.  In practice, the compiler automatically
@@ -26,25 +32,78 @@
 #endif
 
 // Select the table-lookup method of computing the 8-bit CRC
-// by setting this to 1.  The lookup table enlarges code size by
-// about 250 bytes.  It does NOT consume RAM (but did in very
-// old versions of OneWire).  If you disable this, a slower
-// but very compact algorithm is used.
+// by setting this to 1 (2x16 byte table) or 2 (256 byte table,
+// fastest).  The lookup table does NOT consume RAM (but did in
+// very old versions of OneWire).  If you disable this, a slower
+// but very compact algorithm is used.  See OneWireCRC.h.
 #ifndef ONEWIRE_CRC8_TABLE
 #define ONEWIRE_CRC8_TABLE 1
 #endif
 
+// Set to 1 to run calibrate() in begin(), see below
+#ifndef ONEWIRE_CALIBRATE
+#define ONEWIRE_CALIBRATE 0
+#endif
+
 // You can allow 16-bit CRC checks by defining this to 1
 // (Note that ONEWIRE_CRC must also be 1.)
 #ifndef ONEWIRE_CRC16
 #define ONEWIRE_CRC16 1
 #endif
 
+// Set to 1 to compute the 16-bit CRC with a 512 byte table instead
+// of the 16 byte parity table.
+#ifndef ONEWIRE_CRC16_TABLE
+#define ONEWIRE_CRC16_TABLE 0
+#endif
+
+// Slot timings of one bus speed, in ns. OneWire converts them to
+// fastcycles() ticks, so sub-µs values are fine.
+struct OneWireTiming
+{
+    uint32_t rstl;          // reset low time
+    uint32_t apu;           // active pull-up after the reset pulse
+    uint32_t pdsample;      // presence sample, from the start of the reset pulse
+    uint32_t rsth;          // presence sample to end of the reset sequence
+    uint32_t low0;          // write 0 low time
+    uint32_t low1;          // write 1 low time
+    uint32_t slot;          // slot length, including recovery
+    uint32_t drive_low;     // read slot low time
+    uint32_t rdv;           // read sample, from the start of the slot
+
+    // Profiles
+    static const OneWireTiming standard;    // 15kbit/s, the default
+    static const OneWireTiming overdrive;   // ~100kbit/s, after overdrive_skip()/overdrive_select()
+    static const OneWireTiming long_line;   // standard speed with more margin for long cables
+};
+
+// What calibrate() measured on a bus.
+struct OneWireCalibration
+{
+    uint32_t rise_ns;       // release to high, slowest seen
+    uint32_t hold_ns;       // start of a read slot to a device releasing its 0, shortest seen
+    bool     ok;            // timings were adjusted
+};
+
 class OneWire
 {
   private:
+    friend class OneWireAsync;
+
     uint32_t pin, bitmask;
 
+    OneWireTiming profile_ns;       // as given to set_timing()
+    OneWireTiming timing_ns;        // in use, profile_ns adjusted by calibrate()
+    OneWireTiming timing_cycles;    // same, in fastcycles() ticks
+
+    OneWireCalibration cal = { 0, 0, false };
+    uint32_t calibration_period = 0;
+    uint32_t calibration_due = 0;
+    bool calibrating = false;
+
+    bool preemptible = false;
+    void (*tail_hook)(uint32_t cycles) = nullptr;
+
 #if ONEWIRE_SEARCH
     // global search state
     unsigned char ROM_NO[8];
@@ -56,12 +115,18 @@ class OneWire
   public:
     OneWire() { }
     OneWire(uint8_t pin) { begin(pin); }
+    virtual ~OneWire() { }
+
+    // GPIO 0-31, see OneWireT for the others.
     void begin(uint8_t pin);
 
+    // IO_MUX setup for a 1-Wire pin, done by begin().
+    static void setup_pin(uint8_t pin);
+
     // Perform a 1-Wire reset cycle. Returns 1 if a device responds
     // with a presence pulse.  Returns 0 if there is no device or the
     // bus is shorted or otherwise held low for more than 250uS
-    bool reset(void);
+    virtual bool reset(void);
 
     // Issue a 1-Wire rom select command, you do the reset first.
     void select(const uint8_t rom[8]);
@@ -69,6 +134,35 @@ class OneWire
     // Issue a 1-Wire rom skip command, to address all on bus.
     void skip(void);
 
+    // Slot timings, OneWireTiming::standard after begin(). Devices must
+    // be at the same speed: see below for overdrive.
+    void set_timing(const OneWireTiming& t);
+    const OneWireTiming& timing() const { return timing_ns; }
+
+    // Measures this bus and tightens the profile set by set_timing() to it:
+    // the rise time after a release (in write 1 slots), and how long the
+    // devices hold a 0 (in the first two read slots of a Search ROM). Read
+    // slots are then sampled right after a 1 has risen, and slots end right
+    // after the slowest low phase has risen, plus margin_ns, instead of the
+    // worst case for any cable. Costs about 3 resets and 20 slots.
+    // margin_ns=0 picks 1/40 of the profile slot time (2µs at standard speed).
+    // Returns false and keeps the profile if there is no device, the bus
+    // doesn't rise within a slot, or the margins don't fit.
+    bool calibrate(uint32_t margin_ns = 0);
+    const OneWireCalibration& calibration() const { return cal; }
+
+    // Run calibrate() again from reset(), at most every period_ms. 0 = never.
+    void set_calibration_period(uint32_t period_ms);
+
+    // Overdrive Skip ROM (0x3C) and Overdrive Match ROM (0x69): like
+    // skip()/select(), but the addressed devices that support overdrive
+    // switch to it, and so does this bus. Send them after a reset at
+    // standard speed. Following resets are overdrive resets, which keep
+    // the devices in overdrive. To go back: set_timing(OneWireTiming::standard)
+    // and reset(), as a standard reset returns all devices to standard speed.
+    void overdrive_skip();
+    void overdrive_select(const uint8_t rom[8]);
+
     // Write a byte.
     void write(uint8_t v, bool parasite=false);
 
@@ -79,13 +173,42 @@ class OneWire
 
     void read_bytes(uint8_t *buf, uint16_t count);
 
+    // read_bytes() that also feeds the CRC, one bit per slot, after the
+    // sample while the slot runs out: the CRC is ready when the last
+    // byte is, instead of taking a pass over the buffer afterwards.
+    void read_bytes_crc(uint8_t *buf, uint16_t count, OneWireCRC8& crc);
+    void read_bytes_crc(uint8_t *buf, uint16_t count, OneWireCRC16& crc);
+
     // Write a bit. The bus is always left powered at the end, see
     // note in write() about that.
-    void write_bit(uint8_t v);
+    virtual void write_bit(uint8_t v);
 
     // Read a bit.
     bool read_bit(void);
 
+    // By default every slot keeps interrupts off from its falling edge
+    // to its release (to the sample for a read), then spins until the
+    // slot ends: 480µs for a reset, 60µs for a write 0.
+    //
+    // Preemptible, only the edges that have a maximum are protected: the
+    // reset pulse, which only has a minimum, runs with interrupts on, so
+    // the longest sections are the release to the presence sample (70µs)
+    // and the low phase of a write 0, which must not pass tLOW0 max. The
+    // end of each slot, the recovery, has no maximum: tail(cycles left)
+    // is called there, if set, and may run other work or yield (see
+    // yield_tail), for longer than the slot if it must; the bus just runs
+    // slower.
+    void set_preemptible(bool on, void (*tail)(uint32_t cycles) = nullptr) {
+        preemptible = on;
+        tail_hook = on ? tail : nullptr;
+    }
+
+    // A tail that lets other tasks of the same priority run.
+    static void yield_tail(uint32_t cycles);
+    // A tail that blocks until the end of the slot, see
+    // hybridDelayMicroseconds(): tasks of any priority run meanwhile.
+    static void sleep_tail(uint32_t cycles);
+
 #if ONEWIRE_SEARCH
     // Clear the search state so that if will start from the beginning again.
     void reset_search();
@@ -147,7 +270,42 @@ class OneWire
 #endif
 #endif
 
-    private:
+  protected:
+    void init(uint8_t pin);
+
+    // The bit slots, virtual so OneWireT can run them with a constant
+    // pin. Everything else is built on these.
+    virtual bool read_bit_crc(uint16_t& crc, uint16_t poly);
+    virtual void write_byte(uint8_t v);
+    virtual uint8_t read_byte(uint16_t& crc, uint16_t poly);
+    virtual int measure_rise();
+    virtual int measure_read_slot();
+
+    // Their code, for any pin access class: see OneWire_slots.h
+    template<class P> bool reset_t(P p);
+    template<class P> void write_bit_t(P p, uint8_t v);
+    template<class P> void write_byte_t(P p, uint8_t v);
+    template<class P> void write_slot_t(P p, MultiDelay& d, uint32_t low);
+    template<class P> bool read_bit_t(P p, uint16_t& crc, uint16_t poly);
+    template<class P> uint8_t read_byte_t(P p, uint16_t& crc, uint16_t poly);
+    template<class P> bool read_slot_t(P p, MultiDelay& d);
+    template<class P> int measure_rise_t(P p);
+    template<class P> int measure_read_slot_t(P p);
+
+    // Waits for the end of a slot, handing the time to tail_hook.
+    inline __attribute__((always_inline))
+    void slot_tail(MultiDelay& d, uint32_t end) {
+        if (tail_hook) {
+            int left = (int)end - d.elapsedCycles();
+            if (left > 0)
+                tail_hook(left);
+        }
+        d.waitUntilCycles(end);
+    }
+
+  private:
+    void apply_timing(const OneWireTiming& t);
+
     inline __attribute__((always_inline))
     bool pinRead() {
         return GPIO.in & bitmask;
@@ -176,4 +334,33 @@ class OneWire
     }
 };
 
+#include "OneWire_slots.h"
+
+// OneWire on a pin fixed at compile time. The slots access the GPIO
+// registers with a constant mask, picking the bank (GPIO.in or GPIO.in1,
+// out_w1ts or out1_w1ts...) at compile time: fewer instructions between
+// the edges and the sample, and GPIO 32-33 work too.
+//
+//    OneWireT<33> ow;
+//
+// OneWireAsync drives the pin through OneWire's run time mask, so it
+// needs a pin below 32.
+template<uint8_t Pin>
+class OneWireT : public OneWire
+{
+  public:
+    OneWireT() { begin(); }
+    void begin() { init(Pin); }
+
+    bool reset(void) override { return reset_t( OneWirePin<Pin>() ); }
+    void write_bit(uint8_t v) override { write_bit_t( OneWirePin<Pin>(), v ); }
+
+  protected:
+    bool read_bit_crc(uint16_t& crc, uint16_t poly) override { return read_bit_t( OneWirePin<Pin>(), crc, poly ); }
+    void write_byte(uint8_t v) override { write_byte_t( OneWirePin<Pin>(), v ); }
+    uint8_t read_byte(uint16_t& crc, uint16_t poly) override { return read_byte_t( OneWirePin<Pin>(), crc, poly ); }
+    int measure_rise() override { return measure_rise_t( OneWirePin<Pin>() ); }
+    int measure_read_slot() override { return measure_read_slot_t( OneWirePin<Pin>() ); }
+};
+
 #endif // OneWire_h
@@ -0,0 +1,336 @@
+// Interrupt-driven 1-Wire engine, see OneWireAsync.h
+//
+// 2022 - peufeu, same license as OneWire.cpp
+
+#include "config.h"
+#ifndef FASTMILLIS_HOST
+#include <Arduino.h>
+#endif
+#include <string.h>
+#include "OneWireAsync.h"
+#include "fastmillis.h"
+#include "trace.h"
+#include "OneWire_timing.h"
+
+// Delay before the first edge of a transfer, so the alarm is in the future
+// when we arm it.
+#define tSTART 5
+
+static OneWireAsync* engines[4];
+
+#ifndef FASTMILLIS_HOST
+static void IRAM_ATTR onewire_async_isr0() { engines[0]->on_alarm(); }
+static void IRAM_ATTR onewire_async_isr1() { engines[1]->on_alarm(); }
+static void IRAM_ATTR onewire_async_isr2() { engines[2]->on_alarm(); }
+static void IRAM_ATTR onewire_async_isr3() { engines[3]->on_alarm(); }
+static void (*const isr_for[4])() = {
+    onewire_async_isr0, onewire_async_isr1, onewire_async_isr2, onewire_async_isr3 };
+#endif
+
+OneWireAsync::OneWireAsync(OneWire& _ow, uint8_t _timer_num)
+    : ow(_ow), timer_num(_timer_num)
+{
+}
+
+bool OneWireAsync::begin()
+{
+    if (timer_num >= 4 || engines[timer_num] || !ow.bitmask)
+        return false;           // timer taken, or pin >= 32
+#ifndef FASTMILLIS_HOST
+    timer = timerBegin(timer_num, 80, true);    // 1MHz, like TIMG0_T0
+    if (!timer)
+        return false;
+#endif
+    // the alarm isn't enabled until a transfer starts
+    engines[timer_num] = this;
+#ifndef FASTMILLIS_HOST
+    timerAttachInterrupt(timer, isr_for[timer_num], true);
+#endif
+    return true;
+}
+
+void OneWireAsync::end()
+{
+    if (timer_num >= 4 || engines[timer_num] != this)
+        return;
+#ifndef FASTMILLIS_HOST
+    timerAlarmDisable(timer);
+    timerDetachInterrupt(timer);
+    timerEnd(timer);
+    timer = nullptr;
+#endif
+    if (state != IDLE) {
+        ow.pinInput();
+        TRACE_END( "onewire.async" );
+        state = IDLE;
+    }
+    engines[timer_num] = nullptr;
+}
+
+uint64_t IRAM_ATTR OneWireAsync::now()
+{
+#ifdef FASTMILLIS_HOST
+    return fastmicros64();
+#else
+    return timerRead(timer);
+#endif
+}
+
+void IRAM_ATTR OneWireAsync::arm(uint64_t at)
+{
+    alarm_at = at;
+#ifndef FASTMILLIS_HOST
+    timerAlarmWrite(timer, at, false);
+    timerAlarmEnable(timer);
+#endif
+}
+
+bool OneWireAsync::start(State s)
+{
+    if (state != IDLE)
+        return false;
+    TRACE_BEGIN_V( "onewire.async", s );
+    index = 0;
+    mask = 1;
+    phase = SLOT_START;
+    state = s;
+    slot_start = now() + tSTART;
+    arm(slot_start);
+    return true;
+}
+
+bool OneWireAsync::start_reset()
+{
+    if (busy())
+        return false;
+    // wait until the wire is high... just in case
+    ow.pinInput();
+    unsigned retries = 125;
+    while (!ow.pinRead()) {
+        if (--retries == 0) {
+            presence_pulse = false;
+            return false;
+        }
+        delayMicroseconds(2);
+    }
+    count = 1;
+    return start(RESET);
+}
+
+bool OneWireAsync::start_write(const uint8_t* buf, uint16_t _count)
+{
+    if (busy())
+        return false;
+    wbuf = buf;
+    count = _count;
+    return count ? start(WRITE) : true;
+}
+
+bool OneWireAsync::start_write_byte(uint8_t v)
+{
+    if (busy())
+        return false;
+    one_byte = v;
+    return start_write(&one_byte, 1);
+}
+
+bool OneWireAsync::start_read(uint8_t* buf, uint16_t _count)
+{
+    if (busy())
+        return false;
+    rbuf = buf;
+    count = _count;
+    return count ? start(READ) : true;
+}
+
+// Arms the start of the next slot, tSLOT after this one, but no earlier
+// than "free": if this slot started late, the next one doesn't start
+// before the bus has recovered, and on_alarm() doesn't run it right away.
+void IRAM_ATTR OneWireAsync::arm_next_slot(uint64_t free)
+{
+    uint64_t at = slot_start + tSLOT;
+    arm(at > free ? at : free);
+}
+
+// Moves to the next bit, returns false when the transfer is over.
+bool IRAM_ATTR OneWireAsync::next_bit()
+{
+    mask <<= 1;
+    if (!mask) {
+        mask = 1;
+        index++;
+    }
+    return index < count;
+}
+
+// Runs the state machine for every edge that is due. Normally that's one
+// step per interrupt, but if we were so late that the next edge is already
+// due, the alarm would only fire after the counter wraps, so do it now.
+void IRAM_ATTR OneWireAsync::on_alarm()
+{
+    do {
+        step();
+    } while (state != IDLE && now() >= alarm_at);
+}
+
+// One step of the state machine, at alarm time.
+void IRAM_ATTR OneWireAsync::step()
+{
+    switch (phase) {
+    case SLOT_START:
+        slot_start = alarm_at;
+        if (index >= count) {
+            // done, leave the bus like OneWire::write() does
+            ow.pinInput();
+            ow.pinLow();
+#ifndef FASTMILLIS_HOST
+            timerAlarmDisable(timer);
+#endif
+            TRACE_END( "onewire.async" );
+            state = IDLE;
+            return;
+        }
+        if (state == RESET) {
+            // time the pulse from the edge, however late this interrupt is
+            timeCriticalEnter() {
+                edge = now();
+                ow.pinLow();
+                ow.pinOutput();
+            } timeCriticalExit();
+            phase = RESET_RELEASE;
+            arm(edge + tRSTL);
+        } else if (state == WRITE) {
+            // A write 0 must not stay low past 120µs: interrupt latency
+            // can't be allowed in its low phase, so spin through it too.
+            uint32_t low = (wbuf[index] & mask) ? tLOW1 : tLOW0;
+            uint64_t t;
+            MultiDelay d;
+            timeCriticalEnter() {
+                t = now();
+                d.reset();
+                ow.pinLow();
+                ow.pinOutput();
+                d.waitUntilMicros( low );
+                ow.pinInput();
+            } timeCriticalExit();
+            next_bit();
+            arm_next_slot(t + low + tREC);
+        } else {
+            bool r;
+            uint64_t t;
+            MultiDelay d;
+            timeCriticalEnter() {
+                t = now();
+                d.reset();
+                ow.pinOutput();
+                ow.pinLow();
+                d.waitUntilMicros( tDRIVElow );
+                ow.pinInput();
+                d.waitUntilMicros( tRDV );
+                r = ow.pinRead();
+            } timeCriticalExit();
+            if (mask == 1)
+                rbuf[index] = 0;
+            if (r)
+                rbuf[index] |= mask;
+            next_bit();
+            arm_next_slot(t + tLOW0 + tREC);    // a device may hold a 0 that long
+        }
+        break;
+
+    case RESET_RELEASE: {
+        // The devices time their presence pulse from the release, which
+        // is as late as this interrupt was: sample from there.
+        MultiDelay d;
+        timeCriticalEnter() {
+            d.reset();
+            edge = now();
+            ow.pinHigh();
+            d.waitUntilMicros( tAPU );  // active pullup
+            ow.pinInput();
+        } timeCriticalExit();
+        phase = RESET_SAMPLE;
+        arm(edge + tPDSAMPLE - tRSTL);
+        break;
+    }
+
+    case RESET_SAMPLE:
+        presence_pulse = !ow.pinRead();
+        phase = RESET_DONE;
+        arm(edge + tPDSAMPLE - tRSTL + tRSTH);
+        break;
+
+    case RESET_DONE:
+        // alarm_at is now: on_alarm() finishes right away
+        index = count;
+        phase = SLOT_START;
+        break;
+    }
+}
+
+bool OneWireAsync::poll()
+{
+#ifdef FASTMILLIS_HOST
+    // no interrupts on the host: run the state machine when it is due
+    if (state != IDLE && now() >= alarm_at)
+        on_alarm();
+#endif
+    return state == IDLE;
+}
+
+void OneWireAsync::wait()
+{
+    while (!poll()) {
+#ifdef FASTMILLIS_HOST
+        uint64_t t = fastmicros64();
+        if (!fastmillis_host::realtime() && alarm_at > t)
+            fastmillis_host::advance_us(alarm_at - t);
+#endif
+    }
+}
+
+bool OneWireAsync::reset()
+{
+    if (!start_reset())
+        return false;
+    wait();
+    return presence_pulse;
+}
+
+void OneWireAsync::write(uint8_t v)
+{
+    start_write_byte(v);
+    wait();
+}
+
+void OneWireAsync::write_bytes(const uint8_t* buf, uint16_t count)
+{
+    start_write(buf, count);
+    wait();
+}
+
+uint8_t OneWireAsync::read()
+{
+    start_read(&one_byte, 1);
+    wait();
+    return one_byte;
+}
+
+void OneWireAsync::read_bytes(uint8_t* buf, uint16_t count)
+{
+    start_read(buf, count);
+    wait();
+}
+
+void OneWireAsync::select(const uint8_t rom[8])
+{
+    uint8_t buf[9];
+    buf[0] = 0x55;          // Choose ROM
+    memcpy(buf+1, rom, 8);
+    write_bytes(buf, 9);
+}
+
+void OneWireAsync::skip()
+{
+    write(0xCC);            // Skip ROM
+}
@@ -0,0 +1,112 @@
+#ifndef OneWireAsync_h
+#define OneWireAsync_h
+
+#include "OneWire.h"
+
+// Interrupt-driven 1-Wire engine.
+//
+// OneWire busy-waits through every 80µs slot. Here a hardware timer alarm
+// walks a bit-slot state machine instead: the ISR drives the edges (and
+// spins between the ones that have a maximum: up to the sample of a read
+// slot, tRDV=18µs, and through the low phase of a write slot, which must
+// not pass 120µs for a 0), then arms the alarm for the next edge and
+// returns. The CPU is free during the recovery at the end of each slot,
+// the reset pulse and the presence wait, most of the bus time.
+//
+// Edges are scheduled on absolute timer values, so interrupt latency
+// delays an edge but doesn't accumulate over the transfer. A slot that
+// started late pushes the next one back, so that it still gets tREC of
+// recovery.
+//
+//    OneWireAsync ow_async( ow );      // uses hardware timer 2 (TIMG1_T0)
+//    ow_async.begin();
+//    ow_async.start_reset();
+//    while( !ow_async.poll() ) do_something_else();
+//    if( ow_async.presence() ) ...
+//
+// One transfer at a time, buffers must stay valid until poll() returns
+// true. The blocking functions at the end start a transfer and wait, for
+// code that wants the same API as OneWire.
+//
+// On the host backend there is no timer interrupt: poll() and wait() run
+// the state machine when the simulated alarm time is reached.
+
+class OneWireAsync
+{
+  public:
+    // timer_num: Arduino hardware timer. 0 and 1 are used by fastmillis.
+    OneWireAsync(OneWire& ow, uint8_t timer_num = 2);
+    ~OneWireAsync() { end(); }
+
+    // Sets up the timer and its interrupt. Returns false if the timer
+    // can't be used, or if the pin is 32 or above.
+    bool begin();
+
+    // Aborts any transfer, frees the timer and its interrupt. begin()
+    // may be called again, on this engine or another one on the timer.
+    void end();
+
+    // Start a transfer. Returns false if one is already running.
+    bool start_reset();
+    bool start_write(const uint8_t* buf, uint16_t count);
+    bool start_write_byte(uint8_t v);
+    bool start_read(uint8_t* buf, uint16_t count);
+
+    // true once the current transfer is complete (or if there is none).
+    bool poll();
+    bool busy() const { return state != IDLE; }
+
+    // Wait for the current transfer to complete.
+    void wait();
+
+    // Result of the last reset: true if a device answered.
+    bool presence() const { return presence_pulse; }
+
+    // Blocking API, thin wrappers over start_*() + wait()
+    bool reset();
+    void write(uint8_t v);
+    void write_bytes(const uint8_t* buf, uint16_t count);
+    uint8_t read();
+    void read_bytes(uint8_t* buf, uint16_t count);
+    void select(const uint8_t rom[8]);
+    void skip();
+
+    // Called from the timer interrupt, public only for the trampolines.
+    void on_alarm();
+
+  private:
+    enum State : uint8_t { IDLE, RESET, WRITE, READ };
+    enum Phase : uint8_t {
+        SLOT_START,         // begin the next slot (or finish)
+        RESET_RELEASE,      // end of the reset pulse
+        RESET_SAMPLE,       // sample the presence pulse
+        RESET_DONE,         // end of the presence pulse
+    };
+
+    OneWire&        ow;
+    uint8_t         timer_num;
+    hw_timer_t*     timer = nullptr;
+
+    volatile State  state = IDLE;
+    Phase           phase = SLOT_START;
+    uint64_t        slot_start = 0;     // timer value at the start of the current slot
+    uint64_t        alarm_at = 0;
+    uint64_t        edge = 0;           // timer value at the last edge of a reset
+
+    const uint8_t*  wbuf = nullptr;
+    uint8_t*        rbuf = nullptr;
+    uint16_t        count = 0;
+    uint16_t        index = 0;          // current byte
+    uint8_t         mask = 0;           // current bit
+    uint8_t         one_byte = 0;       // buffer for write()/read()
+    bool            presence_pulse = false;
+
+    bool start(State s);
+    void step();
+    bool next_bit();
+    void arm(uint64_t at);
+    void arm_next_slot(uint64_t free);
+    uint64_t now();
+};
+
+#endif // OneWireAsync_h
@@ -0,0 +1,88 @@
+#ifndef OneWireCRC_h
+#define OneWireCRC_h
+
+#include <stdint.h>
+
+// Dallas CRC8 (X^8 + X^5 + X^4 + 1) and CRC16 (X^16 + X^15 + X^2 + 1).
+// Both are reflected: bits go in LSB first, the order they come off the
+// bus, so a CRC can also be updated one bit per read slot.
+//
+// Every variant is here. OneWire::crc8() and crc16() use the one picked
+// by ONEWIRE_CRC8_TABLE and ONEWIRE_CRC16_TABLE (see OneWire.h), and with
+// -ffunction-sections the linker drops the others.
+//
+//   crc8_bitwise     8 shifts per byte, no table
+//   crc8_nibble      2x16 byte table       ONEWIRE_CRC8_TABLE 1 (default)
+//   crc8_table       256 byte table        ONEWIRE_CRC8_TABLE 2
+//   crc16_bitwise    8 shifts per byte, no table
+//   crc16_parity     16 byte parity table  ONEWIRE_CRC16_TABLE 0 (default)
+//   crc16_table      512 byte table        ONEWIRE_CRC16_TABLE 1
+//
+// extras/onewire_crc_bench.cpp measures them in bytes per cycle.
+
+namespace onewire_crc {
+
+uint8_t crc8_bitwise(const uint8_t* p, uint16_t len, uint8_t crc = 0);
+uint8_t crc8_nibble(const uint8_t* p, uint16_t len, uint8_t crc = 0);
+uint8_t crc8_table(const uint8_t* p, uint16_t len, uint8_t crc = 0);
+uint16_t crc16_bitwise(const uint8_t* p, uint16_t len, uint16_t crc = 0);
+uint16_t crc16_parity(const uint8_t* p, uint16_t len, uint16_t crc = 0);
+uint16_t crc16_table(const uint8_t* p, uint16_t len, uint16_t crc = 0);
+
+// The configured variants.
+uint8_t crc8(const uint8_t* p, uint16_t len, uint8_t crc = 0);
+uint16_t crc16(const uint8_t* p, uint16_t len, uint16_t crc = 0);
+
+// One bit, branchless: a few instructions, cheap enough to run in the
+// recovery time of a read slot.
+static inline uint8_t crc8_bit(uint8_t crc, bool bit)
+{
+    return (crc >> 1) ^ (-((crc ^ bit) & 1) & 0x8C);
+}
+
+static inline uint16_t crc16_bit(uint16_t crc, bool bit)
+{
+    return (crc >> 1) ^ (-((crc ^ bit) & 1) & 0xA001);
+}
+
+}
+
+// Incremental CRCs, for data that arrives in pieces. Feed the data then
+// the CRC bytes as received: valid() is true if they match.
+//
+//    OneWireCRC8 crc;
+//    ow.read_bytes_crc( scratchpad, 9, crc );
+//    if( crc.valid() ) ...
+//
+// The CRC16 is sent inverted, which leaves 0xB001 in the register
+// instead of 0.
+
+class OneWireCRC8
+{
+  public:
+    uint8_t value = 0;
+
+    void reset() { value = 0; }
+    void update(uint8_t b) { value = onewire_crc::crc8(&b, 1, value); }
+    void update(const uint8_t* p, uint16_t len) { value = onewire_crc::crc8(p, len, value); }
+    void update_bit(bool bit) { value = onewire_crc::crc8_bit(value, bit); }
+    bool valid() const { return value == 0; }
+};
+
+class OneWireCRC16
+{
+  public:
+    static const uint16_t RESIDUE = 0xB001;
+
+    uint16_t value;
+
+    explicit OneWireCRC16(uint16_t init = 0) : value(init) { }
+
+    void reset(uint16_t init = 0) { value = init; }
+    void update(uint8_t b) { value = onewire_crc::crc16(&b, 1, value); }
+    void update(const uint8_t* p, uint16_t len) { value = onewire_crc::crc16(p, len, value); }
+    void update_bit(bool bit) { value = onewire_crc::crc16_bit(value, bit); }
+    bool valid() const { return value == RESIDUE; }
+};
+
+#endif // OneWireCRC_h
@@ -0,0 +1,319 @@
+// Device table and incremental discovery, see OneWireDeviceTable.h
+//
+// 2022 - peufeu, same license as OneWire.cpp
+
+#include "config.h"
+#ifndef FASTMILLIS_HOST
+#include <Arduino.h>
+#include <Preferences.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include "OneWireDeviceTable.h"
+
+// Search bit i (ROM bit i) is key bit 63-i.
+#define KEY_BIT(i) (uint64_t(1) << (63 - (i)))
+
+void OneWireDeviceTable::begin(OneWire& _ow)
+{
+    ow = &_ow;
+    clear();
+}
+
+uint64_t OneWireDeviceTable::rom_to_key(const uint8_t rom[8])
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 64; i++)
+        if (rom[i >> 3] & (1 << (i & 7)))
+            key |= KEY_BIT(i);
+    return key;
+}
+
+void OneWireDeviceTable::key_to_rom(uint64_t key, uint8_t rom[8])
+{
+    memset(rom, 0, 8);
+    for (int i = 0; i < 64; i++)
+        if (key & KEY_BIT(i))
+            rom[i >> 3] |= 1 << (i & 7);
+}
+
+uint16_t OneWireDeviceTable::lower_bound(uint64_t key) const
+{
+    uint16_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if (entries[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int OneWireDeviceTable::find(const uint8_t rom[8]) const
+{
+    uint64_t key = rom_to_key(rom);
+    uint16_t i = lower_bound(key);
+    return i < n && entries[i].key == key ? i : -1;
+}
+
+// Is there a known device whose first "bits" search bits are those of key?
+bool OneWireDeviceTable::has_prefix(uint64_t key, uint8_t bits) const
+{
+    if (!bits)
+        return n > 0;
+    uint64_t mask = ~uint64_t(0) << (64 - bits);
+    uint16_t i = lower_bound(key & mask);
+    return i < n && (entries[i].key & mask) == (key & mask);
+}
+
+bool OneWireDeviceTable::insert(uint64_t key)
+{
+    uint16_t i = lower_bound(key);
+    if (i < n && entries[i].key == key) {
+        entries[i].misses = 0;
+        return false;
+    }
+    if (n == ONEWIRE_TABLE_SIZE) {
+        overflows++;
+        return false;
+    }
+    memmove(&entries[i+1], &entries[i], (n - i) * sizeof(Entry));
+    entries[i].key = key;
+    entries[i].misses = 0;
+    n++;
+    if (cursor > i)
+        cursor++;
+    added++;
+    if (on_change) {
+        uint8_t r[8];
+        key_to_rom(key, r);
+        on_change(r, true);
+    }
+    return true;
+}
+
+void OneWireDeviceTable::remove(uint16_t i)
+{
+    uint64_t key = entries[i].key;
+    memmove(&entries[i], &entries[i+1], (n - i - 1) * sizeof(Entry));
+    n--;
+    if (cursor > i)
+        cursor--;
+    removed++;
+    if (on_change) {
+        uint8_t r[8];
+        key_to_rom(key, r);
+        on_change(r, false);
+    }
+}
+
+// Search ROM along key. Returns how many bits the device answered (64 if
+// it is there), and sets in "others" the bits where some device took the
+// other branch.
+uint8_t OneWireDeviceTable::walk(uint64_t key, uint64_t& others)
+{
+    others = 0;
+    if (!ow->reset())
+        return 0;
+    ow->write(0xF0);                // Search ROM
+    for (uint8_t i = 0; i < 64; i++) {
+        bool id_bit = ow->read_bit();
+        bool cmp_id_bit = ow->read_bit();
+        bool want = key & KEY_BIT(i);
+        if (id_bit && cmp_id_bit)
+            return i;               // nobody left
+        if (id_bit != cmp_id_bit) {
+            if (id_bit != want) {
+                others |= KEY_BIT(i);
+                return i;           // only the other branch
+            }
+        } else {
+            others |= KEY_BIT(i);
+        }
+        ow->write_bit(want);
+    }
+    return 64;
+}
+
+// Searches the subtree under the first "bits" bits of prefix, adds what it
+// finds. Same algorithm as OneWire::search(), with the first bits fixed.
+uint16_t OneWireDeviceTable::discover(uint64_t prefix, uint8_t bits)
+{
+    uint16_t found = 0;
+    uint64_t key = prefix;
+    int last_discrepancy = -1;      // none yet: take 0 everywhere
+
+    do {
+        if (!ow->reset())
+            break;
+        ow->write(0xF0);            // Search ROM
+        int last_zero = -1;
+        uint8_t i;
+        for (i = 0; i < 64; i++) {
+            bool id_bit = ow->read_bit();
+            bool cmp_id_bit = ow->read_bit();
+            if (id_bit && cmp_id_bit)
+                break;
+            bool want;
+            if (i < bits) {
+                want = prefix & KEY_BIT(i);
+                if (id_bit != cmp_id_bit && id_bit != want)
+                    break;          // nothing under this prefix
+            } else if (id_bit != cmp_id_bit) {
+                want = id_bit;
+            } else {
+                if (i < last_discrepancy)
+                    want = key & KEY_BIT(i);
+                else
+                    want = i == last_discrepancy;
+                if (!want)
+                    last_zero = i;
+            }
+            if (want)
+                key |= KEY_BIT(i);
+            else
+                key &= ~KEY_BIT(i);
+            ow->write_bit(want);
+        }
+        if (i < 64)
+            break;
+        uint8_t r[8];
+        key_to_rom(key, r);
+        if (OneWire::crc8(r, 7) == r[7] && insert(key))
+            found++;
+        last_discrepancy = last_zero;
+    } while (last_discrepancy >= 0);
+    return found;
+}
+
+uint16_t OneWireDeviceTable::scan()
+{
+    clear();
+    discover(0, 0);
+    return n;
+}
+
+uint16_t OneWireDeviceTable::step()
+{
+    if (!n)
+        return discover(0, 0);
+    if (cursor >= n)
+        cursor = 0;
+
+    uint16_t changes = 0;
+    uint64_t key = entries[cursor].key;
+    uint64_t others;
+    uint8_t depth = walk(key, others);
+
+    // New devices: branches off our path where the table has nobody.
+    for (uint8_t i = 0; i < 64 && i <= depth; i++) {
+        uint64_t other = (key ^ KEY_BIT(i)) & (~uint64_t(0) << (63 - i));
+        if ((others & KEY_BIT(i)) && !has_prefix(other, i + 1))
+            changes += discover(other, i + 1);
+    }
+
+    int idx = lower_bound(key);     // inserts may have moved us
+    if (depth == 64) {
+        entries[idx].misses = 0;
+        cursor = idx + 1;
+    } else if (++entries[idx].misses >= miss_limit) {
+        remove(idx);
+        changes++;
+        cursor = idx;
+    } else {
+        cursor = idx + 1;
+    }
+    return changes;
+}
+
+uint16_t OneWireDeviceTable::serialize(uint8_t* buf, uint16_t size) const
+{
+    uint16_t len = HEADER + n*8 + TRAILER;
+    if (len > size)
+        return 0;
+    memcpy(buf, "OWT", 3);
+    buf[3] = 1;
+    buf[4] = n;
+    buf[5] = n >> 8;
+    for (uint16_t i = 0; i < n; i++)
+        key_to_rom(entries[i].key, buf + HEADER + i*8);
+    uint16_t crc = OneWire::crc16(buf, len - TRAILER);
+    buf[len-2] = crc;
+    buf[len-1] = crc >> 8;
+    return len;
+}
+
+bool OneWireDeviceTable::deserialize(const uint8_t* buf, uint16_t len)
+{
+    clear();
+    if (len < HEADER + TRAILER || memcmp(buf, "OWT", 3) || buf[3] != 1)
+        return false;
+    uint16_t count = buf[4] | (buf[5] << 8);
+    if (count > ONEWIRE_TABLE_SIZE || len != HEADER + count*8 + TRAILER)
+        return false;
+    uint16_t crc = OneWire::crc16(buf, len - TRAILER);
+    if (buf[len-2] != uint8_t(crc) || buf[len-1] != uint8_t(crc >> 8))
+        return false;
+    for (uint16_t i = 0; i < count; i++) {
+        const uint8_t* r = buf + HEADER + i*8;
+        if (OneWire::crc8(r, 7) != r[7]) {
+            clear();
+            return false;
+        }
+        // saved sorted, but don't trust it
+        uint64_t key = rom_to_key(r);
+        uint16_t j = lower_bound(key);
+        if (j < n && entries[j].key == key)
+            continue;
+        memmove(&entries[j+1], &entries[j], (n - j) * sizeof(Entry));
+        entries[j].key = key;
+        entries[j].misses = 0;
+        n++;
+    }
+    return true;
+}
+
+bool OneWireDeviceTable::save(const char* name) const
+{
+    static uint8_t buf[HEADER + ONEWIRE_TABLE_SIZE*8 + TRAILER];
+    uint16_t len = serialize(buf, sizeof(buf));
+#ifdef FASTMILLIS_HOST
+    FILE* f = fopen(name, "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(buf, 1, len, f) == len;
+    return fclose(f) == 0 && ok;
+#else
+    Preferences prefs;
+    if (!prefs.begin("onewire", false))
+        return false;
+    bool ok = prefs.putBytes(name, buf, len) == len;
+    prefs.end();
+    return ok;
+#endif
+}
+
+bool OneWireDeviceTable::load(const char* name)
+{
+    static uint8_t buf[HEADER + ONEWIRE_TABLE_SIZE*8 + TRAILER];
+    size_t len;
+#ifdef FASTMILLIS_HOST
+    FILE* f = fopen(name, "rb");
+    if (!f) {
+        clear();
+        return false;
+    }
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+#else
+    Preferences prefs;
+    if (!prefs.begin("onewire", true)) {
+        clear();
+        return false;
+    }
+    len = prefs.getBytes(name, buf, sizeof(buf));
+    prefs.end();
+#endif
+    return deserialize(buf, len);
+}
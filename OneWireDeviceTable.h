@@ -0,0 +1,90 @@
+#ifndef OneWireDeviceTable_h
+#define OneWireDeviceTable_h
+
+#include <stdint.h>
+#include "OneWire.h"
+
+// Known devices on a bus, kept up to date without full searches.
+//
+// A full search costs 64 triplets (two read slots, one write slot) per
+// device, every time. This keeps a sorted table of the ROMs instead:
+//
+// - load() restores it from a checkpoint written by save() (NVS on the
+//   ESP32, a file on the host), so a warm boot needs no search at all;
+// - step() checks one known device per call, round robin. It walks the
+//   search tree along that ROM: if the walk stops early the device is
+//   gone (after miss_limit walks in a row). On the way, every bit where
+//   devices answered on the other side too is compared with the table:
+//   if no known ROM is there, that subtree holds new devices, and only
+//   it is searched. A full round of step() finds every change, for the
+//   cost of one full search, spread over time;
+// - scan() does the full search, for a cold start.
+//
+// Search order (and table order) is ROM bit 0 first: keys are the ROM
+// with its 64 bits reversed, so the devices under a search prefix are a
+// range of the table.
+
+#ifndef ONEWIRE_TABLE_SIZE
+#define ONEWIRE_TABLE_SIZE 128
+#endif
+
+class OneWireDeviceTable
+{
+  public:
+    void begin(OneWire& ow);
+
+    uint16_t count() const { return n; }
+    void rom(uint16_t i, uint8_t rom[8]) const { key_to_rom(entries[i].key, rom); }
+    int find(const uint8_t rom[8]) const;       // index, or -1
+
+    void clear() { n = 0; cursor = 0; }
+
+    // Full search, replaces the table. Returns the number of devices.
+    uint16_t scan();
+
+    // Checks the next device, see above. Returns the number of changes.
+    uint16_t step();
+
+    // Called on every change.
+    void (*on_change)(const uint8_t rom[8], bool added) = nullptr;
+
+    uint8_t miss_limit = 2;     // walks in a row before a device is dropped
+    uint32_t added = 0, removed = 0, overflows = 0;
+
+    // Checkpoint: "name" is the NVS key (at most 15 characters) on the
+    // ESP32, a file name on the host. load() checks the CRCs and returns
+    // false, leaving the table empty, if anything is off.
+    bool save(const char* name) const;
+    bool load(const char* name);
+
+    // The same, to and from memory. Format: "OWT", version=1, u16 count,
+    // count ROMs, CRC16 of all that. serialize() returns the size, or 0
+    // if it doesn't fit.
+    static const uint16_t HEADER = 6, TRAILER = 2;
+    uint16_t serialize(uint8_t* buf, uint16_t size) const;
+    bool deserialize(const uint8_t* buf, uint16_t len);
+
+    static uint64_t rom_to_key(const uint8_t rom[8]);
+    static void key_to_rom(uint64_t key, uint8_t rom[8]);
+
+  private:
+    struct Entry {
+        uint64_t key;
+        uint8_t  misses;
+    };
+
+    OneWire* ow = nullptr;
+    Entry    entries[ONEWIRE_TABLE_SIZE];
+    uint16_t n = 0;
+    uint16_t cursor = 0;
+
+    uint16_t lower_bound(uint64_t key) const;
+    bool has_prefix(uint64_t key, uint8_t bits) const;
+    bool insert(uint64_t key);
+    void remove(uint16_t i);
+
+    uint8_t walk(uint64_t key, uint64_t& others);
+    uint16_t discover(uint64_t prefix, uint8_t bits);
+};
+
+#endif // OneWireDeviceTable_h
@@ -0,0 +1,188 @@
+// Parallel 1-Wire on several pins, see OneWireMultiBus.h
+//
+// 2022 - peufeu, same license as OneWire.cpp
+
+#include "config.h"
+#ifndef FASTMILLIS_HOST
+#include <Arduino.h>
+#endif
+#include "OneWireMultiBus.h"
+#include "fastmillis.h"
+#include "trace.h"
+#include "OneWire_timing.h"
+
+// A pin >= 32 isn't in GPIO.in/out: its bus gets no pin and stays out of
+// the valid mask, so it is never driven nor reported present.
+bool OneWireMultiBus::begin(const uint8_t* _pins, uint8_t count)
+{
+    if (count > MAX_BUSES)
+        count = MAX_BUSES;
+    nbuses = count;
+    valid = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        bus_pin[i] = 0;
+        if (_pins[i] >= 32) {
+            Serial.println( "OneWireMultiBus needs pin<32" );
+            continue;
+        }
+        pinMode(_pins[i], INPUT);
+        OneWire::setup_pin(_pins[i]);
+        bus_pin[i] = uint32_t(1) << _pins[i];
+        valid |= uint32_t(1) << i;
+    }
+    set_active(all_buses());
+    return valid == all_buses();
+}
+
+void OneWireMultiBus::update_pin_mask()
+{
+    pins = 0;
+    for (uint8_t i = 0; i < nbuses; i++)
+        if (active & (uint32_t(1) << i))
+            pins |= bus_pin[i];
+}
+
+uint32_t OneWireMultiBus::reset()
+{
+    uint32_t in;
+    unsigned retries = 125;
+
+    TRACE_BEGIN( "onewire.multi.reset" );
+    GPIO.enable_w1tc = pins;
+    // wait until all the wires are high... just in case
+    while ((GPIO.in & pins) != pins) {
+        if (--retries == 0)
+            break;
+        delayMicroseconds(2);
+    }
+    // the ones still low would read as a presence: leave them out
+    uint32_t stuck = pins & ~GPIO.in;
+    uint32_t reset_pins = pins & ~stuck;
+    held_low = 0;
+    for (uint8_t i = 0; i < nbuses; i++)
+        if ((active & (uint32_t(1) << i)) && (bus_pin[i] & stuck))
+            held_low |= uint32_t(1) << i;
+
+    MultiDelay d;
+    timeCriticalEnter() {
+        d.reset();
+        GPIO.out_w1tc = reset_pins;
+        GPIO.enable_w1ts = reset_pins;  // drive outputs low
+        d.waitUntilMicros( tRSTL );
+        GPIO.out_w1ts = reset_pins;
+        d.waitUntilMicros( tRSTL+tAPU );    // active pullup
+        GPIO.enable_w1tc = reset_pins;  // allow them to float
+        d.waitUntilMicros( tPDSAMPLE );
+        in = GPIO.in;
+    } timeCriticalExit();
+    hybridDelayMicroseconds(tRSTH);
+
+    uint32_t presence = 0;
+    for (uint8_t i = 0; i < nbuses; i++)
+        if ((active & ~held_low & (uint32_t(1) << i)) && !(in & bus_pin[i]))
+            presence |= uint32_t(1) << i;
+    TRACE_END( "onewire.multi.reset" );
+    return presence;
+}
+
+// Eight write slots. ones[bit] is the pin mask of the buses sending a 1.
+void OneWireMultiBus::write_slots(const uint32_t ones[8])
+{
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        uint32_t release_early = ones[bit];
+        MultiDelay d;
+        timeCriticalEnter() {
+            d.reset();
+            GPIO.out_w1tc = pins;
+            GPIO.enable_w1ts = pins;        // drive outputs low
+            d.waitUntilMicros( tLOW1 );
+            GPIO.enable_w1tc = release_early;
+            d.waitUntilMicros( tLOW0 );
+            GPIO.enable_w1tc = pins;
+        } timeCriticalExit();
+        d.waitUntilMicros( tSLOT );
+    }
+}
+
+// Eight read slots, samples[bit] is GPIO.in at tRDV.
+void OneWireMultiBus::read_slots(uint32_t samples[8])
+{
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        MultiDelay d;
+        timeCriticalEnter() {
+            d.reset();
+            GPIO.enable_w1ts = pins;        // drive outputs low
+            GPIO.out_w1tc = pins;
+            d.waitUntilMicros( tDRIVElow );
+            GPIO.enable_w1tc = pins;        // let them float
+            d.waitUntilMicros( tRDV );
+            samples[bit] = GPIO.in;
+        } timeCriticalExit();
+        d.waitUntilMicros( tSLOT );
+    }
+}
+
+void OneWireMultiBus::write_all(uint8_t v)
+{
+    uint32_t ones[8];
+    for (uint8_t bit = 0; bit < 8; bit++)
+        ones[bit] = (v >> bit) & 1 ? pins : 0;
+    write_slots(ones);
+}
+
+void OneWireMultiBus::write(const uint8_t* v)
+{
+    uint32_t ones[8] = { 0 };
+    for (uint8_t i = 0; i < nbuses; i++) {
+        if (!(active & (uint32_t(1) << i)))
+            continue;
+        for (uint8_t bit = 0; bit < 8; bit++)
+            if ((v[i] >> bit) & 1)
+                ones[bit] |= bus_pin[i];
+    }
+    write_slots(ones);
+}
+
+void OneWireMultiBus::read(uint8_t* v)
+{
+    uint32_t samples[8];
+    read_slots(samples);
+    for (uint8_t i = 0; i < nbuses; i++) {
+        uint8_t r = 0;
+        for (uint8_t bit = 0; bit < 8; bit++)
+            if (samples[bit] & bus_pin[i])
+                r |= 1 << bit;
+        v[i] = r;
+    }
+}
+
+void OneWireMultiBus::write_bytes(const uint8_t* buf, uint16_t count)
+{
+    uint8_t v[MAX_BUSES];
+    for (uint16_t j = 0; j < count; j++) {
+        for (uint8_t i = 0; i < nbuses; i++)
+            v[i] = buf[i*count + j];
+        write(v);
+    }
+}
+
+void OneWireMultiBus::read_bytes(uint8_t* buf, uint16_t count)
+{
+    uint8_t v[MAX_BUSES];
+    for (uint16_t j = 0; j < count; j++) {
+        read(v);
+        for (uint8_t i = 0; i < nbuses; i++)
+            buf[i*count + j] = v[i];
+    }
+}
+
+void OneWireMultiBus::select(const uint8_t (*roms)[8])
+{
+    write_all(0x55);           // Choose ROM
+    uint8_t v[MAX_BUSES];
+    for (uint8_t j = 0; j < 8; j++) {
+        for (uint8_t i = 0; i < nbuses; i++)
+            v[i] = roms[i][j];
+        write(v);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef OneWireMultiBus_h
+#define OneWireMultiBus_h
+
+#include <stdint.h>
+#include "OneWire.h"
+
+// Several 1-Wire buses driven in the same time slots.
+//
+// The GPIO set/clear/enable registers take a mask of pins, and GPIO.in
+// samples all pins at once. So one slot sequence can reset, write or read
+// up to 32 buses in parallel: during a write slot the buses sending a 1
+// are released at tLOW1 and the others at tLOW0, and a read slot is one
+// sample of GPIO.in, split into per-bus bits afterwards. Reading 8 sensor
+// chains takes the time of one.
+//
+// Buses are numbered in the order of the pins given to begin(). Functions
+// that return one bit per bus use bit i for bus i. Multi-byte buffers are
+// bus-major: bus i uses buf[i*count] .. buf[i*count + count-1].
+//
+// Pins must be < 32: begin() returns false if one isn't, and that bus
+// is left out of every operation. Only the buses in the active mask are
+// driven; the default is all of them.
+
+class OneWireMultiBus
+{
+  public:
+    static const uint8_t MAX_BUSES = 32;
+
+    OneWireMultiBus() { }
+    bool begin(const uint8_t* pins, uint8_t count);
+
+    uint8_t buses() const { return nbuses; }
+
+    // Restrict the following operations to the buses in mask, for
+    // example the ones where reset() saw a device.
+    void set_active(uint32_t mask) { active = mask & valid; update_pin_mask(); }
+    uint32_t get_active() const { return active; }
+    uint32_t all_buses() const { return nbuses == 32 ? 0xFFFFFFFF : (uint32_t(1) << nbuses) - 1; }
+
+    // Reset all active buses. Returns the buses where a device answered.
+    // A bus whose wire doesn't come up first is left out of the reset and
+    // reported absent, and shows up in shorted().
+    uint32_t reset();
+
+    // Buses whose wire was still low before the last reset(): shorted to
+    // ground, or held by a device.
+    uint32_t shorted() const { return held_low; }
+
+    // Write the same byte to all active buses (skip ROM, convert T...)
+    void write_all(uint8_t v);
+
+    // Write v[i] to bus i.
+    void write(const uint8_t* v);
+
+    // Read one byte from each bus into v[i].
+    void read(uint8_t* v);
+
+    void write_bytes(const uint8_t* buf, uint16_t count);
+    void read_bytes(uint8_t* buf, uint16_t count);
+
+    // Skip ROM on every active bus.
+    void skip() { write_all(0xCC); }
+
+    // Match ROM on each bus, roms[i] on bus i.
+    void select(const uint8_t (*roms)[8]);
+
+  private:
+    uint8_t  nbuses = 0;
+    uint32_t bus_pin[MAX_BUSES];    // pin bitmask of each bus
+    uint32_t valid = 0;             // buses with a usable pin
+    uint32_t active = 0;            // active buses
+    uint32_t pins = 0;              // pin bitmask of the active buses
+    uint32_t held_low = 0;          // buses stuck low at the last reset
+
+    void update_pin_mask();
+    void write_slots(const uint32_t ones[8]);
+    void read_slots(uint32_t samples[8]);
+};
+
+#endif // OneWireMultiBus_h
@@ -0,0 +1,595 @@
+// Simulated 1-Wire buses and devices for the host backend, see OneWireSim.h
+//
+// 2022 - peufeu, same license as OneWire.cpp
+
+#include "config.h"
+#include "fastmillis.h"
+
+#ifdef FASTMILLIS_HOST
+
+#include <algorithm>
+#include <math.h>
+#include "OneWireSim.h"
+
+OneWireSimSerial Serial;
+OneWireSimGpio GPIO;
+OneWireSimBus* OneWireSimBus::pins[OneWireSimBus::MAX_PINS];
+
+/**************************************************************
+ *  Device: ROM layer
+ **************************************************************/
+
+OneWireSimDevice::OneWireSimDevice(uint8_t family, uint64_t serial)
+{
+    rom[0] = family;
+    for (int i = 1; i < 7; i++) {
+        rom[i] = serial;
+        serial >>= 8;
+    }
+    rom[7] = crc8(rom, 7);
+}
+
+uint8_t OneWireSimDevice::crc8(const uint8_t* p, uint16_t len, uint8_t crc)
+{
+    while (len--) {
+        uint8_t b = *p++;
+        for (int i = 0; i < 8; i++) {
+            uint8_t mix = (crc ^ b) & 1;
+            crc >>= 1;
+            if (mix) crc ^= 0x8C;
+            b >>= 1;
+        }
+    }
+    return crc;
+}
+
+uint16_t OneWireSimDevice::crc16(const uint8_t* p, uint16_t len, uint16_t crc)
+{
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+uint64_t OneWireSimDevice::now_ns() const
+{
+    return OneWireSimBus::now_ns();
+}
+
+void OneWireSimDevice::send(uint8_t b)
+{
+    if (_tx_bit >= _tx.size() * 8) {
+        _tx.clear();
+        _tx_bit = 0;
+    }
+    _tx.push_back(b);
+}
+
+void OneWireSimDevice::send(const uint8_t* p, uint16_t len)
+{
+    while (len--)
+        send(*p++);
+}
+
+void OneWireSimDevice::reset_pulse(uint64_t t)
+{
+    _state = ROM_COMMAND;
+    _rx_bits = 0;
+    _tx.clear();
+    _tx_bit = 0;
+    _tx_slot = false;
+    _low_from = t + timing().pdh;
+    _low_until = t + timing().pdh + timing().pdl;
+    on_reset();
+}
+
+// Master release: a reset if it was low long enough, else the end of a slot.
+// A standard reset also returns to standard speed. In between, the slot
+// was too long: lose the frame until the next reset.
+bool OneWireSimDevice::release(uint64_t t, uint64_t low_ns)
+{
+    if (low_ns >= standard.rstl)
+        _overdrive = false;
+    if (low_ns >= timing().rstl) {
+        reset_pulse(t);
+        return true;
+    }
+    if (low_ns > timing().slot_max) {
+        _state = IDLE;
+        _tx_slot = false;
+        return false;
+    }
+    rise(low_ns);
+    return false;
+}
+
+// Master falling edge: decide if we send a 0 in this slot.
+void OneWireSimDevice::fall(uint64_t t)
+{
+    bool bit = true;
+    _tx_slot = false;
+
+    switch (_state) {
+    case SEARCH_ROM:
+        if (_search_step < 2) {
+            _tx_slot = true;
+            bit = ((rom[_match >> 3] >> (_match & 7)) & 1) ^ _search_step;
+        }
+        break;
+
+    case COMMAND:
+    case DATA:
+        if (_tx_bit >= _tx.size() * 8)
+            on_tx_empty();
+        if (_tx_bit < _tx.size() * 8) {
+            _tx_slot = true;
+            bit = (_tx[_tx_bit >> 3] >> (_tx_bit & 7)) & 1;
+        } else {
+            bit = idle_bit();
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (!bit) {
+        _low_from = t;
+        _low_until = t + timing().hold;
+    }
+}
+
+// Master release, not a reset: end of a read slot, or sample a write slot.
+void OneWireSimDevice::rise(uint64_t low_ns)
+{
+    if (_tx_slot) {
+        _tx_slot = false;
+        if (_state == SEARCH_ROM)
+            _search_step++;
+        else
+            _tx_bit++;
+        return;
+    }
+    if (_state == IDLE)
+        return;
+
+    bool bit = _bus->sample(low_ns + _bus->rise_ns <= timing().sample);
+
+    if (_state == SEARCH_ROM) {
+        if (bit != ((rom[_match >> 3] >> (_match & 7)) & 1)) {
+            _state = IDLE;          // lost the arbitration
+            return;
+        }
+        _search_step = 0;
+        if (++_match == 64)
+            _state = COMMAND;
+        return;
+    }
+
+    _rx_byte = (_rx_byte >> 1) | (bit ? 0x80 : 0);
+    if (++_rx_bits == 8) {
+        _rx_bits = 0;
+        receive(_rx_byte);
+    }
+}
+
+void OneWireSimDevice::receive(uint8_t b)
+{
+    switch (_state) {
+    case ROM_COMMAND:
+        switch (b) {
+        case 0x33:                  // Read ROM
+            send(rom, 8);
+            _state = COMMAND;
+            break;
+        case 0x69:                  // Overdrive Match ROM, the ROM comes at overdrive speed
+            if (!overdrive_capable) {
+                _state = IDLE;
+                break;
+            }
+            _overdrive = true;
+            _state = MATCH_ROM;
+            _match = 0;
+            _matched = true;
+            _overdrive_match = true;
+            break;
+        case 0x55:                  // Match ROM
+            _state = MATCH_ROM;
+            _match = 0;
+            _matched = true;
+            _overdrive_match = false;
+            break;
+        case 0x3C:                  // Overdrive Skip ROM
+            if (!overdrive_capable) {
+                _state = IDLE;
+                break;
+            }
+            _overdrive = true;
+            _state = COMMAND;
+            break;
+        case 0xCC:                  // Skip ROM
+            _state = COMMAND;
+            break;
+        case 0xEC:                  // Alarm Search
+            if (!alarm()) {
+                _state = IDLE;
+                break;
+            }
+            // fall through
+        case 0xF0:                  // Search ROM
+            _state = SEARCH_ROM;
+            _match = 0;
+            _search_step = 0;
+            break;
+        default:
+            _state = IDLE;
+        }
+        break;
+
+    case MATCH_ROM:
+        if (b != rom[_match])
+            _matched = false;
+        if (++_match == 8) {
+            _state = _matched ? COMMAND : IDLE;
+            if (!_matched && _overdrive_match)
+                _overdrive = false;     // the others go back to standard speed
+        }
+        break;
+
+    case COMMAND:
+        _state = DATA;
+        on_command(b);
+        break;
+
+    case DATA:
+        on_data(b);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**************************************************************
+ *  DS18B20
+ **************************************************************/
+
+OneWireSimDS18B20::OneWireSimDS18B20(uint64_t serial)
+    : OneWireSimDevice(0x28, serial)
+{
+    static const uint8_t power_on[9] = { 0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10, 0 };
+    std::copy(power_on, power_on + 9, scratchpad);
+    std::copy(power_on + 2, power_on + 5, eeprom);
+}
+
+// 93.75ms at 9 bits, doubling with each extra bit
+uint32_t OneWireSimDS18B20::conversion_ns() const
+{
+    return 93750000u << ((scratchpad[4] >> 5) & 3);
+}
+
+void OneWireSimDS18B20::finish_conversion()
+{
+    if (!converting || now_ns() < convert_end)
+        return;
+    converting = false;
+    int16_t raw = lrintf(temperature * 16);
+    raw &= ~((1 << (3 - ((scratchpad[4] >> 5) & 3))) - 1);     // drop bits below resolution
+    scratchpad[0] = raw;
+    scratchpad[1] = raw >> 8;
+}
+
+void OneWireSimDS18B20::on_command(uint8_t c)
+{
+    cmd = c;
+    count = 0;
+    switch (c) {
+    case 0x44:                      // Convert T
+        converting = true;
+        convert_end = now_ns() + conversion_ns();
+        conversions++;
+        break;
+    case 0xBE:                      // Read Scratchpad
+        finish_conversion();
+        scratchpad[8] = crc8(scratchpad, 8);
+        send(scratchpad, 9);
+        break;
+    case 0x48:                      // Copy Scratchpad
+        std::copy(scratchpad + 2, scratchpad + 5, eeprom);
+        break;
+    case 0xB8:                      // Recall E2
+        std::copy(eeprom, eeprom + 3, scratchpad + 2);
+        break;
+    }
+}
+
+void OneWireSimDS18B20::on_data(uint8_t b)
+{
+    if (cmd != 0x4E || count >= 3)  // Write Scratchpad: TH, TL, config
+        return;
+    if (count == 2)
+        b = (b & 0x60) | 0x1F;
+    scratchpad[2 + count++] = b;
+}
+
+bool OneWireSimDS18B20::idle_bit()
+{
+    finish_conversion();
+    return !converting;             // 0 while converting, 1 when done
+}
+
+bool OneWireSimDS18B20::alarm()
+{
+    finish_conversion();
+    int8_t t = int16_t(scratchpad[0] | (scratchpad[1] << 8)) >> 4;
+    return t >= int8_t(scratchpad[2]) || t <= int8_t(scratchpad[3]);
+}
+
+/**************************************************************
+ *  DS2408
+ **************************************************************/
+
+OneWireSimDS2408::OneWireSimDS2408(uint64_t serial)
+    : OneWireSimDevice(0x29, serial)
+{
+    overdrive_capable = true;
+}
+
+void OneWireSimDS2408::set_pio(uint8_t new_inputs, uint8_t new_latch)
+{
+    uint8_t before = pio();
+    inputs = new_inputs;
+    latch = new_latch;
+    activity |= before ^ pio();
+}
+
+void OneWireSimDS2408::set_inputs(uint8_t v)
+{
+    set_pio(v, latch);
+}
+
+uint8_t OneWireSimDS2408::reg(uint16_t a) const
+{
+    switch (a) {
+    case 0x88: return pio();
+    case 0x89: return latch;
+    case 0x8A: return activity;
+    case 0x8B: return select_mask;
+    case 0x8C: return polarity;
+    case 0x8D: return control;
+    default:   return 0xFF;
+    }
+}
+
+void OneWireSimDS2408::on_command(uint8_t c)
+{
+    cmd = c;
+    count = 0;
+    crc = crc16(&c, 1);
+    switch (c) {
+    case 0xC3:                      // Reset Activity Latches
+        activity = 0;
+        send(0xAA);
+        break;
+    }
+}
+
+void OneWireSimDS2408::on_data(uint8_t b)
+{
+    switch (cmd) {
+    case 0xF0:                      // Read PIO Registers: TA1, TA2, then registers to the end of the page, CRC16
+        crc = crc16(&b, 1, crc);
+        if (count++ == 0) {
+            addr = b;
+            break;
+        }
+        addr |= b << 8;
+        if (addr < 0x88 || addr > 0x8F)
+            break;                  // invalid address: the master reads 1s
+        for (; addr <= 0x8F; addr++) {
+            uint8_t v = reg(addr);
+            crc = crc16(&v, 1, crc);
+            send(v);
+        }
+        send(~crc);
+        send(~crc >> 8);
+        break;
+
+    case 0x5A:                      // Channel Access Write: data, inverted data; answers 0xAA, PIO state
+        if (count++ == 0) {
+            first = b;
+            break;
+        }
+        count = 0;
+        if (b != uint8_t(~first))
+            break;                  // the master reads 1s
+        set_pio(inputs, first);
+        send(0xAA);
+        send(pio());
+        break;
+
+    case 0xCC:                      // Write Conditional Search Register: TA1, TA2, data...
+        if (count < 2) {
+            addr = count++ ? addr | (b << 8) : b;
+            break;
+        }
+        switch (addr++) {
+        case 0x8B: select_mask = b; break;
+        case 0x8C: polarity = b; break;
+        case 0x8D: control = (control & 0xF0) | (b & 0x0F); break;
+        }
+        break;
+    }
+}
+
+void OneWireSimDS2408::on_tx_empty()
+{
+    switch (cmd) {
+    case 0xF5:                      // Channel Access Read: PIO state, CRC16 after each 32 bytes
+        if (count == 32) {
+            send(~crc);
+            send(~crc >> 8);
+            count = 0;
+            crc = 0;
+        } else {
+            uint8_t v = pio();
+            crc = crc16(&v, 1, crc);
+            send(v);
+            count++;
+        }
+        break;
+    case 0xC3:
+        send(0xAA);
+        break;
+    }
+}
+
+// Control register: bit 0 selects PIO state (1) or activity latches (0),
+// bit 1 selects AND (1) or OR (0) of the selected channels.
+bool OneWireSimDS2408::alarm()
+{
+    if (!select_mask)
+        return false;
+    uint8_t cond = (control & 1) ? uint8_t(~(pio() ^ polarity)) : activity;
+    cond &= select_mask;
+    return (control & 2) ? cond == select_mask : cond != 0;
+}
+
+/**************************************************************
+ *  Bus
+ **************************************************************/
+
+OneWireSimBus::OneWireSimBus(uint8_t pin)
+    : _pin(pin)
+{
+    if (pin < MAX_PINS)
+        pins[pin] = this;
+}
+
+OneWireSimBus::~OneWireSimBus()
+{
+    if (_pin < MAX_PINS && pins[_pin] == this)
+        pins[_pin] = nullptr;
+    for (OneWireSimDevice* d : _devices)
+        d->_bus = nullptr;
+}
+
+void OneWireSimBus::attach(OneWireSimDevice& d)
+{
+    if (d._bus)
+        d._bus->detach(d);
+    d._bus = this;
+    d._state = OneWireSimDevice::IDLE;
+    d._low_until = 0;
+    _devices.push_back(&d);
+}
+
+void OneWireSimBus::detach(OneWireSimDevice& d)
+{
+    _devices.erase(std::remove(_devices.begin(), _devices.end(), &d), _devices.end());
+    d._bus = nullptr;
+}
+
+bool OneWireSimBus::wire_low(uint64_t t) const
+{
+    if (_master_low)
+        return true;
+    uint64_t released = _release;
+    for (const OneWireSimDevice* d : _devices) {
+        if (d->_low_from <= t && t < d->_low_until)
+            return true;
+        if (d->_low_until <= t && d->_low_until > released)
+            released = d->_low_until;
+    }
+    return t - released < rise_ns;
+}
+
+bool OneWireSimBus::sample(bool high)
+{
+    if (noise > 0) {
+        seed ^= seed << 13;         // xorshift32
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        if (seed < noise * 4294967296.0f) {
+            glitches++;
+            return !high;
+        }
+    }
+    return high;
+}
+
+void OneWireSimBus::drive(bool low)
+{
+    if (low == _master_low)
+        return;
+    _master_low = low;
+    uint64_t t = now_ns();
+    if (low) {
+        _fall = t;
+        for (OneWireSimDevice* d : _devices)
+            d->fall(t);
+        return;
+    }
+    uint64_t low_ns = t - _fall;
+    _release = t;
+    bool reset = false, over = false;
+    for (OneWireSimDevice* d : _devices) {
+        over |= low_ns > d->timing().slot_max && low_ns < d->timing().rstl;
+        reset |= d->release(t, low_ns);
+    }
+    if (over)
+        overlong++;
+    if (reset)
+        resets++;
+    else
+        slots++;
+}
+
+/**************************************************************
+ *  GPIO registers
+ **************************************************************/
+
+OneWireSimGpioReg::operator uint32_t() const
+{
+    fastmillis_host::spend_cycles(fastmillis_host::reg_access_cost);
+    if (_w != IN)
+        return 0;               // write-only
+    uint32_t out = _bank ? GPIO.out1 : GPIO.out;
+    uint32_t enable = _bank ? GPIO.enable1 : GPIO.enable;
+    // pins without a bus read back what they drive, or the pull-up
+    uint32_t v = (out & enable) | ~enable;
+    for (uint8_t bit = 0; bit < 32; bit++) {
+        OneWireSimBus* bus = OneWireSimBus::on_pin(_bank * 32 + bit);
+        if (!bus)
+            continue;
+        if (bus->sample(bus->high()))
+            v |= uint32_t(1) << bit;
+        else
+            v &= ~(uint32_t(1) << bit);
+    }
+    return v;
+}
+
+OneWireSimGpioReg& OneWireSimGpioReg::operator=(uint32_t v)
+{
+    fastmillis_host::spend_cycles(fastmillis_host::reg_access_cost);
+    uint32_t& out = _bank ? GPIO.out1 : GPIO.out;
+    uint32_t& enable = _bank ? GPIO.enable1 : GPIO.enable;
+    switch (_w) {
+    case OUT_W1TS:    out |= v; break;
+    case OUT_W1TC:    out &= ~v; break;
+    case ENABLE_W1TS: enable |= v; break;
+    case ENABLE_W1TC: enable &= ~v; break;
+    default:          return *this;
+    }
+    for (uint8_t bit = 0; bit < 32; bit++) {
+        OneWireSimBus* bus = OneWireSimBus::on_pin(_bank * 32 + bit);
+        if (bus && (v >> bit) & 1)
+            bus->drive((enable & ~out) >> bit & 1);
+    }
+    return *this;
+}
+
+#endif // FASTMILLIS_HOST
@@ -0,0 +1,315 @@
+#ifndef OneWireSim_h
+#define OneWireSim_h
+
+// Simulated 1-Wire buses for the host backend (FASTMILLIS_HOST).
+//
+// OneWire.h includes this instead of <Arduino.h> on the host. It provides
+// a GPIO register block whose in/out/enable registers are wired to
+// simulated buses, so OneWire, OneWireAsync and OneWireMultiBus run
+// unchanged against the virtual clock of fastmillis_host.h.
+//
+// A bus sits on one pin and holds any number of devices. The wire is a
+// wired-AND of the master and the devices, with a pull-up:
+//
+// - the master pulls it low while the pin is an output driving 0;
+// - each device reacts to the master's edges like the real chip does:
+//   a low longer than 480µs is a reset, answered by a presence pulse;
+//   in a write slot it samples the wire 30µs after the falling edge, and
+//   in a read slot it holds the wire low for 30µs to send a 0 (at
+//   overdrive speed: 48µs, 3µs and 3µs); a low too long for a slot and
+//   too short for a reset (120µs to 480µs) is out of spec: the device
+//   loses the frame and waits for the next reset;
+// - after the last release the wire reads low for rise_ns more (RC of
+//   the pull-up and the cable), so a slow bus breaks like a real one.
+//
+// The ROM layer is implemented by OneWireSimDevice: Read ROM, Match ROM,
+// Skip ROM, Search ROM with arbitration, Alarm Search, and for devices
+// that support it Overdrive Skip ROM and Overdrive Match ROM. Models of
+// the DS18B20 and DS2408 sit on top.
+//
+//    OneWireSimBus bus(4);
+//    OneWireSimDS18B20 t1(1), t2(2);
+//    bus.attach(t1);
+//    bus.attach(t2);
+//    t1.set_temperature(21.5);
+//    OneWire ow(4);
+//    ow.reset();     // true
+//
+// noise sets the probability that a sample (by the master or by a device)
+// reads the wrong level, to check CRCs and retries. The simulation is not
+// thread safe and, like the rest of the host backend, never built on target.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "fastmillis.h"
+
+/**************************************************************
+ *  Arduino stand-ins used by the 1-Wire code
+ **************************************************************/
+
+#define INPUT   0x01
+#define OUTPUT  0x03
+
+static inline void pinMode( uint8_t, uint8_t ) { }
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+
+struct OneWireSimSerial {
+    void print( const char* s )   { fputs( s, stderr ); }
+    void println( const char* s ) { fprintf( stderr, "%s\n", s ); }
+};
+extern OneWireSimSerial Serial;
+
+/**************************************************************
+ *  Devices
+ **************************************************************/
+
+class OneWireSimBus;
+
+class OneWireSimDevice
+{
+  public:
+    // family code + 48 bit serial, the CRC byte is computed
+    OneWireSimDevice(uint8_t family, uint64_t serial);
+    virtual ~OneWireSimDevice() { }
+
+    uint8_t rom[8];
+
+    // Timings in ns, typical values from the datasheets.
+    struct Timing {
+        uint32_t rstl;              // shortest low seen as a reset
+        uint32_t pdh;               // release to presence pulse
+        uint32_t pdl;               // presence pulse length
+        uint32_t sample;            // write slot sample point
+        uint32_t hold;              // read slot: how long a 0 is held
+        uint32_t slot_max;          // longest low that is still a slot (tLOW0 max)
+    };
+    Timing standard  = { 480000, 30000, 120000, 30000, 30000, 120000 };
+    Timing overdrive = { 48000, 2000, 10000, 3000, 3000, 16000 };
+
+    bool overdrive_capable = false;
+    bool in_overdrive() const { return _overdrive; }
+
+    OneWireSimBus* bus() const { return _bus; }
+
+    // Dallas CRCs, bitwise, independent of the ones in OneWire.cpp
+    static uint8_t crc8(const uint8_t* p, uint16_t len, uint8_t crc = 0);
+    static uint16_t crc16(const uint8_t* p, uint16_t len, uint16_t crc = 0);
+
+  protected:
+    // Function layer, called once the device is selected.
+    virtual void on_reset() { }
+    virtual void on_command(uint8_t cmd) = 0;   // first byte after the ROM command
+    virtual void on_data(uint8_t) { }           // following bytes
+
+    // Bit sent in a read slot when nothing is queued, 1 = don't pull.
+    virtual bool idle_bit() { return true; }
+
+    // Called when the queue runs dry in a read slot, to stream more.
+    virtual void on_tx_empty() { }
+
+    // Takes part in Alarm Search (0xEC).
+    virtual bool alarm() { return false; }
+
+    void send(uint8_t b);
+    void send(const uint8_t* p, uint16_t len);
+    uint64_t now_ns() const;
+
+  private:
+    friend class OneWireSimBus;
+
+    enum State : uint8_t { IDLE, ROM_COMMAND, MATCH_ROM, SEARCH_ROM, COMMAND, DATA };
+
+    OneWireSimBus* _bus = nullptr;
+    State    _state = IDLE;
+    uint8_t  _rx_byte = 0, _rx_bits = 0;
+    uint8_t  _match = 0;            // bytes matched so far / search bit
+    uint8_t  _search_step = 0;      // 0: send bit, 1: send complement, 2: receive
+    bool     _matched = false;
+    bool     _overdrive_match = false;  // Match ROM was 0x69
+    bool     _tx_slot = false;      // current slot is a read slot for us
+    bool     _overdrive = false;
+    std::vector<uint8_t> _tx;
+    uint32_t _tx_bit = 0;           // next bit to send in _tx
+
+    uint64_t _low_from = 0, _low_until = 0;     // when we pull the wire low
+
+    const Timing& timing() const { return _overdrive ? overdrive : standard; }
+    void fall(uint64_t t);
+    bool release(uint64_t t, uint64_t low_ns);
+    void rise(uint64_t low_ns);
+    void reset_pulse(uint64_t t);
+    void receive(uint8_t b);
+    void pull_low(uint64_t from, uint64_t until) { _low_from = from; _low_until = until; }
+};
+
+// DS18B20 thermometer, family 0x28.
+// Convert T takes 94..750ms depending on resolution; read slots return 0
+// until it is done. Alarm Search finds it when the temperature is
+// outside TL..TH.
+class OneWireSimDS18B20 : public OneWireSimDevice
+{
+  public:
+    OneWireSimDS18B20(uint64_t serial);
+
+    void set_temperature(float celsius) { temperature = celsius; }
+    float temperature = 20.0;
+
+    uint8_t scratchpad[9];
+    uint8_t eeprom[3];              // TH, TL, config
+    uint32_t conversions = 0;
+
+    uint32_t conversion_ns() const;
+
+  protected:
+    void on_reset() override { cmd = 0; }
+    void on_command(uint8_t cmd) override;
+    void on_data(uint8_t b) override;
+    bool idle_bit() override;
+    bool alarm() override;
+
+  private:
+    uint8_t  cmd = 0;
+    uint8_t  count = 0;
+    uint64_t convert_end = 0;
+    bool     converting = false;
+    void finish_conversion();
+};
+
+// DS2408 8-channel addressable switch, family 0x29, overdrive capable.
+// Read PIO Registers (0xF0), Channel Access Read (0xF5) with a CRC16
+// every 32 bytes, Channel Access Write (0x5A), Reset Activity Latches
+// (0xC3) and Write Conditional Search Register (0xCC). Alarm Search finds
+// it when an activity latch selected by the channel selection mask is set.
+class OneWireSimDS2408 : public OneWireSimDevice
+{
+  public:
+    OneWireSimDS2408(uint64_t serial);
+
+    // Level applied to the pins from outside, 1 = not pulled down.
+    void set_inputs(uint8_t v);
+
+    uint8_t pio() const { return inputs & latch; }
+    uint8_t latch = 0xFF;           // output latch, 0 = transistor on
+    uint8_t activity = 0;
+    uint8_t select_mask = 0;        // conditional search registers
+    uint8_t polarity = 0;
+    uint8_t control = 0x88;         // control/status: VCC powered, power-on reset
+
+  protected:
+    void on_reset() override { cmd = 0; }
+    void on_command(uint8_t cmd) override;
+    void on_data(uint8_t b) override;
+    void on_tx_empty() override;
+    bool alarm() override;
+
+  private:
+    uint8_t  inputs = 0xFF;
+    uint8_t  cmd = 0;
+    uint8_t  count = 0;
+    uint16_t addr = 0;
+    uint8_t  first = 0;             // Channel Access Write: first byte
+    uint16_t crc = 0;
+    uint8_t  reg(uint16_t a) const;
+    void set_pio(uint8_t new_inputs, uint8_t new_latch);
+};
+
+/**************************************************************
+ *  Bus
+ **************************************************************/
+
+class OneWireSimBus
+{
+  public:
+    static const uint8_t MAX_PINS = 40;
+
+    // Attaches the bus to a pin, replacing any bus there.
+    OneWireSimBus(uint8_t pin);
+    ~OneWireSimBus();
+
+    void attach(OneWireSimDevice& d);
+    void detach(OneWireSimDevice& d);
+    uint32_t devices() const { return _devices.size(); }
+
+    uint32_t rise_ns = 500;         // release to high
+    float    noise = 0;             // probability of a wrong sample
+    uint32_t seed = 1;
+
+    // counters
+    uint32_t resets = 0;
+    uint32_t slots = 0;
+    uint32_t glitches = 0;
+    uint32_t overlong = 0;          // lows longer than a slot, shorter than a reset
+
+    uint8_t pin() const { return _pin; }
+
+    // Level of the wire now, without noise.
+    bool high() const { return !wire_low(now_ns()); }
+
+    // Level seen by a sampler, with noise.
+    bool sample(bool high);
+
+    static uint64_t now_ns() { return fastmillis_host::now_ps() / 1000; }
+    static OneWireSimBus* on_pin(uint8_t pin) { return pin < MAX_PINS ? pins[pin] : nullptr; }
+
+    // Called by the GPIO registers when the master output changes.
+    void drive(bool low);
+
+  private:
+    static OneWireSimBus* pins[MAX_PINS];
+
+    std::vector<OneWireSimDevice*> _devices;
+    uint8_t  _pin;
+    bool     _master_low = false;
+    uint64_t _fall = 0;
+    uint64_t _release = 0;
+
+    bool wire_low(uint64_t t) const;
+};
+
+/**************************************************************
+ *  GPIO registers
+ *
+ *  Same names as the ESP32 GPIO struct, used the same way:
+ *  GPIO.out_w1tc = mask, GPIO.in & mask... and for pins 32-39,
+ *  GPIO.out1_w1tc.val = mask, GPIO.in1.val & mask...
+ **************************************************************/
+
+class OneWireSimGpioReg
+{
+  public:
+    enum Which : uint8_t { IN, OUT_W1TS, OUT_W1TC, ENABLE_W1TS, ENABLE_W1TC };
+
+    OneWireSimGpioReg(Which w, uint8_t bank = 0) : _w(w), _bank(bank) { }
+    operator uint32_t() const;
+    OneWireSimGpioReg& operator=(uint32_t v);
+
+  private:
+    Which   _w;
+    uint8_t _bank;                  // 0: pins 0-31, 1: pins 32-39
+};
+
+struct OneWireSimGpio {
+    OneWireSimGpioReg in          { OneWireSimGpioReg::IN };
+    OneWireSimGpioReg out_w1ts    { OneWireSimGpioReg::OUT_W1TS };
+    OneWireSimGpioReg out_w1tc    { OneWireSimGpioReg::OUT_W1TC };
+    OneWireSimGpioReg enable_w1ts { OneWireSimGpioReg::ENABLE_W1TS };
+    OneWireSimGpioReg enable_w1tc { OneWireSimGpioReg::ENABLE_W1TC };
+
+    struct Bank1 { OneWireSimGpioReg val; };
+    Bank1 in1          { { OneWireSimGpioReg::IN, 1 } };
+    Bank1 out1_w1ts    { { OneWireSimGpioReg::OUT_W1TS, 1 } };
+    Bank1 out1_w1tc    { { OneWireSimGpioReg::OUT_W1TC, 1 } };
+    Bank1 enable1_w1ts { { OneWireSimGpioReg::ENABLE_W1TS, 1 } };
+    Bank1 enable1_w1tc { { OneWireSimGpioReg::ENABLE_W1TC, 1 } };
+
+    uint32_t out = 0, out1 = 0;
+    uint32_t enable = 0, enable1 = 0;
+};
+
+extern OneWireSimGpio GPIO;
+
+#endif // OneWireSim_h
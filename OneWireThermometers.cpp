@@ -0,0 +1,163 @@
+// DS18B20 acquisition pipeline, see OneWireThermometers.h
+//
+// 2022 - peufeu, same license as OneWire.cpp
+
+#include "config.h"
+#ifndef FASTMILLIS_HOST
+#include <Arduino.h>
+#endif
+#include <string.h>
+#include "OneWireThermometers.h"
+#include "OneWireDeviceTable.h"
+
+void OneWireThermometers::begin(OneWire& _ow)
+{
+    ow = &_ow;
+    n = 0;
+    state = IDLE;
+    batches = crc_errors = retried = 0;
+}
+
+bool OneWireThermometers::add(const uint8_t rom[8])
+{
+    if (rom[0] != 0x28 || n == ONEWIRE_THERMOMETERS)
+        return false;
+    memcpy(roms[n], rom, 8);
+    memset(&readings[n], 0, sizeof(OneWireReading));
+    n++;
+    return true;
+}
+
+uint16_t OneWireThermometers::add(const OneWireDeviceTable& table)
+{
+    uint16_t added = 0;
+    for (uint16_t i = 0; i < table.count(); i++) {
+        uint8_t r[8];
+        table.rom(i, r);
+        added += add(r);
+    }
+    return added;
+}
+
+bool OneWireThermometers::start()
+{
+    if (state != IDLE)
+        return false;
+    TRACE_BEGIN( "ds18b20.convert" );
+    bool presence = ow->reset();
+    if (presence) {
+        ow->skip();
+        ow->write(0x44);            // Convert T, all devices
+    }
+    TRACE_END( "ds18b20.convert" );
+    if (!presence)
+        return false;
+
+    convert_us = fastmicros64();
+    deadline.set(conversion_ms);
+    next_check.set(1);
+    for (uint16_t i = 0; i < n; i++) {
+        readings[i].ok = false;
+        readings[i].tries = 0;
+    }
+    state = CONVERTING;
+    return true;
+}
+
+bool OneWireThermometers::poll()
+{
+    if (state == CONVERTING) {
+        if (!deadline.expired()) {
+            // still converting: the bus reads 0
+            if (!poll_done || !next_check.expired())
+                return false;
+            next_check.set(1);
+            if (!ow->read_bit())
+                return false;
+        }
+        state = READING;
+        index = 0;
+        pass = 0;
+    }
+    if (state != READING)
+        return false;
+
+    uint16_t reads = 0;
+    for (;;) {
+        while (index < n && readings[index].ok)
+            index++;
+        if (index == n) {
+            // end of pass: again for the failed ones, if any
+            if (pass < retries && good_count() < n) {
+                pass++;
+                index = 0;
+                continue;
+            }
+            finish();
+            return true;
+        }
+        if (reads_per_poll && reads == reads_per_poll)
+            return false;
+        if (pass)
+            retried++;
+        read_one(index++);
+        reads++;
+    }
+}
+
+bool OneWireThermometers::sweep()
+{
+    if (!start())
+        return false;
+    while (!poll())
+        ;
+    return !failed;
+}
+
+uint16_t OneWireThermometers::good_count() const
+{
+    uint16_t g = 0;
+    for (uint16_t i = 0; i < n; i++)
+        g += readings[i].ok;
+    return g;
+}
+
+bool OneWireThermometers::read_one(uint16_t i)
+{
+    OneWireReading& r = readings[i];
+    uint8_t sp[9];
+    OneWireCRC8 crc;
+
+    TRACE_BEGIN_V( "ds18b20.read", i );
+    r.tries++;
+    bool presence = ow->reset();
+    if (presence) {
+        ow->select(roms[i]);
+        ow->write(0xBE);            // Read Scratchpad
+        ow->read_bytes_crc(sp, 9, crc);
+    }
+    TRACE_END( "ds18b20.read" );
+    r.us = fastmicros64();
+    if (!presence)
+        return false;
+
+    // All zeros has a valid CRC: that's a shorted bus, not a reading.
+    if (!crc.valid() || !(sp[4] | sp[5] | sp[6] | sp[7])) {
+        crc_errors++;
+        return false;
+    }
+    r.raw = int16_t(sp[0] | (sp[1] << 8));
+    r.ok = true;
+    return true;
+}
+
+void OneWireThermometers::finish()
+{
+    state = IDLE;
+    done_us = fastmicros64();
+    good = good_count();
+    failed = n - good;
+    batches++;
+    if (on_batch)
+        on_batch(*this);
+}
@@ -0,0 +1,118 @@
+#ifndef OneWireThermometers_h
+#define OneWireThermometers_h
+
+#include <stdint.h>
+#include "OneWire.h"
+#include "timeout.h"
+
+class OneWireDeviceTable;
+
+// Reads every DS18B20 on a bus, as a pipeline.
+//
+// Instead of convert + wait + read for each device in turn:
+//
+// - start() sends one Skip ROM + Convert T: all devices convert at once.
+//   The conversion deadline is a Timeout, nothing blocks. If poll_done
+//   is set, poll() also reads one slot per ms: the bus reads 0 while any
+//   device is still converting, so the sweep moves on as soon as the
+//   slowest one is done instead of waiting for the worst case;
+// - then poll() reads the scratchpads back to back (Match ROM + Read
+//   Scratchpad, 9 bytes), checking the CRC;
+// - devices that failed (no presence, bad CRC) are read again, only them,
+//   in up to "retries" more passes. The scratchpad keeps the result, so
+//   no new conversion is needed;
+// - once done, poll() returns true and the readings, timestamped, form a
+//   batch: convert_us is when the temperatures were measured.
+//
+// A scratchpad read is 152 slots (Match ROM, command, 9 bytes), about
+// 13ms at standard speed: 100 devices at 12 bits take 750ms + 1.3s. For
+// one sweep per second, lower the resolution (and conversion_ms), use
+// calibrate(), or split the devices over several buses.
+//
+//    OneWireThermometers temps;
+//    temps.begin( ow );
+//    temps.add( table );           // or add( rom ) for each
+//    temps.start();
+//    ...
+//    if( temps.poll() )            // in loop()
+//        for( uint16_t i=0; i<temps.count(); i++ )
+//            if( temps.reading(i).ok ) use( temps.reading(i).celsius() );
+//
+// Parasite powered devices hold nothing low while converting: turn
+// poll_done off for them, or the sweep reads them too early.
+
+#ifndef ONEWIRE_THERMOMETERS
+#define ONEWIRE_THERMOMETERS 128
+#endif
+
+struct OneWireReading {
+    int16_t  raw;           // 1/16 °C
+    bool     ok;            // false: no valid scratchpad after all retries
+    uint8_t  tries;         // scratchpad reads it took
+    uint64_t us;            // fastmicros64() of the read
+
+    float celsius() const { return raw * (1.0f / 16); }
+};
+
+class OneWireThermometers
+{
+  public:
+    void begin(OneWire& ow);
+
+    // Adds a DS18B20 (family 0x28). Returns false if the ROM is not one
+    // or the list is full.
+    bool add(const uint8_t rom[8]);
+    // Adds the DS18B20s of a device table, returns how many.
+    uint16_t add(const OneWireDeviceTable& table);
+    void clear() { n = 0; }
+
+    uint16_t count() const { return n; }
+    const uint8_t* rom(uint16_t i) const { return roms[i]; }
+    const OneWireReading& reading(uint16_t i) const { return readings[i]; }
+
+    uint16_t conversion_ms = 750;   // worst case at 12 bits
+    bool     poll_done = true;      // finish early, see above
+    uint8_t  retries = 2;           // passes over the failed devices
+    uint16_t reads_per_poll = 0;    // scratchpads read per poll(), 0 = all
+
+    // Starts a sweep. Returns false if one is running or nobody answered
+    // the reset.
+    bool start();
+
+    // Runs the sweep, returns true once when it completes.
+    bool poll();
+    bool busy() const { return state != IDLE; }
+
+    // start() + poll() until done. Returns true if every device was read.
+    bool sweep();
+
+    // Last batch
+    uint64_t convert_us = 0;        // Convert T sent
+    uint64_t done_us = 0;           // last scratchpad read
+    uint16_t good = 0, failed = 0;
+
+    // Since begin()
+    uint32_t batches = 0, crc_errors = 0, retried = 0;
+
+    void (*on_batch)(OneWireThermometers& t) = nullptr;
+
+  private:
+    enum State : uint8_t { IDLE, CONVERTING, READING };
+
+    OneWire*       ow = nullptr;
+    uint8_t        roms[ONEWIRE_THERMOMETERS][8];
+    OneWireReading readings[ONEWIRE_THERMOMETERS];
+    uint16_t       n = 0;
+
+    State    state = IDLE;
+    Timeout  deadline;
+    Timeout  next_check;
+    uint16_t index = 0;
+    uint8_t  pass = 0;
+
+    bool read_one(uint16_t i);
+    uint16_t good_count() const;
+    void finish();
+};
+
+#endif // OneWireThermometers_h
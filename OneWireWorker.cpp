@@ -0,0 +1,192 @@
+// 1-Wire worker task, see OneWireWorker.h
+//
+// 2022 - peufeu, same license as OneWire.cpp
+
+#include "config.h"
+#ifndef FASTMILLIS_HOST
+#include <Arduino.h>
+#endif
+#include "OneWireWorker.h"
+#include "fastmillis.h"
+#include "trace.h"
+
+#define QUEUE_MASK (ONEWIRE_WORKER_QUEUE - 1)
+
+OneWireWorker::OneWireWorker()
+{
+    static_assert((ONEWIRE_WORKER_QUEUE & QUEUE_MASK) == 0, "ONEWIRE_WORKER_QUEUE must be a power of 2");
+    for (uint32_t i = 0; i < ONEWIRE_WORKER_QUEUE; i++)
+        cells[i].seq = i;
+}
+
+bool OneWireWorker::begin(uint8_t core, uint8_t priority)
+{
+    if (running)
+        return false;
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+#ifdef FASTMILLIS_HOST
+    (void)priority;
+    thread = std::thread([this, core] {
+        fastmillis_host::set_core(core);
+        loop();
+    });
+    return true;
+#else
+    stopped = false;
+    if (xTaskCreatePinnedToCore(task_main, "onewire", 4096, this, priority, &task, core) != pdPASS) {
+        running = false;
+        return false;
+    }
+    return true;
+#endif
+}
+
+void OneWireWorker::end()
+{
+    if (!running)
+        return;
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+#ifdef FASTMILLIS_HOST
+    thread.join();
+#else
+    xTaskNotifyGive(task);      // wake it up to see running == false
+    while (!__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+        vTaskDelay(1);
+    task = nullptr;
+#endif
+}
+
+#ifndef FASTMILLIS_HOST
+void OneWireWorker::task_main(void* arg)
+{
+    OneWireWorker* w = (OneWireWorker*)arg;
+    w->loop();
+    __atomic_store_n(&w->stopped, true, __ATOMIC_RELEASE);
+    vTaskDelete(nullptr);
+}
+#endif
+
+void OneWireWorker::loop()
+{
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (run_pending())
+            continue;
+#ifdef FASTMILLIS_HOST
+        std::this_thread::yield();
+#else
+        // submit() notifies after pushing, so nothing is missed between
+        // the empty queue and this
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+    }
+}
+
+bool OneWireWorker::submit(OneWireTransaction& t)
+{
+    t.status = OneWireTransaction::QUEUED;
+    uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    Cell* cell;
+    for (;;) {
+        cell = &cells[pos & QUEUE_MASK];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            // our turn, unless another producer takes this position first
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            t.status = OneWireTransaction::OK;
+            __atomic_fetch_add(&rejected, 1, __ATOMIC_RELAXED);
+            return false;       // full
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->t = &t;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&submitted, 1, __ATOMIC_RELAXED);
+#ifndef FASTMILLIS_HOST
+    if (task)
+        xTaskNotifyGive(task);
+#endif
+    return true;
+}
+
+OneWireTransaction* OneWireWorker::pop()
+{
+    Cell* cell = &cells[dequeue_pos & QUEUE_MASK];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+        return nullptr;
+    OneWireTransaction* t = cell->t;
+    __atomic_store_n(&cell->seq, dequeue_pos + ONEWIRE_WORKER_QUEUE, __ATOMIC_RELEASE);
+    dequeue_pos++;
+    return t;
+}
+
+uint32_t OneWireWorker::run_pending()
+{
+    uint32_t n = 0;
+    while (OneWireTransaction* t = pop()) {
+        execute(*t);
+        post(*t);
+        n++;
+    }
+    return n;
+}
+
+void OneWireWorker::execute(OneWireTransaction& t)
+{
+    OneWireTransaction::Status status = OneWireTransaction::OK;
+    OneWire& ow = *t.ow;
+
+    TRACE_BEGIN_V( "onewire.transaction", t.flags );
+    if ((t.flags & OneWireTransaction::RESET) && !ow.reset()) {
+        status = OneWireTransaction::NO_PRESENCE;
+    } else {
+        if (t.flags & OneWireTransaction::SKIP)
+            ow.skip();
+        else if (t.flags & OneWireTransaction::SELECT)
+            ow.select(t.rom);
+        if (t.wlen)
+            ow.write_bytes(t.wbuf, t.wlen);
+        if (t.flags & OneWireTransaction::CRC8) {
+            OneWireCRC8 crc;
+            ow.read_bytes_crc(t.rbuf, t.rlen, crc);
+            if (!crc.valid())
+                status = OneWireTransaction::CRC_ERROR;
+        } else if (t.flags & OneWireTransaction::CRC16) {
+            OneWireCRC16 crc;
+            crc.update(t.wbuf, t.wlen);
+            ow.read_bytes_crc(t.rbuf, t.rlen, crc);
+            if (!crc.valid())
+                status = OneWireTransaction::CRC_ERROR;
+        } else if (t.rlen) {
+            ow.read_bytes(t.rbuf, t.rlen);
+        }
+    }
+    TRACE_END( "onewire.transaction" );
+    t.done_us = fastmicros64();
+    __atomic_store_n(&t.status, status, __ATOMIC_RELEASE);
+}
+
+// Only the worker writes done_head, only poll() writes done_tail.
+void OneWireWorker::post(OneWireTransaction& t)
+{
+    completed++;
+    uint32_t head = done_head;
+    if (head - __atomic_load_n(&done_tail, __ATOMIC_ACQUIRE) == ONEWIRE_WORKER_QUEUE) {
+        lost_completions++;     // nobody polls: status is still set
+        return;
+    }
+    done_ring[head & QUEUE_MASK] = &t;
+    __atomic_store_n(&done_head, head + 1, __ATOMIC_RELEASE);
+}
+
+OneWireTransaction* OneWireWorker::poll()
+{
+    uint32_t tail = done_tail;
+    if (tail == __atomic_load_n(&done_head, __ATOMIC_ACQUIRE))
+        return nullptr;
+    OneWireTransaction* t = done_ring[tail & QUEUE_MASK];
+    __atomic_store_n(&done_tail, tail + 1, __ATOMIC_RELEASE);
+    return t;
+}
@@ -0,0 +1,124 @@
+#ifndef OneWireWorker_h
+#define OneWireWorker_h
+
+#include <stdint.h>
+#include "OneWire.h"
+#ifdef FASTMILLIS_HOST
+#include <thread>
+#endif
+
+// Runs 1-Wire transactions on a core of its own.
+//
+// Every OneWire call busy-waits through its slots. Here a task pinned to
+// one core (a std::thread on the host) owns the buses: other tasks fill
+// in a OneWireTransaction (reset, ROM command, bytes to write, bytes to
+// read, CRC check) and submit() it, which only pushes a pointer on a
+// lock-free queue. The worker runs it, stores the result and posts the
+// transaction on a completion queue.
+//
+//    OneWireWorker worker;
+//    worker.begin( 0 );                  // core 0, the app runs on 1
+//
+//    static uint8_t sp[9];
+//    static OneWireTransaction t;
+//    t.ow = &ow;
+//    t.flags = OneWireTransaction::RESET | OneWireTransaction::SELECT | OneWireTransaction::CRC8;
+//    memcpy( t.rom, rom, 8 );
+//    t.wbuf = read_scratchpad;  t.wlen = 1;     // { 0xBE }
+//    t.rbuf = sp;               t.rlen = 9;
+//    worker.submit( t );
+//    ...
+//    while( OneWireTransaction* done = worker.poll() )
+//        if( done->status == OneWireTransaction::OK ) ...
+//
+// Transactions and their buffers belong to the worker from submit() until
+// done() is true. Any task may submit (the queue is multi-producer), one
+// task polls the completions. Each wake-up, the worker runs everything
+// queued back to back. The OneWire objects must only be used through the
+// worker once it has started.
+
+#ifndef ONEWIRE_WORKER_QUEUE
+#define ONEWIRE_WORKER_QUEUE 32     // power of 2
+#endif
+
+struct OneWireTransaction
+{
+    enum Flags : uint8_t {
+        RESET  = 0x01,      // reset first, fail without presence
+        SKIP   = 0x02,      // then Skip ROM
+        SELECT = 0x04,      // or Match ROM with rom
+        CRC8   = 0x08,      // last byte read is the CRC8 of the others
+        CRC16  = 0x10,      // last 2 bytes read are the inverted CRC16 of all bytes written and read
+    };
+    enum Status : uint8_t { QUEUED, OK, NO_PRESENCE, CRC_ERROR };
+
+    OneWire*       ow = nullptr;
+    uint8_t        flags = RESET;
+    uint8_t        rom[8];
+    const uint8_t* wbuf = nullptr;
+    uint16_t       wlen = 0;
+    uint8_t*       rbuf = nullptr;
+    uint16_t       rlen = 0;
+    void*          user = nullptr;
+
+    // results
+    Status         status = OK;
+    uint64_t       done_us = 0;     // fastmicros64() when it completed
+
+    bool done() const { return __atomic_load_n(&status, __ATOMIC_ACQUIRE) != QUEUED; }
+};
+
+class OneWireWorker
+{
+  public:
+    OneWireWorker();
+
+    // Starts the worker task on a core. Returns false if it can't.
+    bool begin(uint8_t core = 0, uint8_t priority = 1);
+    // Stops it, after the transaction in progress.
+    void end();
+
+    // Queues a transaction. Returns false if the queue is full.
+    bool submit(OneWireTransaction& t);
+
+    // Next completed transaction, nullptr if none. One consumer only.
+    OneWireTransaction* poll();
+
+    // Runs what is queued in the caller, without a worker task: for
+    // single-core setups and tests. Returns the number run.
+    uint32_t run_pending();
+
+    // counters
+    uint32_t submitted = 0, rejected = 0, completed = 0, lost_completions = 0;
+
+  private:
+    // Submissions: bounded MPSC queue, each cell has a sequence number
+    // telling producers and the consumer whose turn it is.
+    struct Cell {
+        uint32_t seq;
+        OneWireTransaction* t;
+    };
+    Cell     cells[ONEWIRE_WORKER_QUEUE];
+    uint32_t enqueue_pos = 0;
+    uint32_t dequeue_pos = 0;
+
+    // Completions: SPSC ring, worker to poll().
+    OneWireTransaction* done_ring[ONEWIRE_WORKER_QUEUE];
+    uint32_t done_head = 0, done_tail = 0;
+
+    bool     running = false;
+#ifdef FASTMILLIS_HOST
+    std::thread thread;
+#else
+    TaskHandle_t task = nullptr;
+    bool     stopped = false;
+    static void task_main(void* arg);
+#endif
+
+    OneWireTransaction* pop();
+    void execute(OneWireTransaction& t);
+    void post(OneWireTransaction& t);
+    void loop();
+};
+
+#endif // OneWireWorker_h
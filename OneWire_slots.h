@@ -0,0 +1,290 @@
+#ifndef OneWire_slots_h
+#define OneWire_slots_h
+
+// The bit slots of OneWire, as templates over the pin access. OneWire
+// runs them with OneWirePinMask (pin chosen at run time, 0-31) and
+// OneWireT<Pin> with OneWirePin<Pin>, where each access is one store of
+// a constant mask to a constant register, on GPIO 0-33. Included by
+// OneWire.h, after the class.
+
+#include "fastmillis.h"
+#include "trace.h"
+
+// Pin chosen at run time: GPIO 0-31.
+struct OneWirePinMask
+{
+    uint32_t mask;
+
+    inline __attribute__((always_inline)) bool read() const { return GPIO.in & mask; }
+    inline __attribute__((always_inline)) void low() const { GPIO.out_w1tc = mask; }
+    inline __attribute__((always_inline)) void high() const { GPIO.out_w1ts = mask; }
+    inline __attribute__((always_inline)) void input() const { GPIO.enable_w1tc = mask; }
+    inline __attribute__((always_inline)) void output() const { GPIO.enable_w1ts = mask; }
+};
+
+// Pin fixed at compile time. Pins 32-33 use the second register bank
+// (GPIO.in1, out1_w1ts...), chosen here, so they cost the same as the
+// others. 34-39 can't drive the bus.
+template<uint8_t Pin>
+struct OneWirePin
+{
+    static_assert(Pin <= 33, "1-Wire needs an output capable pin: GPIO 0-33");
+    static const uint32_t mask = uint32_t(1) << (Pin & 31);
+
+    inline __attribute__((always_inline)) bool read() const {
+        if (Pin < 32) return GPIO.in & mask;
+        else return GPIO.in1.val & mask;
+    }
+    inline __attribute__((always_inline)) void low() const {
+        if (Pin < 32) GPIO.out_w1tc = mask;
+        else GPIO.out1_w1tc.val = mask;
+    }
+    inline __attribute__((always_inline)) void high() const {
+        if (Pin < 32) GPIO.out_w1ts = mask;
+        else GPIO.out1_w1ts.val = mask;
+    }
+    inline __attribute__((always_inline)) void input() const {
+        if (Pin < 32) GPIO.enable_w1tc = mask;
+        else GPIO.enable1_w1tc.val = mask;
+    }
+    inline __attribute__((always_inline)) void output() const {
+        if (Pin < 32) GPIO.enable_w1ts = mask;
+        else GPIO.enable1_w1ts.val = mask;
+    }
+};
+
+// Perform the onewire reset function.  We will wait for
+// the bus to come high, if it doesn't then it is broken or shorted
+// and we return a 0;
+//
+// Returns 1 if a device asserted a presence pulse, 0 otherwise.
+//
+template<class P>
+bool OneWire::reset_t(P p)
+{
+    bool r;
+    unsigned retries = 125;
+
+    if( calibration_period && !calibrating && (int32_t)(fastmillis() - calibration_due) >= 0 ) {
+        calibration_due = fastmillis() + calibration_period;
+        calibrate();
+    }
+
+    TRACE_BEGIN( "onewire.reset" );
+    p.input();
+    // wait until the wire is high... just in case
+    do {
+        if (--retries == 0) {
+            TRACE_END( "onewire.reset" );
+            return 0;
+        }
+        delayMicroseconds(2);
+    } while ( !p.read() );
+
+    const OneWireTiming& c = timing_cycles;
+    MultiDelay d;
+    uint32_t late = 0;                      // preemptible: how much the pulse was stretched
+    if (preemptible) {
+        // The reset pulse only has a minimum: interrupts may stretch it.
+        timeCriticalEnter() {
+            d.reset();
+            p.low();
+            p.output();
+        } timeCriticalExit();
+        d.waitUntilCycles( c.rstl );
+    }
+    timeCriticalEnter() {
+        if (preemptible) {
+            late = d.elapsedCycles() - c.rstl;
+        } else {
+            d.reset();
+            p.low();
+            p.output();  // drive output low
+            d.waitUntilCycles( c.rstl );    // tRSTL minimum 480µs
+        }
+        p.high();
+        d.waitUntilCycles( late+c.rstl+c.apu );  // active pullup
+        p.input();                          // allow it to float
+        d.waitUntilCycles( late+c.pdsample );    // aim for right after tPDL goes down
+        r = !p.read();
+    } timeCriticalExit();
+    // 400µs of recovery, the longest wait of all: sleep through it unless
+    // the tail has its own plans
+    if (!tail_hook) {
+        int left = (int)(late+c.pdsample+c.rsth) - d.elapsedCycles();
+        if (left > 0)
+            hybridDelayMicroseconds(left / FASTCYCLES_MHZ);
+    }
+    slot_tail( d, late+c.pdsample+c.rsth );
+    TRACE_END( "onewire.reset" );
+    return r;
+}
+
+// One write slot, from its start to the release, interrupts off. A 1 has
+// to come up before the devices sample, 15µs in, and a 0 must not stay
+// low more than 120µs (tLOW0 max, 16µs at overdrive): past that it is
+// neither a slot nor a reset, so even preemptible the low phase of a 0
+// cannot be handed back, only the recovery after it.
+template<class P>
+inline __attribute__((always_inline))
+void OneWire::write_slot_t(P p, MultiDelay& d, uint32_t low)
+{
+    timeCriticalEnter() {
+        d.reset();
+        p.low();
+        p.output();  // drive output low
+        d.waitUntilCycles( low );
+        // p.high();   // drive output high
+        // d.waitUntilCycles( low + c.apu ); // active pullup time
+        p.input();   // return to input mode and let the pullup do the job (safer)
+    } timeCriticalExit();
+}
+
+// Write a bit.
+template<class P>
+void OneWire::write_bit_t(P p, uint8_t v)
+{
+    TRACE_BEGIN_V( "onewire.write_bit", v & 1 );
+    const OneWireTiming& c = timing_cycles;
+    MultiDelay d;
+    write_slot_t( p, d, (v & 1) ? c.low1 : c.low0 );
+    slot_tail( d, c.slot );
+    TRACE_END( "onewire.write_bit" );
+}
+
+// Write a byte, LSB first. The waveform, the low time of each slot, is
+// worked out before the first slot: between the edges there is only the
+// wait loop.
+template<class P>
+void OneWire::write_byte_t(P p, uint8_t v)
+{
+    TRACE_BEGIN_V( "onewire.write_byte", v );
+    const OneWireTiming& c = timing_cycles;
+    uint32_t low[8];
+    for (uint8_t i = 0; i < 8; i++)
+        low[i] = ((v >> i) & 1) ? c.low1 : c.low0;
+    MultiDelay d;
+    for (uint8_t i = 0; i < 8; i++) {
+        write_slot_t( p, d, low[i] );
+        slot_tail( d, c.slot );
+    }
+    TRACE_END( "onewire.write_byte" );
+}
+
+// One read slot, from its start to the sample, interrupts off.
+template<class P>
+inline __attribute__((always_inline))
+bool OneWire::read_slot_t(P p, MultiDelay& d)
+{
+    const OneWireTiming& c = timing_cycles;
+    bool r;
+    timeCriticalEnter() {
+        d.reset();
+        p.output();      // drive output low
+        p.low();
+        d.waitUntilCycles( c.drive_low );
+        p.input();     // let pin float, resistor pull up only
+
+        // This is for profiling only
+        // for(;;) {
+        //     transition_time = d.elapsedCycles();
+        //     if( p.read() || transition_time > c.slot ) 
+        //         break;
+        // }
+        d.waitUntilCycles( c.rdv );
+        r = p.read();
+    } timeCriticalExit();
+    return r;
+}
+
+// Read a bit and shift it into crc, poly 0 for no CRC. The CRC runs
+// after the sample, in the time left in the slot.
+template<class P>
+bool OneWire::read_bit_t(P p, uint16_t& crc, uint16_t poly)
+{
+    TRACE_BEGIN( "onewire.read_bit" );
+    MultiDelay d;
+    bool r = read_slot_t( p, d );
+    crc = (crc >> 1) ^ (-((crc ^ r) & 1) & poly);
+    slot_tail( d, timing_cycles.slot );
+    TRACE_END( "onewire.read_bit" );
+    return r;
+}
+
+// Read a byte, LSB first, same as read_bit_t() 8 times with one trace
+// event and no calls between the slots.
+template<class P>
+uint8_t OneWire::read_byte_t(P p, uint16_t& crc, uint16_t poly)
+{
+    TRACE_BEGIN( "onewire.read_byte" );
+    uint8_t v = 0;
+    MultiDelay d;
+    for (uint8_t i = 0; i < 8; i++) {
+        bool r = read_slot_t( p, d );
+        v |= r << i;
+        crc = (crc >> 1) ^ (-((crc ^ r) & 1) & poly);
+        slot_tail( d, timing_cycles.slot );
+    }
+    TRACE_END( "onewire.read_byte" );
+    return v;
+}
+
+// A write 1 slot, returns the cycles from release to high, or -1 if the
+// wire didn't come up before the end of the slot.
+template<class P>
+int OneWire::measure_rise_t(P p)
+{
+    const OneWireTiming& c = timing_cycles;
+    int t = -1;
+    MultiDelay d;
+    timeCriticalEnter() {
+        d.reset();
+        p.low();
+        p.output();
+        d.waitUntilCycles( c.low1 );
+        p.input();
+        int released = d.elapsedCycles();
+        for(;;) {
+            int e = d.elapsedCycles();
+            if( p.read() ) {
+                t = e - released;
+                break;
+            }
+            if( e > (int)c.slot )
+                break;
+        }
+    } timeCriticalExit();
+    d.waitUntilCycles( c.slot );
+    return t;
+}
+
+// A read slot, returns the cycles from its start to the wire being high
+// again: the end of a device's 0 plus rise time, or about drive_low plus
+// rise time for a 1. -1 if it stays low.
+template<class P>
+int OneWire::measure_read_slot_t(P p)
+{
+    const OneWireTiming& c = timing_cycles;
+    int t = -1;
+    MultiDelay d;
+    timeCriticalEnter() {
+        d.reset();
+        p.output();
+        p.low();
+        d.waitUntilCycles( c.drive_low );
+        p.input();
+        for(;;) {
+            int e = d.elapsedCycles();
+            if( p.read() ) {
+                t = e;
+                break;
+            }
+            if( e > (int)(c.slot + c.slot/2) )
+                break;
+        }
+    } timeCriticalExit();
+    d.waitUntilCycles( c.slot + c.slot/2 );
+    return t;
+}
+
+#endif // OneWire_slots_h
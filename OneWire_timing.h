@@ -0,0 +1,37 @@
+#ifndef OneWire_timing_h
+#define OneWire_timing_h
+
+// Slot timings in µs, shared by the blocking and the interrupt-driven
+// engines. Internal: only include this from .cpp files.
+
+// Reset LOW duration
+#define tRSTL   500
+
+// Write 0 bit LOW duration, 60-120µs
+#define tLOW0 60
+
+// Write 1 bit LOW duration, 1-15µs
+#define tLOW1 9
+
+// Active pull-up time, µs
+#define tAPU 2
+
+// Slot time, 60-120µs = maximum tLOW + tHIGH, so must be higher than both values above
+#define tSLOT 80
+
+// Recovery between the release of a slot and the next falling edge, at
+// least 1µs; more leaves the pull-up time on a loaded bus
+#define tREC 5
+
+// For reads, time to drive the wire low
+#define tDRIVElow 9
+
+// For read, time to sample, counted from the beginning of the low pulse
+#define tRDV 18
+
+// After a reset, time to sample the presence pulse, counted from the
+// beginning of the low pulse, and time until the end of the presence pulse.
+#define tPDSAMPLE (tRSTL + 70)
+#define tRSTH 410
+
+#endif // OneWire_timing_h
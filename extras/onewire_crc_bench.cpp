@@ -0,0 +1,126 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  Speed of the CRC variants of OneWireCRC.h, on the PC.
+ *
+ *  The virtual clock of the host backend only counts register
+ *  accesses, so this one measures real time stamp counter cycles
+ *  (x86) instead: the ratios between variants are what matters,
+ *  the ESP32 numbers will differ.
+ *
+ *      g++ -O2 -DFASTMILLIS_HOST -I. -o onewire_crc_bench extras/onewire_crc_bench.cpp OneWireCRC.cpp
+ *      ./onewire_crc_bench
+ *
+ *  One JSON object per line. Each variant runs over a 9 byte
+ *  scratchpad and a 4kB buffer, best of 64 runs.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <x86intrin.h>
+#include <initializer_list>
+
+#include "config.h"
+#include "OneWireCRC.h"
+
+static volatile uint32_t sink;
+
+template< class F >
+static void bench( const char* name, const uint8_t* buf, uint32_t len, F f ) {
+    uint64_t best = UINT64_MAX;
+    for( int run=0; run<64; run++ ) {
+        uint64_t t0 = __rdtsc();
+        sink = f( buf, len );
+        uint64_t t = __rdtsc() - t0;
+        if( t < best ) best = t;
+    }
+    printf( "{\"bench\":\"%s\",\"bytes\":%u,\"cycles\":%llu,\"bytes_per_cycle\":%.4f}\n",
+        name, (unsigned)len, (unsigned long long)best, double(len) / best );
+}
+
+// The CRC the way read_bytes_crc() runs it: one bit per slot.
+static uint32_t crc8_per_bit( const uint8_t* p, uint32_t len ) {
+    uint8_t crc = 0;
+    while( len-- ) {
+        uint8_t b = *p++;
+        for( int i=0; i<8; i++ )
+            crc = onewire_crc::crc8_bit( crc, (b >> i) & 1 );
+    }
+    return crc;
+}
+
+static uint32_t crc16_per_bit( const uint8_t* p, uint32_t len ) {
+    uint16_t crc = 0;
+    while( len-- ) {
+        uint8_t b = *p++;
+        for( int i=0; i<8; i++ )
+            crc = onewire_crc::crc16_bit( crc, (b >> i) & 1 );
+    }
+    return crc;
+}
+
+int main() {
+    static uint8_t buf[4096];
+    uint32_t x = 1;
+    for( uint8_t& b : buf ) {
+        x = x * 1103515245 + 12345;
+        b = x >> 16;
+    }
+
+    // all the variants must agree
+    uint8_t c8 = onewire_crc::crc8_bitwise( buf, sizeof(buf) );
+    uint16_t c16 = onewire_crc::crc16_bitwise( buf, sizeof(buf) );
+    bool ok = onewire_crc::crc8_nibble( buf, sizeof(buf) ) == c8
+           && onewire_crc::crc8_table( buf, sizeof(buf) ) == c8
+           && crc8_per_bit( buf, sizeof(buf) ) == c8
+           && onewire_crc::crc16_parity( buf, sizeof(buf) ) == c16
+           && onewire_crc::crc16_table( buf, sizeof(buf) ) == c16
+           && crc16_per_bit( buf, sizeof(buf) ) == c16;
+
+    // data + CRC leaves 0 (CRC8) or the residue (inverted CRC16)
+    OneWireCRC8 crc8;
+    crc8.update( buf, 8 );
+    uint8_t b8 = crc8.value;
+    crc8.update( b8 );
+    OneWireCRC16 crc16;
+    crc16.update( buf, 8 );
+    uint16_t inv = ~crc16.value;
+    crc16.update( uint8_t( inv ));
+    crc16.update( uint8_t( inv >> 8 ));
+    ok = ok && crc8.valid() && crc16.valid();
+    printf( "{\"run\":\"onewire_crc_bench\",\"unit\":\"tsc\",\"variants_agree\":%d}\n", ok );
+
+    for( uint32_t len : { 9u, uint32_t( sizeof(buf) ) } ) {
+        bench( "crc8_bitwise",  buf, len, []( const uint8_t* p, uint32_t n ) -> uint32_t { return onewire_crc::crc8_bitwise( p, n ); } );
+        bench( "crc8_nibble",   buf, len, []( const uint8_t* p, uint32_t n ) -> uint32_t { return onewire_crc::crc8_nibble( p, n ); } );
+        bench( "crc8_table",    buf, len, []( const uint8_t* p, uint32_t n ) -> uint32_t { return onewire_crc::crc8_table( p, n ); } );
+        bench( "crc8_per_bit",  buf, len, crc8_per_bit );
+        bench( "crc16_bitwise", buf, len, []( const uint8_t* p, uint32_t n ) -> uint32_t { return onewire_crc::crc16_bitwise( p, n ); } );
+        bench( "crc16_parity",  buf, len, []( const uint8_t* p, uint32_t n ) -> uint32_t { return onewire_crc::crc16_parity( p, n ); } );
+        bench( "crc16_table",   buf, len, []( const uint8_t* p, uint32_t n ) -> uint32_t { return onewire_crc::crc16_table( p, n ); } );
+        bench( "crc16_per_bit", buf, len, crc16_per_bit );
+    }
+    return 0;
+}
@@ -0,0 +1,524 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  1-Wire throughput on simulated buses (OneWireSim.h).
+ *  Runs on the PC against the virtual clock, so the times are
+ *  bus time, deterministic, and can be diffed between commits:
+ *
+ *      g++ -O2 -pthread -DFASTMILLIS_HOST -I. -o onewire_sim_bench extras/onewire_sim_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp trace.cpp OneWire.cpp OneWireCRC.cpp OneWireAsync.cpp \
+ *          OneWireMultiBus.cpp OneWireDeviceTable.cpp OneWireThermometers.cpp OneWireWorker.cpp OneWireSim.cpp
+ *      ./onewire_sim_bench [devices]
+ *
+ *  (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line, times in simulated µs.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "OneWire.h"
+#include "OneWireAsync.h"
+#include "OneWireMultiBus.h"
+#include "OneWireDeviceTable.h"
+#include "OneWireThermometers.h"
+#include "OneWireWorker.h"
+#include <thread>
+
+static uint64_t lcg_state = 0x123456789ULL;
+static uint64_t lcg() {
+    lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return lcg_state >> 16;
+}
+
+struct Stopwatch {
+    uint64_t start = fastmicros64();
+    uint64_t us() const { return fastmicros64() - start; }
+};
+
+static void print( const char* bench, uint32_t devices, uint32_t ok, uint64_t us, const OneWireSimBus& bus ) {
+    printf( "{\"bench\":\"%s\",\"devices\":%u,\"ok\":%u,\"us\":%llu,\"us_per_device\":%.1f,\"slots\":%u,\"resets\":%u,\"glitches\":%u,\"overlong\":%u}\n",
+        bench, (unsigned)devices, (unsigned)ok, (unsigned long long)us, devices ? double(us) / devices : 0.0,
+        (unsigned)bus.slots, (unsigned)bus.resets, (unsigned)bus.glitches, (unsigned)bus.overlong );
+}
+
+static void clear( OneWireSimBus& bus ) {
+    bus.slots = bus.resets = bus.glitches = bus.overlong = 0;
+}
+
+/*  Full search, checks that every ROM comes out once with a good CRC.
+*/
+static uint32_t search_all( OneWire& ow, std::vector<OneWireSimDS18B20*>& devs ) {
+    uint8_t addr[8];
+    uint32_t found = 0;
+    ow.reset_search();
+    while( ow.search( addr )) {
+        if( OneWire::crc8( addr, 7 ) != addr[7] )
+            continue;
+        for( OneWireSimDS18B20* d : devs )
+            if( !memcmp( d->rom, addr, 8 ))
+                found++;
+    }
+    return found;
+}
+
+/*  Reads every scratchpad with Match ROM, counts the good ones.
+*/
+template< class OW >
+static uint32_t read_all( OW& ow, std::vector<OneWireSimDS18B20*>& devs ) {
+    uint32_t ok = 0;
+    for( OneWireSimDS18B20* d : devs ) {
+        uint8_t sp[9];
+        if( !ow.reset() )
+            continue;
+        ow.select( d->rom );
+        ow.write( 0xBE );
+        ow.read_bytes( sp, 9 );
+        int16_t raw = sp[0] | (sp[1] << 8);
+        if( OneWire::crc8( sp, 8 ) == sp[8] && raw == int16_t( d->temperature * 16 ))
+            ok++;
+    }
+    return ok;
+}
+
+/*  Reads the PIO registers of every DS2408, counts the good CRCs.
+*/
+static uint32_t read_registers_all( OneWire& ow, std::vector<OneWireSimDS2408*>& devs ) {
+    uint32_t ok = 0;
+    for( OneWireSimDS2408* d : devs ) {
+        uint8_t buf[13] = { 0xF0, 0x88, 0x00 };     // Read PIO Registers
+        if( !ow.reset() )
+            continue;
+        ow.select( d->rom );
+        ow.write_bytes( buf, 3 );
+        ow.read_bytes( buf+3, 10 );
+        if( OneWire::check_crc16( buf, 11, &buf[11] ))
+            ok++;
+    }
+    return ok;
+}
+
+int main( int argc, char** argv ) {
+    uint32_t n = argc > 1 ? atoi( argv[1] ) : 100;
+    if( n > 1000 ) n = 1000;
+    init_TIMG0();
+
+    OneWireSimBus bus( 4 );
+    std::vector<OneWireSimDS18B20*> devs;
+    for( uint32_t i=0; i<n; i++ ) {
+        OneWireSimDS18B20* d = new OneWireSimDS18B20( lcg() );
+        d->set_temperature( (int32_t( lcg() % 1600 ) - 400) / 16.0f );
+        bus.attach( *d );
+        devs.push_back( d );
+    }
+    OneWireSimDS2408 ds2408( lcg() );
+    bus.attach( ds2408 );
+
+    OneWire ow( 4 );
+    printf( "{\"run\":\"onewire_sim_bench\",\"backend\":\"host-virtual\",\"cpu_mhz\":%u}\n", (unsigned)getCpuFrequencyMhz() );
+
+    {   clear( bus );
+        Stopwatch sw;
+        uint32_t found = search_all( ow, devs );
+        print( "search", n, found, sw.us(), bus );
+    }
+
+    /*  Device table: cold scan, warm boot from the checkpoint, then one
+        round of step() after 2 devices were plugged in and 1 removed.
+    */
+    {   static OneWireDeviceTable table;
+        table.begin( ow );
+        clear( bus );
+        Stopwatch sw;
+        uint32_t found = table.scan();
+        print( "table_scan", n+1, found, sw.us(), bus );
+        table.save( "onewire_sim_bench.tbl" );
+
+        clear( bus );
+        sw = Stopwatch();
+        bool ok = table.load( "onewire_sim_bench.tbl" );
+        print( "table_load", n+1, ok ? table.count() : 0, sw.us(), bus );
+        remove( "onewire_sim_bench.tbl" );
+
+        OneWireSimDS18B20 plugged1( lcg() ), plugged2( lcg() );
+        bus.attach( plugged1 );
+        bus.attach( plugged2 );
+        bus.detach( *devs[0] );
+        table.miss_limit = 1;
+        clear( bus );
+        sw = Stopwatch();
+        uint32_t changes = 0;
+        for( uint32_t i=0; i<=n; i++ )      // the DS18B20s and the DS2408
+            changes += table.step();
+        ok = changes == 3 && table.find( plugged1.rom ) >= 0 && table.find( plugged2.rom ) >= 0 && table.find( devs[0]->rom ) < 0;
+        print( "table_step_round", n+1, ok, sw.us(), bus );
+        bus.detach( plugged1 );
+        bus.detach( plugged2 );
+        bus.attach( *devs[0] );
+    }
+
+    {   clear( bus );
+        Stopwatch sw;
+        ow.reset();
+        ow.skip();
+        ow.write( 0x44 );           // Convert T, all devices
+        while( !ow.read_bit() )
+            fastmillis_host::advance_us( 1000 );
+        print( "convert_all", n, 1, sw.us(), bus );
+    }
+
+    {   clear( bus );
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        print( "read_scratchpad", n, ok, sw.us(), bus );
+    }
+
+    {   clear( bus );
+        OneWireAsync owa( ow );
+        owa.begin();
+        Stopwatch sw;
+        uint32_t ok = read_all( owa, devs );
+        print( "read_scratchpad_async", n, ok, sw.us(), bus );
+    }
+
+    /*  The same reads as transactions, run by the worker thread while
+        this one only submits and collects. The main thread must not
+        touch the virtual clock while the worker runs.
+    */
+    {   static OneWireWorker worker;
+        static OneWireTransaction tr[1000];
+        static uint8_t sp[1000][9];
+        static const uint8_t read_scratchpad = 0xBE;
+        clear( bus );
+        Stopwatch sw;
+        worker.begin();
+        uint32_t next = 0, got = 0, ok = 0;
+        while( got < n ) {
+            if( next < n ) {
+                OneWireTransaction& t = tr[next];
+                t.ow = &ow;
+                t.flags = OneWireTransaction::RESET | OneWireTransaction::SELECT | OneWireTransaction::CRC8;
+                memcpy( t.rom, devs[next]->rom, 8 );
+                t.wbuf = &read_scratchpad;
+                t.wlen = 1;
+                t.rbuf = sp[next];
+                t.rlen = 9;
+                if( worker.submit( t ))
+                    next++;
+            }
+            if( OneWireTransaction* t = worker.poll() ) {
+                uint32_t i = t - tr;
+                if( t->status == OneWireTransaction::OK && int16_t( sp[i][0] | (sp[i][1] << 8) ) == int16_t( devs[i]->temperature * 16 ))
+                    ok++;
+                got++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        worker.end();
+        print( "read_scratchpad_worker", n, ok, sw.us(), bus );
+    }
+
+    {   clear( bus );
+        bus.noise = 1e-3f;
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        print( "read_scratchpad_noise_1e-3", n, ok, sw.us(), bus );
+        bus.noise = 0;
+    }
+
+    /*  Preemptible slots: the tail of every slot goes to a hook. The
+        first run only counts the time handed back, the second one
+        overstays every tail by 100µs, as other work would: slower, still correct.
+    */
+    for( uint32_t overstay_us : { 0, 100 } ) {
+        static uint64_t handed_back;
+        static uint32_t overstay;
+        handed_back = 0;
+        overstay = overstay_us;
+        ow.set_preemptible( true, []( uint32_t cycles ) {
+            handed_back += cycles;
+            fastmillis_host::delay_us( overstay );
+        } );
+        clear( bus );
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        print( overstay_us ? "read_scratchpad_preemptible_overstay_100us" : "read_scratchpad_preemptible", n, ok, sw.us(), bus );
+        printf( "{\"handed_back_us\":%llu}\n", (unsigned long long)(handed_back / getCpuFrequencyMhz()) );
+        ow.set_preemptible( false );
+    }
+
+    /*  Preemption: 100µs of interrupts every 300µs. A write 0 whose low
+        phase runs with interrupts on, open-coded on the bus here, gets
+        stretched past tLOW0 max (120µs) by every one that lands in it,
+        and the devices lose the frame. The slots of OneWire keep that
+        phase critical: the interrupts wait for the release, and land in
+        the recovery.
+    */
+    {
+        fastmillis_host::set_preemption( 300, 100 );
+        clear( bus );
+        Stopwatch sw;
+        const uint32_t writes = 64;
+        for( uint32_t i = 0; i < writes; i++ ) {
+            bus.drive( true );
+            fastmillis_host::delay_us( 60 );
+            bus.drive( false );
+            fastmillis_host::delay_us( 10 );
+        }
+        print( "write0_interrupts_on_preempted", writes, writes - bus.overlong, sw.us(), bus );
+        for( bool preemptible : { false, true } ) {
+            ow.set_preemptible( preemptible, OneWire::yield_tail );
+            clear( bus );
+            Stopwatch sw;
+            uint32_t ok = read_all( ow, devs );
+            print( preemptible ? "read_scratchpad_preemptible_preempted" : "read_scratchpad_preempted", n, ok, sw.us(), bus );
+        }
+        ow.set_preemptible( false );
+        fastmillis_host::set_preemption( 0, 0 );
+    }
+
+    /*  Whole sweeps: one Convert T, then every scratchpad, retrying the
+        failed ones. ok counts readings that match the set temperature.
+    */
+    for( float noise : { 0.0f, 1e-3f } ) {
+        static OneWireThermometers temps;
+        temps.begin( ow );
+        for( OneWireSimDS18B20* d : devs )
+            temps.add( d->rom );
+        clear( bus );
+        bus.noise = noise;
+        Stopwatch sw;
+        temps.sweep();
+        uint32_t ok = 0;
+        for( uint32_t i=0; i<n; i++ )
+            if( temps.reading(i).ok && temps.reading(i).celsius() == devs[i]->temperature )
+                ok++;
+        print( noise ? "thermometers_sweep_noise_1e-3" : "thermometers_sweep", n, ok, sw.us(), bus );
+        printf( "{\"convert_to_done_us\":%llu,\"crc_errors\":%u,\"retried\":%u}\n",
+            (unsigned long long)(temps.done_us - temps.convert_us), (unsigned)temps.crc_errors, (unsigned)temps.retried );
+        bus.noise = 0;
+    }
+
+    {   clear( bus );
+        bus.rise_ns = 12000;        // long cable: 1s read back as 0s at tRDV
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        print( "read_scratchpad_rise_12us", n, ok, sw.us(), bus );
+        bus.rise_ns = 500;
+    }
+
+    {   clear( bus );
+        bus.rise_ns = 8000;         // within what long_line leaves before tRDV
+        ow.set_timing( OneWireTiming::long_line );
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        print( "read_scratchpad_long_line_rise_8us", n, ok, sw.us(), bus );
+        ow.set_timing( OneWireTiming::standard );
+        bus.rise_ns = 500;
+    }
+
+    /*  Same reads after calibrate(), on this bus and on a slow one.
+    */
+    for( uint32_t rise : { 500, 12000 } ) {
+        char name[64];
+        bus.rise_ns = rise;
+        bool ok_cal = ow.calibrate();
+        const OneWireCalibration& cal = ow.calibration();
+        printf( "{\"calibrate\":%d,\"bus_rise_ns\":%u,\"rise_ns\":%u,\"hold_ns\":%u,\"rdv_ns\":%u,\"slot_ns\":%u}\n",
+            ok_cal, (unsigned)rise, (unsigned)cal.rise_ns, (unsigned)cal.hold_ns,
+            (unsigned)ow.timing().rdv, (unsigned)ow.timing().slot );
+        clear( bus );
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        snprintf( name, sizeof(name), "read_scratchpad_calibrated_rise_%uns", (unsigned)rise );
+        print( name, n, ok, sw.us(), bus );
+    }
+    bus.rise_ns = 500;
+    ow.set_timing( OneWireTiming::standard );
+
+    {   clear( bus );
+        Stopwatch sw;
+        uint8_t buf[13] = { 0xF0, 0x88, 0x00 };     // Read PIO Registers
+        ow.reset();
+        ow.select( ds2408.rom );
+        ow.write_bytes( buf, 3 );
+        ow.read_bytes( buf+3, 10 );
+        bool ok = OneWire::check_crc16( buf, 11, &buf[11] );
+        print( "ds2408_read_registers", 1, ok, sw.us(), bus );
+    }
+
+    {   clear( bus );
+        Stopwatch sw;
+        uint8_t buf[13] = { 0xF0, 0x88, 0x00 };
+        OneWireCRC16 crc;
+        ow.reset();
+        ow.select( ds2408.rom );
+        ow.write_bytes( buf, 3 );
+        crc.update( buf, 3 );
+        ow.read_bytes_crc( buf+3, 10, crc );    // CRC done with the last slot
+        print( "ds2408_read_registers_streamed_crc", 1, crc.valid(), sw.us(), bus );
+    }
+
+    /*  DS2408s on their own bus, standard speed then overdrive.
+    */
+    {
+        OneWireSimBus od_bus( 21 );
+        std::vector<OneWireSimDS2408*> switches;
+        for( uint32_t i=0; i<n; i++ ) {
+            switches.push_back( new OneWireSimDS2408( lcg() ));
+            od_bus.attach( *switches.back() );
+        }
+        OneWire od( 21 );
+
+        Stopwatch sw;
+        uint32_t ok = read_registers_all( od, switches );
+        print( "ds2408_read_registers_standard", n, ok, sw.us(), od_bus );
+
+        clear( od_bus );
+        sw = Stopwatch();
+        od.reset();
+        od.overdrive_skip();        // everybody to overdrive
+        ok = read_registers_all( od, switches );
+        print( "ds2408_read_registers_overdrive", n, ok, sw.us(), od_bus );
+
+        od.set_timing( OneWireTiming::standard );
+        od.reset();                 // back to standard speed
+        for( OneWireSimDS2408* d : switches )
+            delete d;
+    }
+
+    /*  DS18B20s on GPIO 33, through OneWireT: the slots drive and sample
+        the pin with the registers of pins 32-39 (out1_w1tc, in1...).
+    */
+    {
+        OneWireSimBus bus33( 33 );
+        std::vector<OneWireSimDS18B20*> temps33;
+        for( uint32_t i=0; i<8; i++ ) {
+            temps33.push_back( new OneWireSimDS18B20( 0x3300 + i ));
+            temps33.back()->set_temperature( -10.0f + i * 4.5f );
+            bus33.attach( *temps33.back() );
+        }
+        OneWireT<33> ow33;
+
+        Stopwatch sw;
+        bool presence = ow33.reset();
+        print( "gpio33_reset", 8, presence, sw.us(), bus33 );
+
+        clear( bus33 );
+        sw = Stopwatch();
+        uint32_t found = search_all( ow33, temps33 );
+        print( "gpio33_search", 8, found, sw.us(), bus33 );
+
+        ow33.reset();
+        ow33.skip();
+        ow33.write( 0x44 );
+        while( !ow33.read_bit() )
+            fastmillis_host::advance_us( 1000 );
+        clear( bus33 );
+        sw = Stopwatch();
+        uint32_t ok = read_all( ow33, temps33 );
+        print( "gpio33_read_scratchpad", 8, ok, sw.us(), bus33 );
+        for( OneWireSimDS18B20* d : temps33 )
+            delete d;
+    }
+
+    /*  The CPU down to 80MHz: the next reset recomputes the slot timings
+        in cycles of the new clock.
+    */
+    {   cpu_clock_set_mhz( 80 );
+        clear( bus );
+        Stopwatch sw;
+        uint32_t ok = read_all( ow, devs );
+        print( "read_scratchpad_cpu_80mhz", n, ok, sw.us(), bus );
+        cpu_clock_set_mhz( 240 );
+    }
+
+    /*  Resets sleep through their recovery once hybrid delays are calibrated,
+        then every slot tail long enough with sleep_tail. Same bus time, the
+        CPU time slept is handed back. Resets sleep from now on, the
+        multibus one too.
+    */
+    {   bool cal = hybridDelayBegin();
+        printf( "{\"hybrid_delay_begin\":%d,\"spin_us\":%u,\"wake_latency_ns\":%u}\n",
+            cal, (unsigned)hybrid_delay.spin_us, (unsigned)fastmillis_host::wake_latency_ns );
+        for( bool tails : { false, true } ) {
+            hybrid_delay.reset_stats();
+            ow.set_preemptible( tails, OneWire::sleep_tail );
+            clear( bus );
+            Stopwatch sw;
+            uint32_t ok = read_all( ow, devs );
+            print( tails ? "read_scratchpad_hybrid_sleep_tail" : "read_scratchpad_hybrid_reset", n, ok, sw.us(), bus );
+            printf( "{\"slept_us\":%llu,\"spun_us\":%llu,\"sleeps\":%u,\"overslept\":%u,\"wake_late_max_us\":%d}\n",
+                (unsigned long long)hybrid_delay.slept_us,
+                (unsigned long long)(hybrid_delay.spun_cycles / FASTCYCLES_MHZ),
+                (unsigned)hybrid_delay.sleeps, (unsigned)hybrid_delay.overslept, (int)hybrid_delay.wake_max );
+        }
+        ow.set_preemptible( false );
+    }
+
+    /*  The same devices split over 8 buses, read in parallel.
+    */
+    {
+        static const uint8_t pins[8] = { 12, 13, 14, 15, 16, 17, 18, 19 };
+        OneWireSimBus* buses[8];
+        std::vector<OneWireSimDS18B20*> per_bus[8];
+        for( int b=0; b<8; b++ )
+            buses[b] = new OneWireSimBus( pins[b] );
+        for( uint32_t i=0; i<n; i++ ) {
+            buses[i%8]->attach( *devs[i] );
+            per_bus[i%8].push_back( devs[i] );
+        }
+        OneWireMultiBus mb;
+        mb.begin( pins, 8 );
+        uint32_t ok = 0;
+        Stopwatch sw;
+        for( uint32_t i=0; i<(n+7)/8; i++ ) {
+            uint8_t roms[8][8] = {};
+            uint32_t mask = 0;
+            for( int b=0; b<8; b++ )
+                if( i < per_bus[b].size() ) {
+                    memcpy( roms[b], per_bus[b][i]->rom, 8 );
+                    mask |= 1 << b;
+                }
+            mb.set_active( mask );
+            mb.reset();
+            mb.select( roms );
+            mb.write_all( 0xBE );
+            uint8_t sp[8*9];
+            mb.read_bytes( sp, 9 );
+            for( int b=0; b<8; b++ )
+                if( (mask >> b) & 1 && OneWire::crc8( sp + b*9, 8 ) == sp[b*9+8] )
+                    ok++;
+        }
+        print( "read_scratchpad_multibus_8", n, ok, sw.us(), *buses[0] );
+    }
+
+    return 0;
+}
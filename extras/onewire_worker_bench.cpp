@@ -0,0 +1,163 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  OneWireWorker (OneWireWorker.h) with several producers, on the PC.
+ *
+ *  Producer threads each read the scratchpad of their own DS18B20
+ *  on a simulated bus, submitting transactions as fast as the
+ *  queue takes them, with up to ONEWIRE_WORKER_QUEUE / producers
+ *  in flight each, so that completions can't be lost. The main
+ *  thread polls the completions and checks that every transaction
+ *  comes back once, with the right temperature, and that each
+ *  producer's come back in the order it submitted them.
+ *  Only the worker thread moves the virtual clock.
+ *
+ *      g++ -O2 -pthread -DFASTMILLIS_HOST -I. -o onewire_worker_bench extras/onewire_worker_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp trace.cpp OneWire.cpp OneWireCRC.cpp OneWireWorker.cpp OneWireSim.cpp
+ *      ./onewire_worker_bench [producers] [transactions per producer]
+ *
+ *  The same with -O1 -g -fsanitize=thread checks the queues for
+ *  data races. (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "OneWire.h"
+#include "OneWireWorker.h"
+
+static const uint32_t MAX_PRODUCERS = 8;
+
+struct Producer {
+    std::vector<OneWireTransaction> tr;
+    std::vector<uint8_t> sp;            // 9 bytes per transaction
+    OneWireSimDS18B20* dev;
+    uint32_t rejected = 0;              // submit() found the queue full
+    uint32_t next_done = 0;             // next index expected back
+};
+
+int main( int argc, char** argv ) {
+    uint32_t producers = argc > 1 ? atoi( argv[1] ) : 4;
+    uint32_t n = argc > 2 ? atoi( argv[2] ) : 100;
+    if( producers < 1 ) producers = 1;
+    if( producers > MAX_PRODUCERS ) producers = MAX_PRODUCERS;
+    const uint32_t in_flight = ONEWIRE_WORKER_QUEUE / producers;
+    init_TIMG0();
+
+    OneWireSimBus bus( 4 );
+    static Producer p[MAX_PRODUCERS];
+    for( uint32_t i=0; i<producers; i++ ) {
+        p[i].dev = new OneWireSimDS18B20( 0x1000 + i );
+        p[i].dev->set_temperature( 10.0f + i * 1.5f );
+        bus.attach( *p[i].dev );
+        p[i].tr.resize( n );
+        p[i].sp.resize( n * 9 );
+    }
+    OneWire ow( 4 );
+    static const uint8_t read_scratchpad = 0xBE;
+
+    // Convert T before the worker starts, while this thread still owns the clock
+    ow.reset();
+    ow.skip();
+    ow.write( 0x44 );
+    while( !ow.read_bit() )
+        fastmillis_host::advance_us( 1000 );
+
+    static OneWireWorker worker;
+    worker.begin();
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for( uint32_t i=0; i<producers; i++ ) {
+        threads.emplace_back( [&, i] {
+            Producer& me = p[i];
+            for( uint32_t j=0; j<n; j++ ) {
+                // wait for a slot of our own, then for room in the queue
+                while( j >= in_flight && !me.tr[j - in_flight].done() )
+                    std::this_thread::yield();
+                OneWireTransaction& t = me.tr[j];
+                t.ow = &ow;
+                t.flags = OneWireTransaction::RESET | OneWireTransaction::SELECT | OneWireTransaction::CRC8;
+                memcpy( t.rom, me.dev->rom, 8 );
+                t.wbuf = &read_scratchpad;
+                t.wlen = 1;
+                t.rbuf = &me.sp[j * 9];
+                t.rlen = 9;
+                t.user = &me;
+                while( !worker.submit( t )) {
+                    me.rejected++;
+                    std::this_thread::yield();
+                }
+            }
+        } );
+    }
+
+    uint32_t got = 0, ok = 0, foreign = 0, out_of_order = 0;
+    const uint32_t total = producers * n;
+    while( got < total ) {
+        OneWireTransaction* t = worker.poll();
+        if( !t ) {
+            std::this_thread::yield();
+            continue;
+        }
+        got++;
+        Producer* me = (Producer*)t->user;
+        if( me < p || me >= p + producers ) {
+            foreign++;
+            continue;
+        }
+        uint32_t j = t - me->tr.data();
+        if( j != me->next_done )
+            out_of_order++;
+        me->next_done = j + 1;
+        const uint8_t* sp = &me->sp[j * 9];
+        if( t->status == OneWireTransaction::OK && int16_t( sp[0] | (sp[1] << 8) ) == int16_t( me->dev->temperature * 16 ))
+            ok++;
+    }
+    for( std::thread& th : threads )
+        th.join();
+    worker.end();
+    double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+    uint32_t rejected = 0, not_done = 0;
+    for( uint32_t i=0; i<producers; i++ ) {
+        rejected += p[i].rejected;
+        for( const OneWireTransaction& t : p[i].tr )
+            not_done += !t.done();
+    }
+    printf( "{\"bench\":\"worker_producers\",\"producers\":%u,\"transactions\":%u,\"ok\":%u,\"foreign\":%u,\"out_of_order\":%u,\"not_done\":%u,"
+            "\"submitted\":%u,\"completed\":%u,\"rejected\":%u,\"lost_completions\":%u,\"bus_us\":%llu,\"wall_ms\":%.1f}\n",
+        (unsigned)producers, (unsigned)total, (unsigned)ok, (unsigned)foreign, (unsigned)out_of_order, (unsigned)not_done,
+        (unsigned)worker.submitted, (unsigned)worker.completed, (unsigned)rejected, (unsigned)worker.lost_completions,
+        (unsigned long long)fastmicros64(), ms );
+    return ok == total && !out_of_order && !not_done && !worker.lost_completions ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  LogHistogramProfiler (profiler.h) against a sorted copy of the
+ *  samples, on the PC.
+ *
+ *  Each data set is recorded into profilers with 0, 3 and 5 sub-bucket
+ *  bits, and percentile() is compared with the sample of the same
+ *  rank, at every rank of the small sets: it must not be below it,
+ *  must be in the same bucket, and must be exact under 2^SUB_BITS.
+ *  The data sets are the edges (0, 1, each power of two and its
+ *  neighbours, UINT32_MAX), random values spread over all magnitudes,
+ *  both mixed, and one value repeated.
+ *  count(), min(), max() and mean() are checked too, and that every
+ *  value lies between bucket_low() and bucket_high() of its bucket.
+ *
+ *      g++ -O2 -DFASTMILLIS_HOST -I. -o profiler_bench extras/profiler_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp
+ *      ./profiler_bench [random samples] [seed]
+ *
+ *  (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line, per data set and SUB_BITS.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "profiler.h"
+
+static uint64_t lcg_state = 0x123456789ULL;
+static uint32_t lcg() {
+    lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return lcg_state >> 32;
+}
+
+// as many values of each bit length
+static uint32_t random_value() {
+    unsigned bits = lcg() % 33;
+    return bits == 32 ? lcg() : lcg() & ((uint32_t(1) << bits) - 1);
+}
+
+static std::vector<uint32_t> edges() {
+    std::vector<uint32_t> v = { 0, 1, 2, 3, 0xFFFFFFFE, 0xFFFFFFFF };
+    for( unsigned k=2; k<32; k++ ) {
+        uint32_t p = uint32_t(1) << k;
+        v.push_back( p - 1 );
+        v.push_back( p );
+        v.push_back( p + 1 );
+    }
+    return v;
+}
+
+static const float quantiles[] = { 0.0f, 0.001f, 0.01f, 0.1f, 0.25f, 0.5f, 0.75f, 0.9f, 0.99f, 0.999f, 1.0f };
+
+static bool all_ok = true;
+
+template< unsigned SUB_BITS >
+static void run( const char* name, const std::vector<uint32_t>& samples ) {
+    typedef LogHistogramProfiler< SUB_BITS > Prof;
+    static Prof p;              // too big for some stacks
+    p.reset();
+    uint64_t sum = 0;
+    uint32_t bucket_errors = 0;
+    for( uint32_t v : samples ) {
+        p.record( v );
+        sum += v;
+        unsigned b = Prof::bucket( v );
+        bucket_errors += b >= Prof::BUCKETS || v < Prof::bucket_low( b ) || v > Prof::bucket_high( b );
+    }
+    std::vector<uint32_t> sorted( samples );
+    std::sort( sorted.begin(), sorted.end() );
+    const uint32_t n = sorted.size();
+
+    /*  The fixed quantiles, 20 random ones, and in small sets every rank.
+        The reference takes the rank the way percentile() does.
+    */
+    const unsigned fixed = sizeof(quantiles) / sizeof(quantiles[0]);
+    const unsigned extra = n <= 1000 ? n : 20;
+    uint32_t checked = 0, below = 0, wrong_bucket = 0, inexact = 0, worst_err_ppm = 0;
+    for( unsigned i=0; i < fixed + extra; i++ ) {
+        float q = i < fixed ? quantiles[i] : n <= 1000 ? float( i - fixed + 1 ) / n : (lcg() % 1000001) * 1e-6f;
+        uint32_t rank = uint32_t( q * n + 0.5f );
+        if( rank < 1 ) rank = 1;
+        if( rank > n ) rank = n;
+        uint32_t ref = sorted[ rank - 1 ];
+        uint32_t got = p.percentile( q );
+        checked++;
+        below += got < ref;
+        wrong_bucket += Prof::bucket( got ) != Prof::bucket( ref );
+        inexact += ref < Prof::SUB && got != ref;
+        if( ref ) {
+            uint32_t ppm = uint32_t( (got - ref) * 1e6 / ref );
+            if( got >= ref && ppm > worst_err_ppm ) worst_err_ppm = ppm;
+        }
+    }
+    bool stats_ok = p.count() == n && p.min() == sorted.front() && p.max() == sorted.back()
+        && p.mean() == uint32_t( sum / n );
+    bool ok = !bucket_errors && !below && !wrong_bucket && !inexact && stats_ok
+        && worst_err_ppm <= 1000000u >> SUB_BITS;
+    all_ok &= ok;
+    printf( "{\"bench\":\"profiler_percentile\",\"data\":\"%s\",\"sub_bits\":%u,\"samples\":%u,\"checked\":%u,"
+            "\"below\":%u,\"wrong_bucket\":%u,\"inexact\":%u,\"bucket_errors\":%u,\"worst_err_ppm\":%u,\"stats_ok\":%s,\"ok\":%s}\n",
+        name, SUB_BITS, (unsigned)n, (unsigned)checked, (unsigned)below, (unsigned)wrong_bucket, (unsigned)inexact,
+        (unsigned)bucket_errors, (unsigned)worst_err_ppm, stats_ok ? "true" : "false", ok ? "true" : "false" );
+}
+
+template< unsigned SUB_BITS >
+static void run_all( const std::vector<std::vector<uint32_t>>& sets, const char* const* names ) {
+    for( size_t i=0; i<sets.size(); i++ )
+        run< SUB_BITS >( names[i], sets[i] );
+}
+
+int main( int argc, char** argv ) {
+    uint32_t n = argc > 1 ? atoi( argv[1] ) : 100000;
+    if( argc > 2 ) lcg_state = strtoull( argv[2], nullptr, 0 );
+    if( n < 1 ) n = 1;
+
+    std::vector<uint32_t> random, mixed, same( 1000, 0xFFFFFFFF ), zeros( 1000, 0 );
+    for( uint32_t i=0; i<n; i++ )
+        random.push_back( random_value() );
+    mixed = random;
+    for( uint32_t v : edges() )
+        mixed.insert( mixed.begin() + lcg() % (mixed.size() + 1), 1 + lcg() % 50, v );
+
+    static const char* const names[] = { "edges", "random", "mixed", "uint32_max", "zeros" };
+    const std::vector<std::vector<uint32_t>> sets = { edges(), random, mixed, same, zeros };
+    run_all< 0 >( sets, names );
+    run_all< 3 >( sets, names );
+    run_all< 5 >( sets, names );
+    return all_ok ? 0 : 1;
+}
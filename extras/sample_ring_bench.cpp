@@ -0,0 +1,110 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  SampleRing (sample_ring.h) between two threads, on the PC.
+ *
+ *  A producer thread pushes numbered records as fast as it can,
+ *  pushing again when the ring is full (each time counts as an
+ *  overflow), and a consumer thread drains them with peek() and
+ *  consume(), checking that every record arrives once, in order,
+ *  with its timestamp.
+ *  The simulated clock isn't thread safe, so the timestamps are
+ *  made up from the record number, with a long gap now and then
+ *  to exercise the coarse stamps of the delta layout.
+ *
+ *      g++ -O2 -pthread -DFASTMILLIS_HOST -I. -o sample_ring_bench extras/sample_ring_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp
+ *      ./sample_ring_bench [records]
+ *
+ *  (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line, per layout.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "sample_ring.h"
+
+static uint32_t stamp_of( uint32_t i ) {
+    return i*3 + (i >> 16) * 40000;     // 40ms more every 65536 records
+}
+
+template< SampleRingLayout LAYOUT >
+static void run( const char* layout, uint32_t n ) {
+    typedef SampleRing< uint16_t, 1024, LAYOUT > Ring;
+    static Ring ring;
+    ring.reset( 0 );
+    bool done = false;
+    uint32_t received = 0, bad_order = 0, bad_time = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer( [&] {
+        typename Ring::Span s;
+        for(;;) {
+            if( !ring.peek( s )) {
+                if( __atomic_load_n( &done, __ATOMIC_ACQUIRE ) && !ring.peek( s ))
+                    break;
+                if( !s.count ) {
+                    std::this_thread::yield();
+                    continue;
+                }
+            }
+            uint32_t t = s.ts;
+            for( uint32_t j=0; j<s.count; j++, received++ ) {
+                uint32_t i = received;
+                t = s.data[j].time( t );
+                int32_t early = stamp_of( i ) - t;
+                if( s.data[j].value != uint16_t( i ))
+                    bad_order++;
+                // only the record after a gap may be stamped early, by less than 1ms
+                if( early < 0 || early >= 1000 || (early && i % 65536))
+                    bad_time++;
+            }
+            ring.consume( s.count );
+        }
+    });
+    // a full ring drops the record: push it again until it fits
+    for( uint32_t i=0; i<n; i++ )
+        while( !ring.push( stamp_of( i ), uint16_t( i )))
+            std::this_thread::yield();
+    __atomic_store_n( &done, true, __ATOMIC_RELEASE );
+    consumer.join();
+    double ns = std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count();
+
+    printf( "{\"bench\":\"sample_ring\",\"layout\":\"%s\",\"record_bytes\":%u,\"pushed\":%u,\"overflows\":%u,\"coarse\":%u,"
+        "\"received\":%u,\"bad_order\":%u,\"bad_time\":%u,\"ns_per_record\":%.1f}\n",
+        layout, (unsigned)sizeof(typename Ring::Record), (unsigned)ring.pushed(), (unsigned)ring.overflows(),
+        (unsigned)ring.coarse(), (unsigned)received, (unsigned)bad_order, (unsigned)bad_time, ns / n );
+}
+
+int main( int argc, char** argv ) {
+    uint32_t n = argc > 1 ? atoi( argv[1] ) : 10000000;
+    run< SAMPLE_RING_FULL >( "full", n );
+    run< SAMPLE_RING_DELTA >( "delta", n );
+}
@@ -0,0 +1,132 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  PeriodicTicker (ticker.h) on the PC, against the virtual clock.
+ *
+ *  A MicrosTicker loop does some work each period and stalls twice,
+ *  once for fewer periods than catch_up_limit and once for more,
+ *  with TICKER_CATCH_UP then TICKER_SKIP. A MillisTicker then runs
+ *  across the wraparound of fastmillis(), with a stall that spans
+ *  it, and at its longest period. Each run checks the counts
+ *  against what the stalls should give, and that the deadline is
+ *  still on the grid, with every period either run or skipped.
+ *
+ *      g++ -O2 -DFASTMILLIS_HOST -I. -o ticker_bench extras/ticker_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp
+ *      ./ticker_bench
+ *
+ *  (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line, per run.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "ticker.h"
+
+static bool all_ok = true;
+
+/*  Runs n periods of "period", "work" long each. Period at[i] stalls
+    until half a period after stall_periods[i] more deadlines have
+    passed, so that many periods are overdue. Time is in the
+    ticker's unit.
+*/
+template< class Clock, class Advance >
+static void run( const char* name, PeriodicTicker< Clock >& t, typename Clock::Time first, uint32_t period, TickerPolicy policy,
+                 uint32_t n, uint32_t work, const uint32_t* at, const uint32_t* stall_periods, uint32_t stalls,
+                 Advance advance ) {
+    typedef typename Clock::Time Time;
+    t.begin_at( first, period, policy );
+    uint32_t expect_skipped = 0, back_to_back = 0, s = 0;
+    Time prev = 0;
+    for( uint32_t i=0; i<n; i++ ) {
+        t.wait();
+        Time now = Clock::now();
+        if( i && Time( now - prev ) < period / 2 )
+            back_to_back++;
+        prev = now;
+        advance( work );
+        if( s < stalls && i == at[s] ) {
+            advance( uint32_t( t.deadline() + stall_periods[s] * period + period / 2 - Clock::now() ));
+            uint32_t missed = stall_periods[s];
+            expect_skipped += policy == TICKER_SKIP ? missed : missed > t.catch_up_limit ? missed - t.catch_up_limit : 0;
+            s++;
+        }
+    }
+    const TickerStats& st = t.stats;
+    // where the deadline is, from where it should be after the periods run or skipped
+    typename Clock::STime off = t.deadline() - first - Time( st.ticks + st.skipped ) * period;
+    bool ok = st.ticks == n && st.overruns == stalls && st.skipped == expect_skipped && !off;
+    all_ok &= ok;
+    printf( "{\"bench\":\"%s\",\"period\":%u,\"unit\":\"%s\",\"ticks\":%u,\"overruns\":%u,\"skipped\":%u,\"expect_skipped\":%u,"
+            "\"back_to_back\":%u,\"off_grid\":%lld,\"late_max\":%u,\"late_mean\":%u,\"ok\":%s}\n",
+        name, (unsigned)period, Clock::unit(), (unsigned)st.ticks, (unsigned)st.overruns, (unsigned)st.skipped,
+        (unsigned)expect_skipped, (unsigned)back_to_back, (long long)off, (unsigned)st.late_max,
+        (unsigned)(st.ticks ? st.late_total / st.ticks : 0), ok ? "true" : "false" );
+}
+
+// to "ms" before fastmillis() wraps
+static void before_wrap( uint32_t ms ) {
+    fastmillis_host::advance_us( uint64_t( uint32_t( -ms ) - fastmillis() ) * 1000 );
+}
+
+int main() {
+    init_TIMG0();
+    auto advance_us = []( uint32_t us ) { fastmillis_host::advance_us( us ); };
+    auto advance_ms = []( uint32_t ms ) { fastmillis_host::advance_us( uint64_t( ms ) * 1000 ); };
+
+    // 4kHz, 30us of work, stalls of 5 and 20 periods
+    static const uint32_t at[2] = { 1000, 2000 }, stall[2] = { 5, 20 };
+    {   MicrosTicker t;
+        run( "ticker_catch_up", t, fastmicros64() + 250, 250, TICKER_CATCH_UP, 4000, 30, at, stall, 2, advance_us );
+    }
+    {   MicrosTicker t;
+        run( "ticker_skip", t, fastmicros64() + 250, 250, TICKER_SKIP, 4000, 30, at, stall, 2, advance_us );
+    }
+
+    /*  100Hz, 2ms of work, starting 500ms before fastmillis() wraps,
+        with a stall of 3 periods from 10ms before the wrap.
+    */
+    static const uint32_t wrap_at[1] = { 48 }, wrap_stall[1] = { 3 };
+    {   MillisTicker t;
+        before_wrap( 500 );
+        run( "ticker_millis_wrap_skip", t, fastmillis() + 10, 10, TICKER_SKIP, 100, 2, wrap_at, wrap_stall, 1, advance_ms );
+    }
+    {   MillisTicker t;
+        before_wrap( 500 );
+        run( "ticker_millis_wrap_catch_up", t, fastmillis() + 10, 10, TICKER_CATCH_UP, 100, 2, wrap_at, wrap_stall, 1, advance_ms );
+    }
+
+    /*  The longest period, 2^31 - 1 ms (24.8 days): wait() sleeps it
+        in hybridDelayUntil(), with the sleeps calibrated.
+    */
+    {   MillisTicker t;
+        hybridDelayBegin();
+        run( "ticker_millis_longest_period", t, fastmillis() + 0x7FFFFFFF, 0x7FFFFFFF, TICKER_SKIP, 3, 2, nullptr, nullptr, 0, advance_ms );
+    }
+    return all_ok ? 0 : 1;
+}
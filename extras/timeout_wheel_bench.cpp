@@ -0,0 +1,231 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  TimeoutWheel (timeout_wheel.h) on the PC, against the virtual clock.
+ *
+ *  Arms thousands of timeouts from 0 to 2^31 ms, so that every level
+ *  and the parking of the last one get used, starting 2^30 ms before
+ *  fastmillis() wraps. The clock then jumps from deadline to deadline,
+ *  now and then to somewhere in between or past a few of them, and
+ *  calls advance(). Every callback is checked against a model: the
+ *  timeout fires once, never before its end nor after an advance()
+ *  more than a tick past it, and never after being cancelled.
+ *  Callbacks re-arm themselves, re-arm and cancel others, and pairs
+ *  due in the same ms cancel each other.
+ *
+ *      g++ -O2 -DFASTMILLIS_HOST -I. -o timeout_wheel_bench extras/timeout_wheel_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp
+ *      ./timeout_wheel_bench [timeouts] [seed]
+ *
+ *  (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "timeout_wheel.h"
+
+static uint64_t lcg_state = 0x123456789ULL;
+static uint32_t lcg() {
+    lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return lcg_state >> 32;
+}
+
+/*  Up to 2^31 - 1 ms, spread evenly over the levels of the wheel (64ms,
+    4s, 4.6 min, 4.9h, 12.4 days) and past them.
+*/
+static uint32_t random_duration() {
+    unsigned bits = 6 * (1 + lcg() % 6);
+    return bits >= 31 ? lcg() & 0x7FFFFFFF : lcg() & ((1u << bits) - 1);
+}
+
+enum Action : uint8_t { NOTHING, REARM_SELF, REARM_OTHER, CANCEL_OTHER, CANCEL_TWIN };
+
+struct Model {
+    WheelTimeout    t;
+    bool            pending = false;
+    uint32_t        end = 0;
+    uint32_t        armed_call = 0;     // advance() calls made when armed
+    bool            armed_in_callback = false;
+    Action          action = NOTHING;
+    uint32_t        twin = 0;           // CANCEL_TWIN: due in the same ms
+};
+
+static TimeoutWheel wheel;
+static std::vector<Model> m;
+static uint32_t calls;                  // advance() calls so far
+static bool in_callback;
+static uint32_t prev_now, now;          // times of the previous and current advance()
+static uint32_t fired, early, late, wrong, rearmed, cancelled, pending;
+
+static void arm( uint32_t i, uint32_t duration ) {
+    Model& x = m[i];
+    if( !x.pending ) pending++;
+    wheel.set( x.t, duration );
+    x.pending  = true;
+    x.end      = fastmillis() + duration;
+    x.armed_call = calls;
+    x.armed_in_callback = in_callback;
+}
+
+static void cancel( uint32_t i ) {
+    Model& x = m[i];
+    wheel.cancel( x.t );
+    if( x.pending ) {
+        pending--;
+        cancelled++;
+    }
+    x.pending = false;
+}
+
+static void on_expired( WheelTimeout& t, void* arg ) {
+    uint32_t i = (uintptr_t)arg;
+    Model& x = m[i];
+    fired++;
+    /*  Armed from a callback, it may fire in the same advance() if it is
+        due by then. Either way, an advance() that started after it was
+        armed and was a tick or more past its end should have fired it:
+        one armed for a ms the wheel has already run waits for the next.
+    */
+    if( !x.pending || t.end_millis() != x.end || calls < x.armed_call + !x.armed_in_callback ) {
+        wrong++;
+        return;
+    }
+    if( (int32_t)(now - x.end) < 0 )
+        early++;
+    else if( calls - 1 > x.armed_call && (int32_t)(prev_now - x.end) >= 1 )
+        late++;
+    x.pending = false;
+    pending--;
+
+    switch( x.action ) {
+    case REARM_SELF:
+        arm( i, random_duration() );
+        rearmed++;
+        x.action = NOTHING;
+        break;
+    case REARM_OTHER:
+    case CANCEL_OTHER: {
+        uint32_t j = lcg() % m.size();
+        if( x.action == REARM_OTHER ) {
+            arm( j, random_duration() );
+            rearmed++;
+        } else
+            cancel( j );
+        break;
+    }
+    case CANCEL_TWIN:
+        cancel( x.twin );
+        break;
+    default:
+        break;
+    }
+}
+
+static void run_advance() {
+    prev_now = now;
+    now = fastmillis();
+    calls++;
+    in_callback = true;
+    wheel.advance( now );
+    in_callback = false;
+}
+
+static void to( uint32_t t ) {
+    fastmillis_host::advance_us( uint64_t( t - fastmillis() ) * 1000 );
+}
+
+int main( int argc, char** argv ) {
+    uint32_t n = argc > 1 ? atoi( argv[1] ) : 5000;
+    if( argc > 2 ) lcg_state = strtoull( argv[2], nullptr, 0 );
+    if( n < 2 ) n = 2;
+    init_TIMG0();
+    to( uint32_t( -(1 << 30) ));
+    wheel.begin( fastmillis() );
+    now = fastmillis();
+    uint32_t start = now;
+
+    m.resize( n );
+    for( uint32_t i=0; i<n; i++ )
+        m[i].t = WheelTimeout( on_expired, (void*)(uintptr_t)i );
+    uint32_t twins = 0;
+    for( uint32_t i=0; i<n; i++ ) {
+        uint32_t r = lcg() % 100;
+        if( r < 10 && i + 1 < n ) {
+            // a pair due in the same ms, the first to fire cancels the other
+            uint32_t d = random_duration();
+            arm( i, d );
+            arm( i+1, d );
+            m[i].action = CANCEL_TWIN;
+            m[i].twin = i+1;
+            m[i+1].action = CANCEL_TWIN;
+            m[i+1].twin = i;
+            twins++;
+            i++;
+            continue;
+        }
+        arm( i, random_duration() );
+        m[i].action = r < 25 ? REARM_SELF : r < 30 ? REARM_OTHER : r < 35 ? CANCEL_OTHER : NOTHING;
+    }
+
+    uint32_t steps = 0, count_mismatch = 0, wrapped = 0;
+    while( pending ) {
+        // earliest pending end
+        uint32_t next = 0;
+        int32_t best = INT32_MAX;
+        for( const Model& x : m )
+            if( x.pending && (int32_t)(x.end - now) < best ) {
+                best = (int32_t)(x.end - now);
+                next = x.end;
+            }
+        uint32_t r = lcg() % 100;
+        if( r < 10 && best > 1 )
+            next = now + 1 + lcg() % (best - 1);        // in between: nothing due
+        else if( r < 15 )
+            next += lcg() % 1000;                       // past it, like a busy loop
+        if( (int32_t)(next - now) < 0 )
+            next = now;
+        if( r >= 95 )
+            cancel( lcg() % n );                        // from outside a callback
+        uint32_t before = fastmillis();
+        to( next );
+        wrapped += fastmillis() < before;
+        run_advance();
+        steps++;
+        count_mismatch += wheel.count() != pending;
+    }
+
+    bool ok = !early && !late && !wrong && !count_mismatch && !wheel.count() && wrapped;
+    printf( "{\"bench\":\"timeout_wheel\",\"timeouts\":%u,\"twins\":%u,\"advance_calls\":%u,\"fired\":%u,\"rearmed\":%u,"
+            "\"cancelled\":%u,\"early\":%u,\"late\":%u,\"wrong\":%u,\"count_mismatch\":%u,\"wrapped\":%u,\"span_ms\":%u,\"ok\":%s}\n",
+        (unsigned)n, (unsigned)twins, (unsigned)steps, (unsigned)fired, (unsigned)rearmed, (unsigned)cancelled,
+        (unsigned)early, (unsigned)late, (unsigned)wrong, (unsigned)count_mismatch, (unsigned)wrapped,
+        (unsigned)(now - start), ok ? "true" : "false" );
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  Converts a trace_dump() (binary or hex) to Chrome trace JSON.
+ *  Runs on the PC, standalone:
+ *
+ *      g++ -O2 -o trace2json extras/trace2json.cpp
+ *      ./trace2json dump.bin > trace.json
+ *
+ *  Open the result in chrome://tracing or ui.perfetto.dev. Each core
+ *  is a thread, timestamps are fastmicros() unwrapped to 64 bits.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+static int hexval( int c ) {
+    if( c >= '0' && c <= '9' ) return c - '0';
+    c = tolower( c );
+    if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    return -1;
+}
+
+/*  Reads the whole input. Binary dumps start with "FMTR", hex dumps with
+    its hex encoding "464d5452"; anything that isn't a hex digit is skipped.
+*/
+static bool read_dump( FILE* in, std::vector<uint8_t>& data ) {
+    std::vector<uint8_t> raw;
+    int c;
+    while( (c = fgetc( in )) != EOF )
+        raw.push_back( c );
+    if( raw.size() >= 4 && std::string( raw.begin(), raw.begin()+4 ) == "FMTR" ) {
+        data.swap( raw );
+        return true;
+    }
+    int hi = -1;
+    for( uint8_t ch : raw ) {
+        int v = hexval( ch );
+        if( v < 0 ) continue;
+        if( hi < 0 ) hi = v;
+        else {
+            data.push_back( hi*16 + v );
+            hi = -1;
+        }
+    }
+    return data.size() >= 4 && std::string( data.begin(), data.begin()+4 ) == "FMTR";
+}
+
+class Reader {
+public:
+    Reader( const std::vector<uint8_t>& d ) : _d(d) {}
+    bool ok() const { return _ok; }
+    uint32_t get( unsigned n ) {
+        uint32_t v = 0;
+        if( _pos + n > _d.size() ) { _ok = false; return 0; }
+        for( unsigned i=0; i<n; i++ )
+            v |= uint32_t( _d[_pos++] ) << (8*i);
+        return v;
+    }
+    std::string str( unsigned n ) {
+        if( _pos + n > _d.size() ) { _ok = false; return ""; }
+        std::string s( _d.begin()+_pos, _d.begin()+_pos+n );
+        _pos += n;
+        return s;
+    }
+private:
+    const std::vector<uint8_t>& _d;
+    size_t  _pos = 0;
+    bool    _ok  = true;
+};
+
+static std::string json_escape( const std::string& s ) {
+    std::string r;
+    for( char c : s ) {
+        if( c == '"' || c == '\\' ) r += '\\';
+        if( (unsigned char)c < 0x20 ) continue;
+        r += c;
+    }
+    return r;
+}
+
+int main( int argc, char** argv ) {
+    FILE* in = stdin;
+    if( argc > 1 && !(in = fopen( argv[1], "rb" ))) {
+        perror( argv[1] );
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    if( !read_dump( in, data )) {
+        fprintf( stderr, "not a trace dump\n" );
+        return 1;
+    }
+
+    Reader r( data );
+    r.str( 4 );
+    unsigned version = r.get( 1 );
+    unsigned cores   = r.get( 1 );
+    unsigned nnames  = r.get( 2 );
+    if( version != 1 ) {
+        fprintf( stderr, "unsupported dump version %u\n", version );
+        return 1;
+    }
+    std::vector<std::string> names( 1, "?" );       // ids start at 1
+    for( unsigned i=0; i<nnames; i++ )
+        names.push_back( json_escape( r.str( r.get( 1 ))));
+
+    printf( "{\"traceEvents\":[\n" );
+    bool first = true;
+    for( unsigned core=0; core<cores && r.ok(); core++ ) {
+        uint32_t count = r.get( 4 );
+        uint64_t ts64  = 0;
+        uint32_t prev  = 0;
+        for( uint32_t i=0; i<count && r.ok(); i++ ) {
+            uint32_t ts    = r.get( 4 );
+            uint16_t name  = r.get( 2 );
+            char     type  = r.get( 1 );
+            r.get( 1 );
+            int32_t  value = r.get( 4 );
+
+            // fastmicros() wraps every 71 minutes. Events of an ISR and of
+            // the code it preempted may be a few µs out of order: a step
+            // back of up to a second is that, not a wrap. Anything else,
+            // however long, is time going forward.
+            uint32_t d = ts - prev;
+            if( !i )
+                ts64 = ts;
+            else if( int32_t( d ) < 0 && int32_t( d ) > -(1 << 20) )
+                ts64 = ts64 > -d ? ts64 - -d : 0;
+            else
+                ts64 += d;
+            prev = ts;
+
+            const char* n = name < names.size() ? names[name].c_str() : "?";
+            printf( "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":0,\"tid\":%u",
+                first ? "" : ",\n", n, type, (unsigned long long)ts64, core );
+            if( type == 'i' )
+                printf( ",\"s\":\"t\"" );
+            if( type == 'C' )
+                printf( ",\"args\":{\"value\":%d}", value );
+            else if( value )
+                printf( ",\"args\":{\"v\":%d}", value );
+            printf( "}" );
+            first = false;
+        }
+    }
+    printf( "\n]}\n" );
+
+    if( !r.ok() ) {
+        fprintf( stderr, "truncated dump\n" );
+        return 1;
+    }
+    return 0;
+}
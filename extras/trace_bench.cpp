@@ -0,0 +1,130 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/**************************************************************
+ *  Trace call sites first hit from an ISR, on the PC.
+ *
+ *  A simulated periodic esp_timer stands in for the ISR: it records
+ *  an event from its own call site and polls a Timeout, whose
+ *  "timeout.expired" instant fires there. Neither site runs before
+ *  the timer does. The names must already be in the table when main()
+ *  starts, and the table must not grow while the timer runs: an ISR
+ *  never registers a name, which would read it from flash.
+ *
+ *      g++ -O2 -DFASTMILLIS_HOST -DFASTMILLIS_TRACE=1 -I. -o trace_bench extras/trace_bench.cpp \
+ *          fastmillis.cpp fastmillis_host.cpp trace.cpp
+ *      ./trace_bench
+ *
+ *  (config.h is the sketch's; an empty one will do.)
+ *  One JSON object per line.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "fastmillis.h"
+#include "timeout.h"
+#include "trace.h"
+
+static Timeout timeout;
+static uint32_t timer_runs, expired_seen;
+
+static void on_timer( void* ) {
+    timer_runs++;
+    TRACE_INSTANT_V( "bench.timer", timer_runs );
+    if( timeout.expired() )
+        expired_seen++;
+}
+
+/*  What trace_dump() writes: the names, and per name the number of events.
+*/
+struct Dump {
+    std::vector<std::string> names;
+    std::vector<uint32_t> events;
+
+    bool read() {
+        FILE* f = tmpfile();
+        if( !f ) return false;
+        trace_dump( f );
+        rewind( f );
+        uint8_t h[8];
+        if( fread( h, 1, 8, f ) != 8 || memcmp( h, "FMTR", 4 )) return false;
+        uint16_t n = h[6] | (h[7] << 8);
+        names.clear();
+        events.assign( n + 1, 0 );
+        for( uint16_t i=0; i<n; i++ ) {
+            int len = fgetc( f );
+            std::string s( len, 0 );
+            if( len < 0 || fread( &s[0], 1, len, f ) != size_t(len) ) return false;
+            names.push_back( s );
+        }
+        for( unsigned c=0; c<h[5]; c++ ) {
+            uint8_t b[4];
+            if( fread( b, 1, 4, f ) != 4 ) return false;
+            uint32_t count = b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+            for( uint32_t i=0; i<count; i++ ) {
+                uint8_t e[12];
+                if( fread( e, 1, 12, f ) != 12 ) return false;
+                uint16_t id = e[4] | (e[5] << 8);
+                if( id <= n ) events[id]++;
+            }
+        }
+        fclose( f );
+        return true;
+    }
+
+    // 0 if not registered
+    uint16_t id( const char* name ) const {
+        for( size_t i=0; i<names.size(); i++ )
+            if( names[i] == name ) return i + 1;
+        return 0;
+    }
+};
+
+int main() {
+    init_TIMG0();
+    Dump before, after;
+    bool dumped = before.read();
+
+    timeout.set( 10 );
+    fastmillis_host::start_periodic( on_timer, nullptr, 1000 );
+    for( int i=0; i<200; i++ )
+        fastmillis_host::advance_us( 100 );
+    dumped &= after.read();
+
+    uint16_t timer_id = after.id( "bench.timer" ), expired_id = after.id( "timeout.expired" );
+    bool ok = dumped && before.id( "bench.timer" ) && before.id( "timeout.expired" )
+        && before.names.size() == after.names.size()
+        && timer_runs && after.events[ timer_id ] == timer_runs
+        && expired_seen && after.events[ expired_id ] == 1;
+    printf( "{\"bench\":\"trace_isr_first_hit\",\"names_before_main\":%u,\"names_after\":%u,\"timer_runs\":%u,"
+            "\"timer_events\":%u,\"expired_events\":%u,\"ok\":%s}\n",
+        (unsigned)before.names.size(), (unsigned)after.names.size(), (unsigned)timer_runs,
+        (unsigned)after.events[ timer_id ], (unsigned)after.events[ expired_id ], ok ? "true" : "false" );
+    return ok ? 0 : 1;
+}
@@ -23,6 +23,11 @@ SOFTWARE.
 */
 
 #include "config.h"
+#ifndef FASTMILLIS_HOST
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <esp_ipc.h>
+#endif
 #include "fastmillis.h"
 
 /**************************************************************
@@ -56,26 +61,18 @@ void init_TIMG0() {
     TIMG0_T1LOAD_REG = 1;
 }
 
+uint64_t IRAM_ATTR fastmillis64() {
+  // we divided by 40000, now divide by 2 to get milliseconds
+  return timg0_t1_read64() >> 1;
+}
+
 uint32_t IRAM_ATTR fastmillis() {
-  TIMG0_T1UPDATE_REG = 0; // write here to tell the hardware to copy counter value into read registers
-  uint32_t lo, lo2, hi;
-  do {
-    lo = TIMG0_T1LO_REG;
-    hi = TIMG0_T1HI_REG;
-    lo2 = TIMG0_T1LO_REG;
-  } while( lo != lo2 );
-  return (uint64_t(hi)<<32) | (lo>>1); // we divided by 40000, now divide by 2 to get milliseconds
+  // truncate after the shift, so bit 0 of HI becomes bit 31 of the result
+  return fastmillis64();
 }
 
 uint64_t IRAM_ATTR fastmicros64() {
-  TIMG0_T0UPDATE_REG = 0; // write here to tell the hardware to copy counter value into read registers
-  uint32_t lo, lo2, hi;
-  do {
-    lo = TIMG0_T0LO_REG;
-    hi = TIMG0_T0HI_REG;
-    lo2 = TIMG0_T0LO_REG;
-  } while( lo != lo2 );
-  return (uint64_t(hi)<<32) | lo;
+  return timg0_t0_read64();
 }
 
 void IRAM_ATTR fastDelayMicroseconds(uint32_t us)
@@ -95,9 +92,10 @@ void IRAM_ATTR fastDelayMicroseconds(uint32_t us)
 
 void IRAM_ATTR accurateDelayMicroseconds(uint32_t us)
 {
-    if( !us ) return;
     uint32_t m = xthal_get_ccount();
-    uint32_t e = m + us*CPU_FREQUENCY_MHZ - 44;     // substract some cycles to account for function call
+    uint32_t cycles = us*cpu_clock.mhz;
+    if( cycles <= cpu_clock.delay_overhead ) return;
+    uint32_t e = m + cycles - cpu_clock.delay_overhead;     // substract the cycles of the function call
     if(m > e){ //overflow
         while(xthal_get_ccount() > e){
             NOP();
@@ -107,3 +105,501 @@ void IRAM_ATTR accurateDelayMicroseconds(uint32_t us)
         NOP();
     }
 }
+
+/**************************************************************
+ *	CPU clock, see cpu_clock_calibrate()
+ **************************************************************/
+
+CpuClock cpu_clock;
+
+#define CPU_CLOCK_WINDOW_US 500
+
+/*	Cycles in CPU_CLOCK_WINDOW_US µs of TIMG0_T0, from one tick of the timer
+	to another, so both ends see the same polling delay.
+*/
+static uint32_t measure_khz() {
+	uint32_t t0, t1, c0, c1;
+	timeCriticalEnter() {
+		uint32_t t = fastmicros();
+		while( (t0 = fastmicros()) == t )
+			;
+		c0 = xthal_get_ccount();
+		while( (t1 = fastmicros()) - t0 < CPU_CLOCK_WINDOW_US )
+			;
+		c1 = xthal_get_ccount();
+	} timeCriticalExit();
+	return uint64_t(c1 - c0) * 1000 / (t1 - t0);
+}
+
+/*	accurateDelayMicroseconds() with no correction, minus the delay asked:
+	what the call and the end of the loop take. Best of a few.
+*/
+static uint32_t measure_delay_overhead() {
+	uint32_t best = 0xFFFFFFFF;
+	cpu_clock.delay_overhead = 0;
+	for( int i=0; i<16; i++ ) {
+		uint32_t c;
+		timeCriticalEnter() {
+			uint32_t c0 = xthal_get_ccount();
+			accurateDelayMicroseconds( 2 );
+			c = xthal_get_ccount() - c0;
+		} timeCriticalExit();
+		if( c < best ) best = c;
+	}
+	return best > 2*cpu_clock.mhz ? best - 2*cpu_clock.mhz : 0;
+}
+
+bool cpu_clock_calibrate() {
+	uint32_t nominal = getCpuFrequencyMhz();
+	uint32_t khz = measure_khz();
+	uint32_t mhz = (khz + 500) / 1000;
+	if( !mhz )
+		return false;
+	cpu_clock.mhz = mhz;
+	cpu_clock.nominal_mhz = nominal;
+	cpu_clock.measured_khz = khz;
+	cpu_clock.delay_overhead = measure_delay_overhead();
+	bool ok = fastcycles_calibrate();
+	return ok && khz >= nominal*990 && khz <= nominal*1010;
+}
+
+bool cpu_clock_update() {
+	if( getCpuFrequencyMhz() == cpu_clock.nominal_mhz && cpu_clock.measured_khz )
+		return false;
+	cpu_clock_calibrate();
+	return true;
+}
+
+bool cpu_clock_set_mhz( uint32_t mhz ) {
+#ifdef FASTMILLIS_HOST
+	fastmillis_host::set_cpu_mhz( mhz );
+#else
+	if( !setCpuFrequencyMhz( mhz ))
+		return false;
+#endif
+	cpu_clock_update();
+	return true;
+}
+
+/**************************************************************
+ *	Cycle timebase, see fastcycles()
+ **************************************************************/
+
+FastCyclesCore fastcycles_cores[ FASTCYCLES_CORES ];
+
+/*	Waits for the next tick of TIMG0_T0 and returns it. "cycles" is the
+	cycle counter halfway through the poll that saw it, "poll" how long
+	that poll took. Interrupts must be off.
+*/
+static uint32_t timg0_edge( uint32_t& cycles, uint32_t& poll ) {
+	uint32_t t = fastmicros(), t1, c0, c1;
+	do {
+		c0 = xthal_get_ccount();
+		t1 = fastmicros();
+		c1 = xthal_get_ccount();
+	} while( t1 == t );
+	poll = c1 - c0;
+	cycles = c0 + poll/2;
+	return t1;
+}
+
+/*	8.24 ticks per cycle from "us" µs worth "cycles" cycles, give or
+	take "slack" cycles. Snapped to FASTCYCLES_MHZ / the nearest whole
+	MHz when that is within the slack, so cores sharing a clock get the
+	same, exact scale. 0 if it makes no sense.
+*/
+static uint32_t fastcycles_scale( uint32_t us, uint32_t cycles, uint32_t slack ) {
+	uint32_t mhz = (cycles + us/2) / us;
+	if( !mhz || FASTCYCLES_MHZ / mhz > 255 )
+		return 0;
+	uint32_t scale = ((uint64_t(us) * FASTCYCLES_MHZ << 24) + cycles/2) / cycles;
+	uint32_t exact = (uint64_t(FASTCYCLES_MHZ) << 24) / mhz;
+	uint32_t tolerance = uint64_t(exact) * slack / cycles;
+	if( scale - exact + tolerance <= 2*tolerance )
+		return exact;
+	return scale;
+}
+
+/*	Cycles from ccount0 to "c", "us" being fastmicros() at about the same
+	time: the low 32 bits are exact, the wraps come from the µs since
+	us_base at the measured rate.
+*/
+static uint64_t IRAM_ATTR fastcycles_since_anchor( const FastCyclesCore& fc, uint32_t c, uint32_t us ) {
+	uint32_t d = c - fc.ccount0;
+	int64_t expected = (uint64_t( us - fc.us_base ) * FASTCYCLES_MHZ << 24) / fc.rate;
+	int64_t wraps = (expected - d + 0x80000000LL) >> 32;
+	return (uint64_t( wraps > 0 ? wraps : 0 ) << 32) + d;
+}
+
+/*	fastcycles() at "cycles" since the anchor, for any number of cycles.
+*/
+static uint32_t IRAM_ATTR fastcycles_at( const FastCyclesCore& fc, uint64_t cycles ) {
+	return fc.tick0 + uint32_t( (cycles >> 24) * fc.scale )
+		+ uint32_t( ((cycles & 0xFFFFFF) * fc.scale) >> 24 );
+}
+
+/*	Called by fastcycles() once 2^31 cycles went by since the anchor of the
+	current core, where the 32 bit difference would soon wrap, and by the
+	FASTCYCLES_REBASE_US timer. If they did, moves the anchor forward by a
+	multiple of 2^24 cycles, which is a whole number of ticks whatever the
+	scale, so fastcycles() doesn't move.
+*/
+void IRAM_ATTR fastcycles_rebase() {
+	timeCriticalEnter() {
+		FastCyclesCore& fc = fastcycles_cores[ xPortGetCoreID() ];
+		uint32_t c = xthal_get_ccount();
+		uint32_t us = fastmicros();
+		uint64_t cycles = fastcycles_since_anchor( fc, c, us );
+		if( cycles >= 0x80000000 ) {	// not done by an interrupt meanwhile
+			uint64_t step = cycles & ~uint64_t( 0xFFFFFF );
+			uint32_t tick = fastcycles_at( fc, step );
+			__atomic_store_n( &fc.seq, fc.seq + 1, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+			fc.ccount0 += uint32_t( step );
+			fc.tick0    = tick;
+			fc.us_base  = us;
+			__atomic_store_n( &fc.seq, fc.seq + 1, __ATOMIC_RELEASE );
+		}
+	} timeCriticalExit();
+}
+
+/*	Anchors the current core to the next tick of TIMG0_T0. With "window",
+	measures the scale over that many µs first, otherwise refines it from
+	the previous anchor when that is far enough and not too far.
+*/
+static bool fastcycles_anchor( uint32_t window ) {
+	bool ok = true;
+	timeCriticalEnter() {
+		FastCyclesCore& fc = fastcycles_cores[ xPortGetCoreID() ];
+		uint32_t us0 = fc.us0, c0 = fc.ccount_us0, us, c, poll, poll0 = fc.poll;
+		if( window ) {
+			us0 = timg0_edge( c0, poll0 );
+			while( fastmicros() - us0 < window - 1 )
+				;
+		}
+		us = timg0_edge( c, poll );
+		uint32_t scale = fc.rate;
+		if( window || (fc.syncs && us - us0 >= CPU_CLOCK_WINDOW_US && us - us0 < 0x7FFFFFFF / (cpu_clock.mhz + 1))) {
+			scale = fastcycles_scale( us - us0, c - c0, poll0/2 + poll/2 + 1 );
+			ok = scale != 0;
+			if( !ok )
+				scale = fc.rate;
+		}
+		uint32_t rate = scale;
+		uint32_t tick = us * FASTCYCLES_MHZ;
+		if( fc.syncs && !window ) {
+			// Never go back. A core slightly ahead carries on from where it
+			// is, a little slower, and is back in step within a second.
+			uint32_t now = fastcycles_at( fc, fastcycles_since_anchor( fc, c, us ));
+			int32_t ahead = now - tick;
+			if( ahead > 0 && ahead <= int32_t( FASTCYCLES_MHZ * FASTCYCLES_SLEW_PPM )) {
+				tick = now;
+				scale -= uint64_t( scale ) * ahead / (FASTCYCLES_MHZ * 1000000);
+			}
+		}
+		__atomic_store_n( &fc.seq, fc.seq + 1, __ATOMIC_RELAXED );
+		__atomic_thread_fence( __ATOMIC_RELEASE );
+		fc.ccount0 = c;
+		fc.tick0   = tick;
+		fc.scale   = scale;
+		fc.rate    = rate;
+		fc.us0     = us;
+		fc.ccount_us0 = c;
+		fc.us_base = us;
+		fc.poll    = poll;
+		fc.error   = (uint64_t( poll/2 + 1 ) * rate) >> 24;
+		fc.syncs++;
+		__atomic_store_n( &fc.seq, fc.seq + 1, __ATOMIC_RELEASE );
+	} timeCriticalExit();
+	return ok;
+}
+
+static void fastcycles_calibrate_core( void* ok ) {
+	if( !fastcycles_anchor( CPU_CLOCK_WINDOW_US ))
+		*(bool*)ok = false;
+}
+
+#ifdef FASTMILLIS_HOST
+static const uint32_t fastcycles_ncores = FASTCYCLES_CORES;
+#else
+static const uint32_t fastcycles_ncores = portNUM_PROCESSORS < FASTCYCLES_CORES ? portNUM_PROCESSORS : FASTCYCLES_CORES;
+#endif
+
+static void fastcycles_rebase_core( void* ) {
+	fastcycles_rebase();
+}
+
+/*	Every FASTCYCLES_REBASE_US, so that no anchor gets 2^32 cycles old
+	unnoticed. Even if it runs late, fastcycles_rebase() counts the wraps.
+*/
+static void fastcycles_rebase_all( void* ) {
+	for( uint32_t core=0; core<fastcycles_ncores; core++ )
+		fastcycles_run_on_core( core, fastcycles_rebase_core, nullptr );
+}
+
+static bool fastcycles_timer_start() {
+#ifdef FASTMILLIS_HOST
+	return fastmillis_host::start_periodic( fastcycles_rebase_all, nullptr, FASTCYCLES_REBASE_US );
+#else
+	esp_timer_handle_t timer;
+	esp_timer_create_args_t args = {};
+	args.callback = fastcycles_rebase_all;
+	args.name = "fastcycles";
+	return esp_timer_create( &args, &timer ) == ESP_OK
+		&& esp_timer_start_periodic( timer, FASTCYCLES_REBASE_US ) == ESP_OK;
+#endif
+}
+
+bool fastcycles_calibrate() {
+	static bool timer_started = false;
+	bool ok = true;
+	for( uint32_t core=0; core<fastcycles_ncores; core++ )
+		if( !fastcycles_run_on_core( core, fastcycles_calibrate_core, &ok ))
+			ok = false;
+	if( !timer_started )
+		timer_started = fastcycles_timer_start();
+	return ok && timer_started;
+}
+
+void fastcycles_sync() {
+	fastcycles_anchor( 0 );
+}
+
+bool fastcycles_run_on_core( uint32_t core, void (*fn)( void* ), void* arg ) {
+#ifdef FASTMILLIS_HOST
+	if( core >= FASTCYCLES_CORES )
+		return false;
+	uint32_t self = fastmillis_host::core();
+	fastmillis_host::set_core( core );
+	fn( arg );
+	fastmillis_host::set_core( self );
+	return true;
+#else
+	return esp_ipc_call_blocking( core, fn, arg ) == ESP_OK;
+#endif
+}
+
+void fastcycles_report( FILE* out ) {
+	for( uint32_t core=0; core<FASTCYCLES_CORES; core++ ) {
+		const FastCyclesCore& fc = fastcycles_cores[ core ];
+		fprintf( out, "{\"fastcycles_core\":%u,\"rate\":%.8f,\"scale\":%.8f,\"offset\":%d,\"error\":%u,\"syncs\":%u}\n",
+			(unsigned)core, fc.rate / 16777216.0, fc.scale / 16777216.0, int32_t( fc.tick0 - fc.ccount0 ),
+			(unsigned)fc.error, (unsigned)fc.syncs );
+	}
+}
+
+/**************************************************************
+ *	Hybrid delays, see hybridDelayMicroseconds()
+ **************************************************************/
+
+HybridDelay hybrid_delay;
+
+static bool hybrid_ready = false;
+
+#ifdef FASTMILLIS_HOST
+
+static bool hybrid_alarms_init() {
+	return true;
+}
+
+static bool hybrid_sleep( uint32_t us ) {
+	fastmillis_host::sleep_us( us );
+	return true;
+}
+
+#else
+
+struct HybridAlarm {
+	esp_timer_handle_t	timer;
+	SemaphoreHandle_t	sem;
+	uint32_t			busy;
+};
+
+static HybridAlarm hybrid_alarms[ HYBRID_DELAY_ALARMS ];
+
+static void hybrid_alarm_fired( void* arg ) {
+	xSemaphoreGive( ((HybridAlarm*)arg)->sem );
+}
+
+static bool hybrid_alarms_init() {
+	for( HybridAlarm& a : hybrid_alarms ) {
+		if( a.timer )
+			continue;
+		esp_timer_create_args_t args = {};
+		args.callback = hybrid_alarm_fired;
+		args.arg = &a;
+		args.name = "hybrid_delay";
+		a.sem = xSemaphoreCreateBinary();
+		if( !a.sem || esp_timer_create( &args, &a.timer ) != ESP_OK )
+			return false;
+	}
+	return true;
+}
+
+/*	Blocks for about "us". Returns false if it can't block here.
+*/
+static bool hybrid_sleep( uint32_t us ) {
+	if( xPortInIsrContext() || xTaskGetSchedulerState() != taskSCHEDULER_RUNNING )
+		return false;
+	for( HybridAlarm& a : hybrid_alarms ) {
+		uint32_t idle = 0;
+		if( !__atomic_compare_exchange_n( &a.busy, &idle, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ))
+			continue;
+		xSemaphoreTake( a.sem, 0 );		// left over by a timeout below
+		bool ok = esp_timer_start_once( a.timer, us ) == ESP_OK;
+		// the alarm comes first, the timeout is only there in case it doesn't
+		if( ok && xSemaphoreTake( a.sem, us / 1000 / portTICK_PERIOD_MS + 2 ) != pdTRUE )
+			esp_timer_stop( a.timer );
+		__atomic_store_n( &a.busy, 0, __ATOMIC_RELEASE );
+		return ok;
+	}
+	// all alarms taken: vTaskDelay(n) blocks at most n ticks
+	uint32_t ticks = us / 1000 / portTICK_PERIOD_MS;
+	if( !ticks )
+		return false;
+	vTaskDelay( ticks );
+	return true;
+}
+
+#endif
+
+/*	Sleeps from "now" until about "wake", records how late it woke up
+	relative to "wake" and to the end of the delay. false if it can't sleep.
+*/
+static bool hybrid_sleep_until( uint64_t now, uint64_t wake, uint64_t end ) {
+	HybridDelay& h = hybrid_delay;
+	if( !hybrid_sleep( wake - now ))
+		return false;
+	uint64_t woke = fastmicros64();
+	int32_t late = (int32_t)(woke - wake);
+	h.sleeps++;
+	h.slept_us += woke - now;
+	h.wake_total += late;
+	if( late > h.wake_max ) h.wake_max = late;
+	h.wake_hist.record( late > 0 ? late : 0 );
+	if( woke > end )
+		h.overslept++;
+	return true;
+}
+
+static inline bool hybrid_worth_sleeping( uint32_t us ) {
+	return hybrid_ready && us >= hybrid_delay.spin_us + hybrid_delay.min_sleep_us;
+}
+
+void hybridDelayMicroseconds( uint32_t us ) {
+	if( us >= 0x7FFFFFFF / FASTCYCLES_MHZ ) {	// doesn't fit the cycle counter
+		hybridDelayUntil( fastmicros64() + us );
+		return;
+	}
+	// fastcycles(), not the raw counter: the task may wake up on the other core
+	HybridDelay& h = hybrid_delay;
+	uint32_t start = fastcycles();
+	h.count++;
+	if( hybrid_worth_sleeping( us )) {
+		uint64_t now = fastmicros64();
+		hybrid_sleep_until( now, now + us - h.spin_us, now + us );
+	}
+	uint32_t spin_start = fastcycles();
+	uint32_t c;
+	while( (int32_t)((c = fastcycles()) - start) < (int32_t)(us * FASTCYCLES_MHZ) )
+		NOP();
+	h.spun_cycles += c - spin_start;
+}
+
+void hybridDelayUntil( uint64_t deadline_us ) {
+	HybridDelay& h = hybrid_delay;
+	uint64_t now = fastmicros64();
+	h.count++;
+	// longer than an alarm takes: sleep 35 minutes at a time until the rest fits
+	while( hybrid_ready && deadline_us > now && deadline_us - now >= 0xFFFFFFFF ) {
+		if( !hybrid_sleep_until( now, now + 0x7FFFFFFF, deadline_us ))
+			break;
+		now = fastmicros64();
+	}
+	if( deadline_us > now && deadline_us - now < 0xFFFFFFFF && hybrid_worth_sleeping( deadline_us - now ))
+		hybrid_sleep_until( now, deadline_us - h.spin_us, deadline_us );
+	uint32_t spin_start = fastcycles();
+	while( fastmicros64() < deadline_us )
+		NOP();
+	h.spun_cycles += fastcycles() - spin_start;
+}
+
+bool hybridDelayBegin( uint32_t runs ) {
+	if( !hybrid_alarms_init() )
+		return false;
+	int32_t worst = 0;
+	for( uint32_t i=0; i<runs; i++ ) {
+		uint64_t wake = fastmicros64() + 200;
+		if( !hybrid_sleep( 200 ))
+			return false;
+		int32_t late = (int32_t)(fastmicros64() - wake);
+		if( late > worst ) worst = late;
+	}
+	hybrid_delay.spin_us = worst + HYBRID_DELAY_MARGIN_US;
+	hybrid_delay.reset_stats();
+	hybrid_ready = true;
+	return true;
+}
+
+void HybridDelay::reset_stats() {
+	count = sleeps = overslept = 0;
+	slept_us = spun_cycles = 0;
+	wake_max = 0;
+	wake_total = 0;
+	wake_hist.reset();
+}
+
+void hybrid_delay_report( FILE* out ) {
+	const HybridDelay& h = hybrid_delay;
+	fprintf( out, "hybrid delay spin=%uus n=%u sleeps=%u slept=%lluus spun=%lluus overslept=%u wake late max=%dus mean=%dus hist(us<2^n):",
+		(unsigned)h.spin_us, (unsigned)h.count, (unsigned)h.sleeps,
+		(unsigned long long)h.slept_us, (unsigned long long)(h.spun_cycles / FASTCYCLES_MHZ),
+		(unsigned)h.overslept, (int)h.wake_max,
+		(int)(h.sleeps ? h.wake_total / h.sleeps : 0) );
+	h.wake_hist.print( out );
+	fputc( '\n', out );
+}
+
+#if FASTMILLIS_CRITICAL_STATS
+
+/**************************************************************
+ *	Critical section statistics, see timeCriticalEnter()
+ **************************************************************/
+
+CriticalSectionSite* CriticalSectionSite::head = nullptr;
+
+static void print_violation( const CriticalSectionSite& site, uint32_t cycles ) {
+	printf( "critical section %s:%d took %u us, budget %u us\n",
+		site.file, site.line, (unsigned)(cycles / cpu_clock.mhz), (unsigned)FASTMILLIS_CRITICAL_BUDGET_US );
+}
+
+void (*CriticalSectionSite::on_violation)( const CriticalSectionSite&, uint32_t ) = print_violation;
+
+void IRAM_ATTR CriticalSectionSite::link() {
+	registered = true;
+	next = __atomic_load_n( &head, __ATOMIC_RELAXED );
+	while( !__atomic_compare_exchange_n( &head, &next, this, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ))
+		;
+}
+
+void critical_section_report( FILE* out ) {
+	for( CriticalSectionSite* s = CriticalSectionSite::head; s; s = s->next ) {
+		fprintf( out, "%s:%d n=%u max=%uus mean=%uus violations=%u hist(cycles<2^n):",
+			s->file, s->line, (unsigned)s->count,
+			(unsigned)(s->max / cpu_clock.mhz),
+			(unsigned)(s->count ? s->total / s->count / cpu_clock.mhz : 0),
+			(unsigned)s->violations );
+		s->hist.print( out );
+		fputc( '\n', out );
+	}
+}
+
+void critical_section_reset() {
+	for( CriticalSectionSite* s = CriticalSectionSite::head; s; s = s->next ) {
+		s->count = s->max = s->violations = s->last_violation = 0;
+		s->total = 0;
+		s->hist.reset();
+	}
+}
+
+#endif
@@ -24,8 +24,102 @@ SOFTWARE.
 
 #pragma once
 
+/*  Clock backend: the ESP32 TIMG0 registers by default, or a simulated
+    TIMG0 and cycle counter on Linux when FASTMILLIS_HOST is defined.
+    See fastmillis_host.h.
+*/
+#ifdef FASTMILLIS_HOST
+#include "fastmillis_host.h"
+#endif
+
+#include <stdint.h>
+
+/**************************************************************
+ *  CPU clock
+ *
+ *  Cycle counts become µs through cpu_clock.mhz, which starts at
+ *  CPU_FREQUENCY_MHZ. cpu_clock_calibrate() measures the cycle
+ *  counter against TIMG0_T0 (1MHz whatever the CPU clock), and
+ *  the call and loop overhead of accurateDelayMicroseconds().
+ *  It also calibrates fastcycles() on every core. Call it from
+ *  setup(), after init_TIMG0().
+ *
+ *  After setCpuFrequencyMhz(), call cpu_clock_update(), or use
+ *  cpu_clock_set_mhz() which does both: it recalibrates if the
+ *  frequency changed. Code that counts fastcycles() ticks
+ *  (MultiDelay, OneWire timings) needs nothing. A delay or
+ *  a 1-Wire transaction running on the other core while the
+ *  clock changes is wrong anyway.
+ **************************************************************/
+
+struct CpuClock {
+    uint32_t    mhz             = CPU_FREQUENCY_MHZ;    // cycles per µs, used by the delays
+    uint32_t    nominal_mhz     = CPU_FREQUENCY_MHZ;    // getCpuFrequencyMhz() at the last calibration
+    uint32_t    measured_khz    = 0;                    // against TIMG0_T0, 0 if never calibrated
+    uint32_t    delay_overhead  = 44;                   // cycles, call and loop of accurateDelayMicroseconds()
+};
+
+extern CpuClock cpu_clock;
+
+/*  Measures the clock, with interrupts off for about 500µs. mhz is the
+    measurement, rounded. Returns false if it is more than 1% away from
+    getCpuFrequencyMhz().
+*/
+bool cpu_clock_calibrate();
+
+/*  Recalibrates if getCpuFrequencyMhz() changed. Returns true if it did.
+*/
+bool cpu_clock_update();
+
+/*  setCpuFrequencyMhz(), then cpu_clock_update().
+*/
+bool cpu_clock_set_mhz( uint32_t mhz );
+
+/**************************************************************
+ *  Power-of-two histogram
+ *
+ *  Bucket n counts the values from 2^(n-1) to 2^n - 1, bucket 0
+ *  the zeros, and the last bucket also everything above it: 33
+ *  buckets hold any uint32_t. record() is a count-leading-zeros
+ *  and an increment, and the constructor is constexpr, so it fits
+ *  in a static recorded with interrupts off. The critical section
+ *  stats, the hybrid delays and PeriodicTicker keep one each; for
+ *  percentiles, see LogHistogramProfiler (profiler.h).
+ **************************************************************/
+
+#include <stdio.h>
+
+template< unsigned N >
+struct Pow2Histogram {
+    uint32_t    counts[N]   = {};
+
+    static inline __attribute__((always_inline))
+    unsigned bucket( uint32_t v ) {
+        unsigned n = v ? 32 - __builtin_clz( v ) : 0;
+        return n < N ? n : N - 1;
+    }
+
+    inline __attribute__((always_inline))
+    void record( uint32_t v ) { counts[ bucket( v ) ]++; }
+
+    void reset() {
+        for( unsigned n=0; n<N; n++ )
+            counts[n] = 0;
+    }
+
+    /*  " n:count" for each non-empty bucket, after a "hist(unit<2^n):"
+        label printed by the caller.
+    */
+    void print( FILE* out ) const {
+        for( unsigned n=0; n<N; n++ )
+            if( counts[n] )
+                fprintf( out, " %u:%u", n, (unsigned)counts[n] );
+    }
+};
+
 /**************************************************************
  *  Implementation of interrupt disable
+
  **************************************************************/
 
 /* interrupts() / noInterrupts() does not disable interrupts */
@@ -38,9 +132,99 @@ SOFTWARE.
 #undef noInterrupts()
 #undef interrupts()
 
+#ifndef FASTMILLIS_CRITICAL_STATS
+#define FASTMILLIS_CRITICAL_STATS 0
+#endif
+
+#if FASTMILLIS_CRITICAL_STATS
+
+/*  Instrumented critical sections.
+
+    With FASTMILLIS_CRITICAL_STATS set to 1, every timeCriticalEnter()/Exit()
+    pair records how long interrupts stayed off, per call site: count, max,
+    mean and a power-of-two histogram, in CPU cycles. That's two ccount reads
+    and a few adds per section. The site is a static with a constexpr
+    constructor, so there is no init guard; it links itself into a list the
+    first time it records, with interrupts off, so link() is in IRAM.
+
+    If FASTMILLIS_CRITICAL_BUDGET_US is set, sections longer than that count
+    as violations, and CriticalSectionSite::on_violation is called right after
+    interrupts come back on (default: printf one line).
+
+    critical_section_report() prints all sites. Stats are updated with
+    interrupts off, but the same site running on both cores at once may
+    lose an update.
+*/
+#ifndef FASTMILLIS_CRITICAL_BUDGET_US
+#define FASTMILLIS_CRITICAL_BUDGET_US 0
+#endif
+
+#include <stdio.h>
+
+class CriticalSectionSite {
+public:
+    const char*             file;
+    int                     line;
+    uint32_t                count       = 0;
+    uint32_t                max         = 0;
+    uint64_t                total       = 0;
+    uint32_t                violations  = 0;
+    uint32_t                last_violation = 0;     // cycles
+    Pow2Histogram< 33 >     hist;                   // [n]: 2^(n-1) <= cycles < 2^n
+    CriticalSectionSite*    next        = nullptr;
+    bool                    registered  = false;
+    bool                    pending     = false;    // violation not reported yet
+
+    constexpr CriticalSectionSite( const char* f, int l ) : file(f), line(l) {}
+
+    inline __attribute__((always_inline))
+    void record( uint32_t cycles ) {
+        if( !registered ) link();
+        count++;
+        total += cycles;
+        if( cycles > max ) max = cycles;
+        hist.record( cycles );
+        if( FASTMILLIS_CRITICAL_BUDGET_US && cycles > FASTMILLIS_CRITICAL_BUDGET_US * cpu_clock.mhz ) {
+            violations++;
+            last_violation = cycles;
+            pending = true;
+        }
+    }
+
+    inline __attribute__((always_inline))
+    void check() {
+        if( pending ) {
+            pending = false;
+            on_violation( *this, last_violation );
+        }
+    }
+
+    void link();
+    static CriticalSectionSite* head;
+
+    /*  Called with interrupts enabled, after a section went over budget.
+    */
+    static void (*on_violation)( const CriticalSectionSite& site, uint32_t cycles );
+};
+
+void critical_section_report( FILE* out );
+void critical_section_reset();
+
+#define timeCriticalEnter() {portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; \
+    static CriticalSectionSite _cs_site( __FILE__, __LINE__ ); \
+    portENTER_CRITICAL(&mux); \
+    uint32_t _cs_start = xthal_get_ccount();
+#define timeCriticalExit() _cs_site.record( xthal_get_ccount() - _cs_start ); \
+    portEXIT_CRITICAL(&mux); \
+    _cs_site.check(); }
+
+#else
+
 #define timeCriticalEnter() {portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;portENTER_CRITICAL(&mux);
 #define timeCriticalExit() portEXIT_CRITICAL(&mux);}
 
+#endif
+
 
 /**************************************************************
  * 	Much faster millis() / micros() implementation
@@ -50,6 +234,7 @@ SOFTWARE.
 
 void init_TIMG0();
 
+#ifndef FASTMILLIS_HOST
 #define TIMG0_T0CONFIG_REG (*(volatile unsigned *)(0x3FF5F000)) // configuration register
 #define TIMG0_T0LO_REG     (*(volatile uint32_t*)(0x3FF5F004)) // bottom 32-bits of the timer value
 #define TIMG0_T0HI_REG     (*(volatile uint32_t*)(0x3FF5F008)) // top 32-bits of the timer value
@@ -65,6 +250,7 @@ void init_TIMG0();
 #define TIMG0_T1LOAD_LO_REG (*(volatile uint32_t*)(0x3FF5F03C)) 
 #define TIMG0_T1LOAD_HI_REG (*(volatile uint32_t*)(0x3FF5F040)) 
 #define TIMG0_T1LOAD_REG    (*(volatile uint32_t*)(0x3FF5F044)) 
+#endif
 
 /*  INTERRUPT SAFE, usable in interrupts and userland code
     This does only one load, so it doesn't have any wraparound issues.
@@ -77,33 +263,179 @@ static inline uint32_t IRAM_ATTR fastmicros() {
   return TIMG0_T0LO_REG;  // read registers
 }
 
+/*  Wait-free 64-bit read of a latched timer.
+
+    An ISR (or the other core) calling fastmicros()/fastmillis() between our
+    loads relatches the timer, so HI and LO may come from different snapshots.
+    A relatch can only make the value newer, and the loads take far less than
+    2^31 timer ticks, so instead of retrying we read HI, LO, HI again:
+
+    - both HI equal: LO belongs to that HI whichever snapshot it came from.
+    - HI changed: LO wrapped around between the two HI loads. If the top bit
+      of LO is clear LO was read after the wraparound and belongs to the
+      second HI, otherwise it belongs to the first one.
+
+    Always 4 register accesses, no loop, so the worst case is bounded no
+    matter how many interrupts hit.
+*/
+static inline uint64_t IRAM_ATTR timg0_combine64( uint32_t hi, uint32_t lo, uint32_t hi2 ) {
+  if( hi != hi2 && !(lo & 0x80000000) ) hi = hi2;
+  return (uint64_t(hi)<<32) | lo;
+}
+
+static inline uint64_t IRAM_ATTR timg0_t0_read64() {
+  TIMG0_T0UPDATE_REG = 0; // write here to tell the hardware to copy counter value into read registers
+  uint32_t hi  = TIMG0_T0HI_REG;
+  uint32_t lo  = TIMG0_T0LO_REG;
+  uint32_t hi2 = TIMG0_T0HI_REG;
+  return timg0_combine64( hi, lo, hi2 );
+}
+
+static inline uint64_t IRAM_ATTR timg0_t1_read64() {
+  TIMG0_T1UPDATE_REG = 0;
+  uint32_t hi  = TIMG0_T1HI_REG;
+  uint32_t lo  = TIMG0_T1LO_REG;
+  uint32_t hi2 = TIMG0_T1HI_REG;
+  return timg0_combine64( hi, lo, hi2 );
+}
+
 /*  INTERRUPT SAFE, usable in interrupts and userland code
-    This loads the counter value twice to make sure fastmillis() called from an
-    ISR didn't mess with it between the two loads. 
+    Milliseconds, wraps around after 49.7 days.
 */
 uint32_t fastmillis();
 
 /*  INTERRUPT SAFE, usable in interrupts and userland code
-    This loads the counter value twice to make sure fastmillis() called from an
-    ISR didn't mess with it between the two loads. 
+    Milliseconds, never wraps around.
+*/
+uint64_t fastmillis64();
+
+/*  INTERRUPT SAFE, usable in interrupts and userland code
+    Microseconds, never wraps around.
 */
 uint64_t fastmicros64();
 
-/*  NOT INTERRUPT SAFE
-    /!\ WARNING: If an interrupt occurs between the two loads, and the ISR writes to 
-    TIMG0_T0UPDATE_REG, then the second 32-bit value read will be wrong, which means the
-    entire 64-bit value read will be wrong.
+/*  INTERRUPT SAFE, usable in interrupts and userland code
+    Same as fastmicros64(), inlined. This used to be the fast but interrupt
+    unsafe version, it is kept for compatibility.
+*/
+static inline uint64_t IRAM_ATTR fastmicros64_isr() {
+  return timg0_t0_read64();
+}
+
+/**************************************************************
+ *  Cycle timebase
+ *
+ *  xthal_get_ccount() counts the cycles of the core it runs on.
+ *  The two cores did not start at the same time, so their counters
+ *  are far apart, and both change pace with the CPU clock: a task
+ *  that moves to the other core between two reads measures garbage.
+ *
+ *  fastcycles() maps the counter of the current core onto a
+ *  timebase shared by all cores, with an offset and a scale per
+ *  core measured against TIMG0_T0. It counts FASTCYCLES_MHZ ticks
+ *  per µs whatever the CPU clock, and stays in step with
+ *  fastmicros() * FASTCYCLES_MHZ at sub-µs resolution. It costs a
+ *  ccount read, a multiply, and two reads of the core id to catch
+ *  a task that moved in the middle.
+ *
+ *  fastcycles_calibrate() measures every core; cpu_clock_calibrate()
+ *  calls it. Until then fastcycles() is the raw counter. Cores agree
+ *  within FastCyclesCore::error ticks, half a poll of the timer.
+ *
+ *  The scale is snapped to FASTCYCLES_MHZ / MHz when the measurement
+ *  can't tell them apart, so cores sharing a clock, as on the ESP32,
+ *  get the same scale and never drift apart. Once the cycles since
+ *  the anchor pass 2^31, fastcycles() moves the anchor forward by a
+ *  whole number of 2^24 cycles, which loses nothing, so a scale that
+ *  is not a whole number (160MHz) keeps working past the 32 bit
+ *  wrap. fastcycles_calibrate() also starts an esp_timer that does
+ *  it on every core every FASTCYCLES_REBASE_US, in time for a core
+ *  that doesn't read fastcycles() for a while.
+ *  Cores with their own clocks (the host
+ *  simulation can skew them) drift: call fastcycles_sync() on each
+ *  core every few seconds, it re-anchors the core to the timer and
+ *  refines its scale from the previous anchor. A core that got ahead
+ *  does not go back in time: it runs up to FASTCYCLES_SLEW_PPM slower
+ *  until it is in step again.
+ **************************************************************/
+
+#include <stdio.h>
+
+#ifndef FASTCYCLES_CORES
+#define FASTCYCLES_CORES 2
+#endif
+
+// how much slower a core that got ahead may run to get back in step
+#ifndef FASTCYCLES_SLEW_PPM
+#define FASTCYCLES_SLEW_PPM 1000
+#endif
+
+// how often every core reads fastcycles(): well within 2^31 cycles
+#ifndef FASTCYCLES_REBASE_US
+#define FASTCYCLES_REBASE_US 4000000
+#endif
+
+// fastcycles() ticks per µs
+#define FASTCYCLES_MHZ CPU_FREQUENCY_MHZ
+
+struct FastCyclesCore {
+    uint32_t    seq     = 0;                // odd while the core rewrites this
+    uint32_t    ccount0 = 0;                // the core's xthal_get_ccount() at the anchor
+    uint32_t    tick0   = 0;                // fastcycles() at ccount0
+    uint32_t    scale   = 1 << 24;          // ticks per cycle, 8.24 fixed point
+    uint32_t    rate    = 1 << 24;          // same, measured: scale is slower while catching up
+    uint32_t    us0     = 0;                // fastmicros() at the last timer edge
+    uint32_t    ccount_us0 = 0;             // the core's xthal_get_ccount() at us0
+    uint32_t    us_base = 0;                // fastmicros() near ccount0, to count wraps
+    uint32_t    poll    = 0;                // cycles, one poll of the timer at the anchor
+    uint32_t    error   = 0;                // ticks, how far the anchor may be from the timer
+    uint32_t    syncs   = 0;                // 0: never calibrated
+};
+
+extern FastCyclesCore fastcycles_cores[ FASTCYCLES_CORES ];
 
-    If you don't use any of fastmillis/fastmicros() in your interrupts, then
-    there is no problem.
+// Moves the anchor of the current core forward if it is old, see above.
+void fastcycles_rebase();
 
-    Otherwise only call this in noInterrupts() block.
+/*  INTERRUPT SAFE, usable in interrupts and userland code
+    Wraps around every 2^32 / FASTCYCLES_MHZ µs (17.9s at 240MHz).
 */
-static inline uint64_t IRAM_ATTR fastmicros64_isr() {
-  TIMG0_T0UPDATE_REG = 0; // write here to tell the hardware to copy counter value into read registers
-  return (uint64_t(TIMG0_T0HI_REG)<<32) | TIMG0_T0LO_REG;
+static inline uint32_t IRAM_ATTR fastcycles() {
+    for(;;) {
+        uint32_t core = xPortGetCoreID();
+        const FastCyclesCore& c = fastcycles_cores[ core ];
+        uint32_t seq = __atomic_load_n( &c.seq, __ATOMIC_ACQUIRE );
+        uint32_t d = xthal_get_ccount() - c.ccount0;
+        if( int32_t( d ) < 0 ) {
+            fastcycles_rebase();
+            continue;
+        }
+        uint32_t t = c.tick0 + uint32_t(( uint64_t( d ) * c.scale ) >> 24 );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( !(seq & 1) && __atomic_load_n( &c.seq, __ATOMIC_RELAXED ) == seq && xPortGetCoreID() == core )
+            return t;
+    }
 }
 
+/*  Anchors every core, measuring its scale over about 500µs with
+    interrupts off. Starts over: the cores may jump. Returns false if a
+    core could not be measured. The first call starts the
+    FASTCYCLES_REBASE_US timer.
+*/
+bool fastcycles_calibrate();
+
+/*  Re-anchors the current core, with interrupts off for at most 1µs
+    and a poll of the timer. Refines the scale from the previous anchor.
+*/
+void fastcycles_sync();
+
+/*  Runs fn(arg) on a given core and waits for it: esp_ipc_call_blocking()
+    on the ESP32, fastmillis_host::set_core() around the call on the host.
+*/
+bool fastcycles_run_on_core( uint32_t core, void (*fn)( void* ), void* arg );
+
+void fastcycles_report( FILE* out );
+
 
 /*  fastdelayMicroseconds isn't faster (it's a delay!) but it is much more accurate.
     ESP32 delayMicroseconds() polls micros() which takes a NON-CONSTANT TIME of about 
@@ -119,14 +451,85 @@ void fastDelayMicroseconds( uint32_t us );
 
 
 /*  This one polls xthal_get_ccount() which is a CPU register counting clock cycles,
-    so it will be the most accurate of all, but it depends on #define CPU_FREQUENCY_MHZ 
-    to be there and the clock frequency to actually be set to that value.
+    so it will be the most accurate of all, but it depends on cpu_clock.mhz matching
+    the actual clock frequency, see cpu_clock_calibrate(). The time it takes to call
+    it and to leave the loop, cpu_clock.delay_overhead, is taken off the delay.
 
     It is only usable (and should only be used) for short delays, since the number of 
     CPU cycles has to fit into 31 bits.
+
+    It reads the counter of the core it runs on: a task preempted and moved to the
+    other core in the middle of it waits on the wrong counter. Call it with interrupts
+    off or from a task pinned to a core; MultiDelay counts fastcycles() instead.
 */
 void accurateDelayMicroseconds( uint32_t us );
 
+/*  Both of the above spin for the whole delay, which is right for a few µs,
+    but a 400µs wait burns 400µs of CPU that other tasks could use.
+
+    hybridDelayMicroseconds() sleeps until spin_us before the end, woken up
+    by an esp_timer alarm, then spins on fastcycles() for the rest. Same
+    accuracy, as long as the task is back within spin_us, and on either
+    core: the raw counter of the core it wakes up on would not do.
+    hybridDelayUntil() does the same up to a fastmicros64() deadline,
+    spinning on fastmicros64() (1µs). A deadline 71 minutes or more away
+    is slept to in pieces of 35 minutes.
+
+    spin_us is how late a wake-up can be. hybridDelayBegin() measures it:
+    it sleeps a few times, records how late the alarm brought the task back,
+    and sets spin_us to the worst of that plus HYBRID_DELAY_MARGIN_US.
+    Delays shorter than spin_us + min_sleep_us only spin.
+
+    Until hybridDelayBegin() is called, before the scheduler runs and in
+    interrupts, they only spin. Never call them with interrupts off.
+    HYBRID_DELAY_ALARMS tasks can sleep on an alarm at once, the others
+    sleep whole RTOS ticks only, and spin the rest.
+
+    A higher priority task running when the alarm fires makes us late all
+    the same: hybrid_delay counts how late every wake-up was, and the delays
+    that ended late (overslept). hybrid_delay_report() prints it. Stats may
+    lose an update when two tasks finish a delay at the same time.
+
+    On the host, sleeping is fastmillis_host::sleep_us().
+*/
+#ifndef HYBRID_DELAY_ALARMS
+#define HYBRID_DELAY_ALARMS 4
+#endif
+
+#ifndef HYBRID_DELAY_MARGIN_US
+#define HYBRID_DELAY_MARGIN_US 2
+#endif
+
+#include <stdio.h>
+
+struct HybridDelay {
+    uint32_t    spin_us         = 50;       // set by hybridDelayBegin()
+    uint32_t    min_sleep_us    = 20;       // shorter sleeps aren't worth a context switch
+
+    uint32_t    count           = 0;        // delays
+    uint32_t    sleeps          = 0;        // delays that slept
+    uint32_t    overslept       = 0;        // woke up after the end of the delay
+    uint64_t    slept_us        = 0;        // handed to other tasks
+    uint64_t    spun_cycles     = 0;        // fastcycles() ticks burned spinning
+    int32_t     wake_max        = 0;        // µs late, worst wake-up
+    int64_t     wake_total      = 0;        // µs late, all wake-ups
+    Pow2Histogram< 16 > wake_hist;          // [n]: 2^(n-1) <= µs late < 2^n, [0]: on time or early
+
+    void reset_stats();
+};
+
+extern HybridDelay hybrid_delay;
+
+/*  Creates the alarms and calibrates spin_us. Call it from a task, once the
+    scheduler runs. Returns false if it can't sleep, then delays only spin.
+*/
+bool hybridDelayBegin( uint32_t runs = 32 );
+
+void hybridDelayMicroseconds( uint32_t us );
+void hybridDelayUntil( uint64_t deadline_us );
+
+void hybrid_delay_report( FILE* out );
+
 /*  
     When bit-banging signals...
 
@@ -140,7 +543,7 @@ void accurateDelayMicroseconds( uint32_t us );
     When we get to the third delay, errors on each individual delay add up,
     plus the time taken to execute the instructions in-between.
 
-    This class takes a snapshot of the cycle counter, and all calls to waitUntil()
+    This class takes a snapshot of fastcycles(), and all calls to waitUntil()
     refer to that. So the above would become:
 
     MultiDelay d;
@@ -151,7 +554,8 @@ void accurateDelayMicroseconds( uint32_t us );
     output(1)
     etc...
 
-    And errors will not accumulate.
+    And errors will not accumulate. Since it counts fastcycles() ticks, it
+    stays right if the task moves to the other core between two waits.
 
 */
 class MultiDelay {
@@ -160,7 +564,7 @@ public:
 
     inline __attribute__((always_inline)) 
     void reset() {
-        start_cycles = xthal_get_ccount(); 
+        start_cycles = fastcycles(); 
     }
 
     inline __attribute__((always_inline)) 
@@ -172,19 +576,19 @@ public:
     */
     inline __attribute__((always_inline)) 
     void waitUntilMicros( int us ) { 
-        waitUntilCycles( us*CPU_FREQUENCY_MHZ );
+        waitUntilCycles( us*FASTCYCLES_MHZ );
     }
 
-    /*  Waits until we're "cycles" cpu cycles later than when reset() was called.
+    /*  Waits until we're "cycles" fastcycles() ticks later than when reset() was called.
     */
     inline __attribute__((always_inline)) 
     void waitUntilCycles( int cycles ) { 
-        while( (int)(xthal_get_ccount() - start_cycles) < cycles ) ;
+        while( (int)(fastcycles() - start_cycles) < cycles ) ;
     }
 
     inline __attribute__((always_inline)) 
     int elapsedCycles() {
-        return xthal_get_ccount() - start_cycles; 
+        return fastcycles() - start_cycles; 
     }
 };
 
@@ -0,0 +1,242 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "config.h"
+#include "fastmillis.h"
+#include "fastmillis_bench.h"
+#include "chrono.h"
+#include "timeout.h"
+
+#include <algorithm>
+
+static uint32_t bench_samples[ FASTMILLIS_BENCH_SAMPLES ];
+
+// results go here so the compiler can't drop the calls
+static volatile uint32_t bench_sink;
+
+FastBenchResult fastbench_stats( uint32_t* samples, uint32_t n ) {
+    FastBenchResult r = { n, 0, 0, 0, 0, 0 };
+    if( !n ) return r;
+    std::sort( samples, samples+n );
+    uint64_t sum = 0;
+    for( uint32_t i=0; i<n; i++ )
+        sum += samples[i];
+    r.min    = samples[0];
+    r.median = samples[ (n-1)/2 ];
+    r.p99    = samples[ (uint64_t(n-1)*99)/100 ];
+    r.max    = samples[n-1];
+    r.mean   = sum / n;
+    return r;
+}
+
+void fastbench_print( FILE* out, const char* name, const FastBenchResult& r ) {
+    fprintf( out, "{\"bench\":\"%s\",\"unit\":\"cycles\",\"n\":%u,\"min\":%u,\"median\":%u,\"p99\":%u,\"max\":%u,\"mean\":%u}\n",
+        name, (unsigned)r.n, (unsigned)r.min, (unsigned)r.median, (unsigned)r.p99, (unsigned)r.max, (unsigned)r.mean );
+}
+
+/*  Cost of two back to back xthal_get_ccount(), subtracted from every sample.
+*/
+static uint32_t bench_overhead( uint32_t n ) {
+    uint32_t best = 0xFFFFFFFF;
+    for( uint32_t i=0; i<n; i++ ) {
+        uint32_t c0 = xthal_get_ccount();
+        uint32_t c1 = xthal_get_ccount();
+        best = std::min( best, c1-c0 );
+    }
+    return best;
+}
+
+template< class F >
+static void bench( FILE* out, const char* name, uint32_t n, uint32_t overhead, F f ) {
+    for( uint32_t i=0; i<n; i++ ) {
+        uint32_t c0 = xthal_get_ccount();
+        f();
+        uint32_t c1 = xthal_get_ccount();
+        uint32_t c = c1 - c0;
+        bench_samples[i] = c > overhead ? c - overhead : 0;
+    }
+    fastbench_print( out, name, fastbench_stats( bench_samples, n ));
+}
+
+static void bench_64bit_reads( FILE* out, uint32_t n, uint32_t overhead, const char* suffix ) {
+    char name[48];
+    snprintf( name, sizeof(name), "fastmillis%s", suffix );
+    bench( out, name, n, overhead, []{ bench_sink = fastmillis(); } );
+    snprintf( name, sizeof(name), "fastmicros64%s", suffix );
+    bench( out, name, n, overhead, []{ bench_sink = fastmicros64(); } );
+}
+
+#ifdef FASTMILLIS_HOST
+/*  Simulated ISR: takes 2µs and calls fastmicros()/fastmillis(), which relatches
+    both timers under the feet of the code being measured.
+*/
+static void bench_isr() {
+    fastmillis_host::advance_us( 2 );
+    TIMG0_T0UPDATE_REG = 0;
+    TIMG0_T1UPDATE_REG = 0;
+}
+#endif
+
+void fastmillis_benchmark( FILE* out, uint32_t n ) {
+    if( n > FASTMILLIS_BENCH_SAMPLES )
+        n = FASTMILLIS_BENCH_SAMPLES;
+
+#ifdef FASTMILLIS_HOST
+    const char* backend = fastmillis_host::realtime() ? "host-realtime" : "host-virtual";
+#else
+    const char* backend = "esp32";
+#endif
+    fprintf( out, "{\"run\":\"fastmillis_benchmark\",\"backend\":\"%s\",\"cpu_mhz\":%u,\"samples\":%u}\n",
+        backend, (unsigned)getCpuFrequencyMhz(), (unsigned)n );
+
+    uint32_t overhead = bench_overhead( n );
+
+    bench( out, "fastmicros", n, overhead, []{ bench_sink = fastmicros(); } );
+    bench( out, "xthal_get_ccount", n, overhead, []{ bench_sink = xthal_get_ccount(); } );
+    bench( out, "fastcycles", n, overhead, []{ bench_sink = fastcycles(); } );
+    bench_64bit_reads( out, n, overhead, "" );
+    bench( out, "fastmicros64_isr", n, overhead, []{ bench_sink = fastmicros64_isr(); } );
+
+    static Chrono chrono;
+    chrono.reset();
+    bench( out, "Chrono::tick", n, overhead, []{ bench_sink = chrono.tick(); } );
+
+    static Timeout timeout;
+    timeout.set( 1<<29 );
+    bench( out, "Timeout::remaining", n, overhead, []{ bench_sink = timeout.remaining(); } );
+
+#ifdef FASTMILLIS_HOST
+    fastmillis_host::set_access_hook( bench_isr, 3 );
+    bench_64bit_reads( out, n, overhead, "_isr_load" );
+    fastmillis_host::set_access_hook( nullptr, 0 );
+#else
+    // the stock Arduino functions, for comparison
+    bench( out, "micros", n, overhead, []{ bench_sink = micros(); } );
+    bench( out, "millis", n, overhead, []{ bench_sink = millis(); } );
+#endif
+}
+
+/**************************************************************
+ *  Delay accuracy, see fastmillis_delay_accuracy()
+ **************************************************************/
+
+/*  Times f() "n" times, prints the error against target_us in ns. Cycles
+    become ns at "mhz", the actual frequency.
+*/
+template< class F >
+static void accuracy( FILE* out, const char* name, uint32_t mhz, uint32_t target_us, uint32_t n, uint32_t overhead, F f ) {
+    for( uint32_t i=0; i<n; i++ ) {
+        uint32_t c0 = xthal_get_ccount();
+        f();
+        uint32_t c = xthal_get_ccount() - c0;
+        c = c > overhead ? c - overhead : 0;
+        bench_samples[i] = uint64_t(c) * 1000 / mhz;
+    }
+    FastBenchResult r = fastbench_stats( bench_samples, n );
+    int32_t t = target_us * 1000;
+    fprintf( out, "{\"bench\":\"%s\",\"unit\":\"ns_error\",\"mhz\":%u,\"n\":%u,\"min\":%d,\"median\":%d,\"p99\":%d,\"max\":%d,\"mean\":%d}\n",
+        name, (unsigned)mhz, (unsigned)r.n, int32_t(r.min) - t, int32_t(r.median) - t,
+        int32_t(r.p99) - t, int32_t(r.max) - t, int32_t(r.mean) - t );
+}
+
+void fastmillis_delay_accuracy( FILE* out, const uint32_t* mhz, uint32_t count, uint32_t n ) {
+    if( n > FASTMILLIS_BENCH_SAMPLES )
+        n = FASTMILLIS_BENCH_SAMPLES;
+    uint32_t initial = getCpuFrequencyMhz();
+    if( !cpu_clock.measured_khz )
+        cpu_clock_calibrate();
+
+    for( uint32_t i=0; i<count; i++ ) {
+        uint32_t f = mhz[i];
+        // the frequency changes under the delays' feet first
+#ifdef FASTMILLIS_HOST
+        fastmillis_host::set_cpu_mhz( f );
+#else
+        if( !setCpuFrequencyMhz( f ))
+            continue;
+#endif
+        uint32_t overhead = bench_overhead( n );
+        uint32_t was = cpu_clock.mhz;
+        accuracy( out, "accurateDelayMicroseconds(10)_stale", f, 10, n, overhead, []{ accurateDelayMicroseconds( 10 ); } );
+
+        cpu_clock_update();
+        fprintf( out, "{\"cpu_clock\":%d,\"mhz\":%u,\"was\":%u,\"measured_khz\":%u,\"delay_overhead\":%u}\n",
+            cpu_clock.mhz == f, (unsigned)cpu_clock.mhz, (unsigned)was, (unsigned)cpu_clock.measured_khz, (unsigned)cpu_clock.delay_overhead );
+
+        overhead = bench_overhead( n );
+        for( uint32_t us : { 1, 10, 100 } ) {
+            static uint32_t d;
+            char name[48];
+            d = us;
+            snprintf( name, sizeof(name), "fastDelayMicroseconds(%u)", (unsigned)us );
+            accuracy( out, name, f, us, n, overhead, []{ fastDelayMicroseconds( d ); } );
+            snprintf( name, sizeof(name), "accurateDelayMicroseconds(%u)", (unsigned)us );
+            accuracy( out, name, f, us, n, overhead, []{ accurateDelayMicroseconds( d ); } );
+            snprintf( name, sizeof(name), "MultiDelay::waitUntilMicros(%u)", (unsigned)us );
+            accuracy( out, name, f, us, n, overhead, []{ MultiDelay m; m.waitUntilMicros( d ); } );
+        }
+    }
+    cpu_clock_set_mhz( initial );
+}
+
+/**************************************************************
+ *  Cycle timebase across cores, see fastcycles_cross_core()
+ **************************************************************/
+
+struct CrossCoreRead {
+    uint32_t fast, raw;
+};
+
+static void cross_core_read( void* arg ) {
+    CrossCoreRead* r = (CrossCoreRead*)arg;
+    r->fast = fastcycles();
+    r->raw  = xthal_get_ccount();
+}
+
+static void cross_core_print( FILE* out, const char* name, uint32_t n, int32_t min, int32_t max, uint32_t backwards ) {
+    fprintf( out, "{\"bench\":\"%s\",\"unit\":\"ticks\",\"n\":%u,\"min\":%d,\"max\":%d,\"backwards\":%u}\n",
+        name, (unsigned)n, min, max, (unsigned)backwards );
+}
+
+void fastcycles_cross_core( FILE* out, uint32_t n ) {
+    CrossCoreRead prev, r;
+    int32_t fast_min = INT32_MAX, fast_max = INT32_MIN, raw_min = INT32_MAX, raw_max = INT32_MIN;
+    uint32_t fast_back = 0, raw_back = 0;
+    if( !fastcycles_run_on_core( 0, cross_core_read, &prev ))
+        return;
+    for( uint32_t i=1; i<=n; i++ ) {
+        if( !fastcycles_run_on_core( i & 1, cross_core_read, &r ))
+            return;             // single core
+        int32_t fast = r.fast - prev.fast, raw = r.raw - prev.raw;
+        fast_min = std::min( fast_min, fast );
+        fast_max = std::max( fast_max, fast );
+        raw_min  = std::min( raw_min, raw );
+        raw_max  = std::max( raw_max, raw );
+        fast_back += fast < 0;
+        raw_back  += raw < 0;
+        prev = r;
+    }
+    cross_core_print( out, "fastcycles_cross_core", n, fast_min, fast_max, fast_back );
+    cross_core_print( out, "xthal_get_ccount_cross_core", n, raw_min, raw_max, raw_back );
+}
@@ -0,0 +1,88 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ *  Microbenchmarks for the timing primitives
+ *
+ *  Each primitive is called many times, and the cost of every single
+ *  call is measured in CPU cycles with xthal_get_ccount(), minus the
+ *  cost of an empty measurement. The distribution is reported as one
+ *  JSON object per line:
+ *
+ *  {"bench":"fastmicros","unit":"cycles","n":1024,"min":..,"median":..,"p99":..,"max":..,"mean":..}
+ *
+ *  The first line describes the run (backend, CPU frequency).
+ *
+ *  On the ESP32, call it from setup() and it prints to the console.
+ *  With the host backend (FASTMILLIS_HOST) it runs against the virtual
+ *  clock, where the numbers are deterministic and count simulated
+ *  register accesses, so a change in a retry loop shows up immediately.
+ *  The host run also repeats the 64-bit reads with a simulated ISR
+ *  relatching the timers between register accesses ("..._isr_load").
+ **************************************************************/
+
+#include <stdio.h>
+#include "fastmillis.h"
+
+#ifndef FASTMILLIS_BENCH_SAMPLES
+#define FASTMILLIS_BENCH_SAMPLES 1024
+#endif
+
+struct FastBenchResult {
+    uint32_t n, min, median, p99, max, mean;
+};
+
+/*  Computes the statistics of samples[0..n-1], in place (sorts them).
+*/
+FastBenchResult fastbench_stats( uint32_t* samples, uint32_t n );
+
+/*  Prints one result line.
+*/
+void fastbench_print( FILE* out, const char* name, const FastBenchResult& r );
+
+/*  Runs every benchmark, "samples" calls each (at most FASTMILLIS_BENCH_SAMPLES).
+*/
+void fastmillis_benchmark( FILE* out = stdout, uint32_t samples = FASTMILLIS_BENCH_SAMPLES );
+
+/*  Delay accuracy at each CPU frequency in mhz[0..count-1]: switches to it
+    with cpu_clock_set_mhz(), then times fastDelayMicroseconds(),
+    accurateDelayMicroseconds() and MultiDelay::waitUntilMicros() for 1, 10
+    and 100µs, "samples" calls each. One line per delay, the error in ns:
+    {"bench":"accurateDelayMicroseconds(10)","unit":"ns_error","mhz":80,"n":..,"min":..,...}
+    Each frequency starts with one "_stale" line, the same delay timed
+    before cpu_clock caught up with the new frequency. Goes back to the
+    initial frequency at the end.
+*/
+void fastmillis_delay_accuracy( FILE* out, const uint32_t* mhz, uint32_t count, uint32_t samples = 256 );
+
+/*  Reads fastcycles() and xthal_get_ccount() on alternate cores, like a
+    task that keeps moving, "samples" times, and prints the step from
+    each read to the previous one, made on the other core, in ticks:
+    {"bench":"fastcycles_cross_core","unit":"ticks","n":..,"min":..,"max":..,"backwards":..}
+    "backwards" counts the steps back in time. Prints nothing on a single
+    core. Call cpu_clock_calibrate() first.
+*/
+void fastcycles_cross_core( FILE* out, uint32_t samples = 256 );
@@ -3,6 +3,7 @@
  **************************************************************/
 
 #include <AceRoutine.h>
+#include "fastmillis_units.h"
 
 class FastClockInterface {
   public:
@@ -12,28 +13,19 @@ class FastClockInterface {
     /** Get the current micros. */
     static unsigned long micros() { return ::fastmicros(); }
 
-    static unsigned long cycles() { return ::xthal_get_ccount(); }
+    /** fastcycles(), so a coroutine resumed on the other core is timed right. */
+    static unsigned long cycles() { return ::fastcycles(); }
 
     /** This should be updated if cycles() is modified to count CPU cycles
      */
-    static unsigned long cycles_per_second() { return 1000000*getCpuFrequencyMhz(); }
+    static unsigned long cycles_per_second() { return 1000000*FASTCYCLES_MHZ; }
 
     /**
-     * Get the current seconds. This is derived by dividing millis() by 1000,
-     * which works pretty well until the `unsigned long` rolls over at
-     * 4294967296 milliseconds. At that last second (4294967), this function
-     * returns the next second (0) a little bit too early. More precisely, it
-     * rolls over to 0 seconds 704 milliseconds too early. If the
-     * COROUTINE_DELAY_SECONDS() is large enough, this inaccuracy should not
-     * matter too much.
-     *
-     * The other problem with this function is that on 8-bit processors without
-     * a hardware division instruction, the software long division by 1000 is
-     * very expensive in both memory and CPU. The flash memory increases by
-     * about 150 bytes on AVR processors. Therefore, the
-     * COROUTINE_DELAY_SECONDS() should be used sparingly.
+     * Get the current seconds, from the 64-bit microsecond counter with a
+     * multiply instead of a division (see fastmillis_units.h): it does not
+     * roll over early like fastmillis() / 1000 would.
      */
-    static unsigned long seconds() { return ::fastmillis() / 1000; }
+    static unsigned long seconds() { return ::fastseconds(); }
 };
 
 // using namespace ace_routine;
@@ -45,3 +37,225 @@ using CoroutineScheduler = ace_routine::CoroutineSchedulerTemplate<Coroutine>;
 using Profiler = ace_routine::Profiler;
 
 
+/**************************************************************
+ *  Deadline-ordered scheduler
+ *
+ *  CoroutineScheduler visits every coroutine round-robin, and each
+ *  one sleeping in COROUTINE_DELAY() reads the clock just to find out
+ *  it must keep sleeping.
+ *
+ *  FastCoroutineScheduler keeps sleeping coroutines in a min-heap
+ *  keyed by wake-up time, and only runs the ones that are runnable.
+ *  Each pass reads the clock once, and only if something is sleeping;
+ *  waking a coroutine costs O(log n).
+ *
+ *  Coroutines derive from FastCoroutine and sleep with
+ *  FAST_COROUTINE_DELAY() / FAST_COROUTINE_DELAY_MICROS(). Plain
+ *  COROUTINE_DELAY() still works, it just polls like before.
+ *
+ *  Call FastCoroutineScheduler::setup() once, then
+ *  FastCoroutineScheduler::loop() instead of CoroutineScheduler::loop().
+ *
+ *  Give a coroutine a FastProfiler with setProfiler() to record the
+ *  cycles spent in each of its runs.
+ **************************************************************/
+
+#include "profiler.h"
+#include "trace.h"
+
+class FastCoroutine : public Coroutine {
+  public:
+    FastCoroutine() {
+        _fast_next = root();
+        root() = this;
+    }
+
+    /** Sleep until fastmicros64() reaches wake_us, then run again. */
+    void fastSleepUntil( uint64_t wake_us ) {
+        _wake_us = wake_us;
+        _sleeping = true;
+    }
+
+    /** Same, but wake up hybrid_delay.spin_us early: see FAST_COROUTINE_DELAY_MICROS_PRECISE(). */
+    void fastSleepUntilPrecise( uint64_t deadline_us ) {
+        _deadline_us = deadline_us;
+        uint32_t early = hybrid_delay.spin_us;
+        fastSleepUntil( deadline_us > early ? deadline_us - early : 0 );
+    }
+
+    uint64_t wakeMicros() const { return _wake_us; }
+    uint64_t deadlineMicros() const { return _deadline_us; }
+    bool isSleeping() const { return _sleeping; }
+
+    /** All FastCoroutine instances, in reverse order of construction. */
+    static FastCoroutine*& root() {
+        static FastCoroutine* r = nullptr;
+        return r;
+    }
+
+    FastCoroutine* fastNext() const { return _fast_next; }
+
+    void setProfiler( FastProfiler* p ) { _profiler = p; }
+    FastProfiler* getProfiler() const { return _profiler; }
+
+  private:
+    template< uint16_t > friend class FastCoroutineSchedulerTemplate;
+
+    FastCoroutine*  _fast_next;         // registration list
+    FastCoroutine*  _run_next = nullptr;// run queue
+    uint64_t        _wake_us  = 0;
+    uint64_t        _deadline_us = 0;
+    bool            _sleeping = false;
+    FastProfiler*   _profiler = nullptr;
+};
+
+#define FAST_COROUTINE_DELAY_MICROS(us) do { \
+    this->fastSleepUntil( fastmicros64() + (us) ); \
+    COROUTINE_YIELD(); \
+  } while (false)
+
+#define FAST_COROUTINE_DELAY(ms) FAST_COROUTINE_DELAY_MICROS( uint64_t(ms)*1000 )
+
+/*  The scheduler runs a coroutine on the first pass after its wake-up time,
+    late by whatever ran before it. This one is woken up spin_us early (see
+    hybridDelayMicroseconds()) and spins to the deadline, for coroutines that
+    bit-bang or sample on a schedule.
+*/
+#define FAST_COROUTINE_DELAY_MICROS_PRECISE(us) do { \
+    this->fastSleepUntilPrecise( fastmicros64() + (us) ); \
+    COROUTINE_YIELD(); \
+    hybridDelayUntil( this->deadlineMicros() ); \
+  } while (false)
+
+/*  MAX_SLEEPING is the heap capacity. If more coroutines sleep at once, the
+    extra ones stay in the run queue and compare their wake-up time against
+    the clock on every pass, like plain COROUTINE_DELAY().
+*/
+template< uint16_t MAX_SLEEPING >
+class FastCoroutineSchedulerTemplate {
+  public:
+    /** Queues every FastCoroutine for its first run. */
+    static void setup() {
+        for( FastCoroutine* c = FastCoroutine::root(); c; c = c->fastNext() )
+            push_runnable( c );
+    }
+
+    /** Wakes the coroutines that are due, then runs each runnable one once. */
+    static void loop() {
+        bool have_now = false;
+        uint64_t now = 0;
+
+        if( _heap_size ) {
+            now = fastmicros64();
+            have_now = true;
+            while( _heap_size && _heap[0]->_wake_us <= now ) {
+                FastCoroutine* c = heap_pop();
+                c->_sleeping = false;
+                push_runnable( c );
+            }
+        }
+
+        for( uint16_t n = _run_count; n; n-- ) {
+            FastCoroutine* c = pop_runnable();
+
+            if( c->_sleeping ) {            // heap was full when it went to sleep
+                if( !have_now ) {
+                    now = fastmicros64();
+                    have_now = true;
+                }
+                if( c->_wake_us > now ) {
+                    requeue( c );
+                    continue;
+                }
+                c->_sleeping = false;
+            }
+
+            if( !c->isSuspended() ) {
+                TRACE_BEGIN_V( "coroutine", (int32_t)(uintptr_t)c );
+                if( c->_profiler ) {
+                    FastProfiler::Scope s( *c->_profiler );
+                    c->runCoroutine();
+                } else {
+                    c->runCoroutine();
+                }
+                TRACE_END( "coroutine" );
+            }
+            requeue( c );
+        }
+    }
+
+    /** Number of coroutines waiting in the heap. */
+    static uint16_t sleeping() { return _heap_size; }
+
+  private:
+    static FastCoroutine*   _heap[ MAX_SLEEPING ];
+    static uint16_t         _heap_size;
+    static FastCoroutine*   _run_head;
+    static FastCoroutine*   _run_tail;
+    static uint16_t         _run_count;
+
+    static void requeue( FastCoroutine* c ) {
+        if( c->isDone() )
+            return;
+        if( c->_sleeping && _heap_size < MAX_SLEEPING )
+            heap_push( c );
+        else
+            push_runnable( c );
+    }
+
+    static void push_runnable( FastCoroutine* c ) {
+        c->_run_next = nullptr;
+        if( _run_tail ) _run_tail->_run_next = c;
+        else            _run_head = c;
+        _run_tail = c;
+        _run_count++;
+    }
+
+    static FastCoroutine* pop_runnable() {
+        FastCoroutine* c = _run_head;
+        _run_head = c->_run_next;
+        if( !_run_head ) _run_tail = nullptr;
+        _run_count--;
+        return c;
+    }
+
+    static void heap_push( FastCoroutine* c ) {
+        uint16_t i = _heap_size++;
+        while( i ) {
+            uint16_t parent = (i-1) / 2;
+            if( _heap[parent]->_wake_us <= c->_wake_us )
+                break;
+            _heap[i] = _heap[parent];
+            i = parent;
+        }
+        _heap[i] = c;
+    }
+
+    static FastCoroutine* heap_pop() {
+        FastCoroutine* top  = _heap[0];
+        FastCoroutine* last = _heap[ --_heap_size ];
+        uint16_t i = 0;
+        for(;;) {
+            uint16_t child = 2*i + 1;
+            if( child >= _heap_size )
+                break;
+            if( child+1 < _heap_size && _heap[child+1]->_wake_us < _heap[child]->_wake_us )
+                child++;
+            if( last->_wake_us <= _heap[child]->_wake_us )
+                break;
+            _heap[i] = _heap[child];
+            i = child;
+        }
+        if( _heap_size )
+            _heap[i] = last;
+        return top;
+    }
+};
+
+template< uint16_t N > FastCoroutine*   FastCoroutineSchedulerTemplate<N>::_heap[ N ];
+template< uint16_t N > uint16_t         FastCoroutineSchedulerTemplate<N>::_heap_size = 0;
+template< uint16_t N > FastCoroutine*   FastCoroutineSchedulerTemplate<N>::_run_head  = nullptr;
+template< uint16_t N > FastCoroutine*   FastCoroutineSchedulerTemplate<N>::_run_tail  = nullptr;
+template< uint16_t N > uint16_t         FastCoroutineSchedulerTemplate<N>::_run_count = 0;
+
+using FastCoroutineScheduler = FastCoroutineSchedulerTemplate<32>;
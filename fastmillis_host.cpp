@@ -0,0 +1,317 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "config.h"
+#include "fastmillis.h"
+
+#ifdef FASTMILLIS_HOST
+
+#include <chrono>
+#include <thread>
+
+/**************************************************************
+ *  Host clock backend, see fastmillis_host.h
+ **************************************************************/
+
+namespace fastmillis_host {
+
+uint32_t ccount_read_cost = 1;
+uint32_t reg_access_cost  = 4;
+uint32_t wake_latency_ns  = 25000;
+
+Timer timg0[2];
+Core  cores[2];
+
+static const uint64_t PS_PER_APB_TICK = 12500;     // APB_CLK is 80MHz
+
+static bool     s_realtime   = false;
+static uint64_t s_ps         = 0;           // simulated time
+static uint64_t s_real_base  = 0;           // steady_clock ps at which s_ps was last synced
+static uint32_t s_cpu_mhz    = CPU_FREQUENCY_MHZ;
+static uint64_t s_cycles     = 0;
+static uint64_t s_cycles_rem = 0;           // fractional cycles, in units of 1/1000000 cycle
+static thread_local uint32_t s_core = 0;
+
+static void   (*s_hook)()     = nullptr;
+static uint32_t s_hook_period = 0;
+static uint32_t s_hook_count  = 0;
+static bool     s_in_hook     = false;
+
+static uint64_t s_preempt_period = 0;       // ps, 0 = off
+static uint64_t s_preempt_length = 0;
+static uint64_t s_preempt_next   = 0;
+static bool     s_preempting     = false;
+
+struct Periodic {
+    void      (*fn)( void* );
+    void*       arg;
+    uint64_t    period;             // ps
+    uint64_t    next;
+};
+static Periodic s_timers[4];
+static uint32_t s_timer_count = 0;
+static bool     s_in_timer    = false;
+
+uint32_t preemptions = 0;
+thread_local uint32_t critical_depth = 0;
+
+static uint64_t steady_ps() {
+    return uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count() ) * 1000;
+}
+
+/*  All time flows through here, so the cycle counter follows frequency changes.
+*/
+static void preempt();
+static void run_timers();
+
+static void elapse( uint64_t ps ) {
+    s_ps += ps;
+    s_cycles_rem += ps * s_cpu_mhz;
+    s_cycles     += s_cycles_rem / 1000000;
+    s_cycles_rem %= 1000000;
+    preempt();
+    run_timers();
+}
+
+/*  Runs the periodic timers that are due, unless in a critical section.
+    Like esp_timer, one that fell behind runs once and carries on from now.
+*/
+static void run_timers() {
+    if( s_in_timer || critical_depth )
+        return;
+    s_in_timer = true;
+    for( uint32_t i=0; i<s_timer_count; i++ ) {
+        Periodic& t = s_timers[i];
+        if( s_ps < t.next )
+            continue;
+        t.next = s_ps + t.period;
+        t.fn( t.arg );
+    }
+    s_in_timer = false;
+}
+
+/*  Runs the preemption if it is due, unless in a critical section. Like a
+    pending interrupt, several that came due meanwhile run once.
+*/
+static void preempt() {
+    if( !s_preempt_period || s_preempting || critical_depth || s_realtime )
+        return;
+    if( s_ps < s_preempt_next )
+        return;
+    s_preempting = true;
+    preemptions++;
+    elapse( s_preempt_length );
+    s_preempt_next = s_ps + s_preempt_period;
+    s_preempting = false;
+}
+
+static void sync() {
+    if( !s_realtime ) return;
+    uint64_t r = steady_ps();
+    elapse( r - s_real_base );
+    s_real_base = r;
+}
+
+static void cost( uint32_t cycles ) {
+    if( !s_realtime )
+        elapse( uint64_t(cycles) * 1000000 / s_cpu_mhz );
+}
+
+uint64_t now_ps() {
+    sync();
+    return s_ps;
+}
+
+void advance_ps( uint64_t ps ) {
+    sync();
+    elapse( ps );
+}
+
+void advance_cycles( uint64_t cycles ) {
+    advance_ps( cycles * 1000000 / s_cpu_mhz );
+}
+
+void reset() {
+    s_ps = s_cycles = s_cycles_rem = 0;
+    s_real_base = steady_ps();
+    s_hook_count = 0;
+    s_preempt_next = s_preempt_period;
+    for( uint32_t i=0; i<s_timer_count; i++ )
+        s_timers[i].next = s_timers[i].period;
+    timg0[0] = Timer();
+    timg0[1] = Timer();
+}
+
+void set_realtime( bool realtime ) {
+    sync();
+    s_realtime  = realtime;
+    s_real_base = steady_ps();
+}
+
+bool realtime() {
+    return s_realtime;
+}
+
+void set_cpu_mhz( uint32_t mhz ) {
+    sync();
+    s_cpu_mhz = mhz;
+}
+
+uint32_t cpu_mhz() {
+    return s_cpu_mhz;
+}
+
+void set_core( uint32_t core ) {
+    s_core = core < 2 ? core : 1;
+}
+
+uint32_t core() {
+    return s_core;
+}
+
+uint32_t ccount() {
+    sync();
+    const Core& k = cores[ s_core ];
+    uint32_t r = uint32_t( s_cycles + int64_t( s_cycles ) * k.ppm / 1000000 ) + k.offset;
+    cost( ccount_read_cost );
+    return r;
+}
+
+void set_access_hook( void (*hook)(), uint32_t period ) {
+    s_hook        = hook;
+    s_hook_period = period;
+    s_hook_count  = 0;
+}
+
+void set_preemption( uint32_t period_us, uint32_t length_us ) {
+    s_preempt_period = uint64_t(period_us) * 1000000;
+    s_preempt_length = uint64_t(length_us) * 1000000;
+    s_preempt_next   = now_ps() + s_preempt_period;
+    preemptions      = 0;
+}
+
+bool start_periodic( void (*fn)( void* ), void* arg, uint32_t period_us ) {
+    if( s_timer_count >= 4 || !period_us )
+        return false;
+    uint64_t period = uint64_t(period_us) * 1000000;
+    s_timers[ s_timer_count++ ] = { fn, arg, period, now_ps() + period };
+    return true;
+}
+
+void critical_exit() {
+    if( critical_depth && !--critical_depth ) {
+        preempt();
+        run_timers();
+    }
+}
+
+void nop() {
+    cost( 1 );
+}
+
+void spend_cycles( uint32_t cycles ) {
+    cost( cycles );
+}
+
+void delay_us( uint32_t us ) {
+    if( !s_realtime ) {
+        advance_us( us );
+        return;
+    }
+    uint64_t end = now_ps() + uint64_t(us) * 1000000;
+    while( now_ps() < end )
+        ;
+}
+
+void sleep_us( uint32_t us ) {
+    if( !s_realtime ) {
+        advance_ps( uint64_t(us) * 1000000 + uint64_t(wake_latency_ns) * 1000 );
+        return;
+    }
+    std::this_thread::sleep_for( std::chrono::microseconds( us ));
+}
+
+uint64_t Timer::value() const {
+    if( !enabled )
+        return base_value;
+    return base_value + (now_ps() / PS_PER_APB_TICK - base_apb) / divider;
+}
+
+void Timer::write_config( uint32_t v ) {
+    base_value = value();
+    base_apb   = now_ps() / PS_PER_APB_TICK;
+    config     = v;
+    enabled    = v & 0x80000000;
+    divider    = (v >> 13) & 0xFFFF;
+    if( !divider ) divider = 65536;
+}
+
+void Timer::load() {
+    base_value = (uint64_t(load_hi) << 32) | load_lo;
+    base_apb   = now_ps() / PS_PER_APB_TICK;
+}
+
+Reg::operator uint32_t() const {
+    uint32_t r = 0;
+    switch( _w ) {
+        case CONFIG:  r = _t.config; break;
+        case LO:      r = uint32_t( _t.latched ); break;
+        case HI:      r = uint32_t( _t.latched >> 32 ); break;
+        case LOAD_LO: r = _t.load_lo; break;
+        case LOAD_HI: r = _t.load_hi; break;
+        default: break;
+    }
+    cost( reg_access_cost );
+    if( s_hook_period && !s_in_hook && ++s_hook_count >= s_hook_period ) {
+        s_hook_count = 0;
+        s_in_hook = true;
+        s_hook();
+        s_in_hook = false;
+    }
+    return r;
+}
+
+Reg& Reg::operator=( uint32_t v ) {
+    switch( _w ) {
+        case CONFIG:  _t.write_config( v ); break;
+        case UPDATE:  _t.update(); break;
+        case LOAD_LO: _t.load_lo = v; break;
+        case LOAD_HI: _t.load_hi = v; break;
+        case LOAD:    _t.load(); break;
+        default: break;
+    }
+    cost( reg_access_cost );
+    return *this;
+}
+
+}   // namespace fastmillis_host
+
+hw_timer_t* timerBegin( uint8_t num, uint16_t divider, bool countUp ) {
+    if( num < 2 )
+        fastmillis_host::timg0[num].write_config( 0x80000000 | (countUp ? 0x40000000 : 0) | (uint32_t(divider) << 13) );
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,246 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ *  Host clock backend
+ *
+ *  Selected by defining FASTMILLIS_HOST (in config.h or with -D).
+ *  fastmillis.h then includes this file instead of defining the
+ *  TIMG0 register addresses, so fastmicros(), fastmillis(), MultiDelay,
+ *  Chrono, Timeout etc. compile unchanged on Linux and run against a
+ *  simulated TIMG0_T0/T1 and a simulated cycle counter.
+ *
+ *  The ESP32 build never sees this file, so it costs nothing on target.
+ *
+ *  Two modes:
+ *
+ *  - virtual (default): time only moves when the code touches the clock.
+ *    Every xthal_get_ccount() read costs ccount_read_cost cycles, every
+ *    timer register access costs reg_access_cost cycles, NOP() costs one
+ *    cycle. Busy-wait loops therefore terminate, and a given sequence of
+ *    register accesses always produces the same timestamps, which makes
+ *    regression tests deterministic. advance_us() etc. move time forward
+ *    explicitly, e.g. to simulate time spent elsewhere.
+ *
+ *  - realtime: time follows std::chrono::steady_clock, for benchmarks.
+ *
+ *  The simulation is not thread safe, except for the current core,
+ *  which is per thread.
+ **************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef CPU_FREQUENCY_MHZ
+#define CPU_FREQUENCY_MHZ 240
+#endif
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+namespace fastmillis_host {
+
+    /*  Simulated cost of clock accesses, in CPU cycles (virtual mode only).
+    */
+    extern uint32_t ccount_read_cost;
+    extern uint32_t reg_access_cost;
+
+    /*  Picoseconds since the start of the simulation.
+    */
+    uint64_t now_ps();
+
+    /*  Moves virtual time forward. In realtime mode this adds an offset,
+        ie simulates a jump in time.
+    */
+    void advance_ps( uint64_t ps );
+    inline void advance_ns( uint64_t ns ) { advance_ps( ns*1000 ); }
+    inline void advance_us( uint64_t us ) { advance_ps( us*1000000 ); }
+    void advance_cycles( uint64_t cycles );
+
+    /*  Rewinds the simulation to t=0, timers stopped.
+    */
+    void reset();
+
+    void set_realtime( bool realtime );
+    bool realtime();
+
+    /*  Simulated CPU frequency. APB clock stays at 80MHz.
+    */
+    void set_cpu_mhz( uint32_t mhz );
+    uint32_t cpu_mhz();
+
+    /*  Simulated cores. A thread runs on core 0 until it calls set_core().
+        Each core has its own cycle counter, like on the ESP32: they started
+        at different times (offset), and unlike on the ESP32, where both
+        cores share a clock, they may run a little fast or slow (ppm), to
+        test fastcycles() against a worst case.
+    */
+    struct Core {
+        uint32_t offset = 0;
+        int32_t  ppm    = 0;
+    };
+    extern Core cores[2];
+
+    void set_core( uint32_t core );
+    uint32_t core();
+
+    /*  Simulated CPU cycle counter of the current core (what
+        xthal_get_ccount() returns).
+    */
+    uint32_t ccount();
+
+    /*  Simulated interrupt: hook() is called once every "period" timer register
+        accesses, between two accesses. Use it to relatch TIMG0_T0UPDATE_REG
+        (ie call fastmicros()) like an ISR would, and check that readers cope.
+        period=0 disables it.
+    */
+    void set_access_hook( void (*hook)(), uint32_t period );
+
+    /*  Simulated preemption: every period_us of virtual time, length_us pass
+        as if an interrupt or a higher priority task ran, the next period
+        starting after it. Not inside a critical section: one due there
+        runs when the outermost section exits, as on target. period_us=0
+        disables it. preemptions counts them.
+    */
+    void set_preemption( uint32_t period_us, uint32_t length_us );
+    extern uint32_t preemptions;
+
+    /*  Simulated periodic esp_timer: fn(arg) runs every period_us of virtual
+        time, on the thread that moves the clock past it, once out of any
+        critical section. Up to 4 timers, false if there is no room.
+    */
+    bool start_periodic( void (*fn)( void* ), void* arg, uint32_t period_us );
+
+    /*  What portENTER_CRITICAL()/portEXIT_CRITICAL() do on the host: count
+        the nesting, per thread, so that preemption waits for the exit.
+    */
+    extern thread_local uint32_t critical_depth;
+    inline void critical_enter() { critical_depth++; }
+    void critical_exit();
+
+    /*  Cost of an access to a simulated peripheral other than the timers
+        (GPIO...). Moves virtual time, does nothing in realtime mode.
+    */
+    void spend_cycles( uint32_t cycles );
+
+    /*  delayMicroseconds(): jumps in virtual mode, spins in realtime mode.
+    */
+    void delay_us( uint32_t us );
+
+    /*  What hybridDelayMicroseconds() does instead of blocking on an alarm:
+        in virtual mode, a jump of us plus wake_latency_ns, the time the alarm
+        and the context switch would take; in realtime mode, a real sleep.
+    */
+    extern uint32_t wake_latency_ns;
+    void sleep_us( uint32_t us );
+
+    /*  One general purpose timer of timer group 0, as seen through its registers.
+    */
+    class Timer {
+    public:
+        bool     enabled    = false;
+        uint32_t divider    = 2;        // hardware reset value
+        uint64_t base_value = 0;        // counter value at base_apb
+        uint64_t base_apb   = 0;        // APB tick at which base_value was valid
+        uint64_t latched    = 0;        // copied by a write to UPDATE
+        uint32_t config     = 0;
+        uint32_t load_lo    = 0,
+                 load_hi    = 0;
+
+        uint64_t value() const;
+        void     write_config( uint32_t v );
+        void     load();
+        void     update() { latched = value(); }
+    };
+
+    extern Timer timg0[2];
+
+    /*  Register proxy. fastmillis.h uses the TIMG0_Tx*_REG macros as lvalues
+        (write to UPDATE, CONFIG, LOAD) and rvalues (read LO, HI) exactly like
+        the volatile pointers used on target.
+    */
+    class Reg {
+    public:
+        enum Which : uint8_t { CONFIG, LO, HI, UPDATE, LOAD_LO, LOAD_HI, LOAD };
+
+        Reg( Timer& t, Which w ) : _t(t), _w(w) {}
+        operator uint32_t() const;
+        Reg& operator=( uint32_t v );
+
+    private:
+        Timer& _t;
+        Which  _w;
+    };
+
+    void nop();
+}
+
+#define TIMG0_T0CONFIG_REG  (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::CONFIG))
+#define TIMG0_T0LO_REG      (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::LO))
+#define TIMG0_T0HI_REG      (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::HI))
+#define TIMG0_T0UPDATE_REG  (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::UPDATE))
+#define TIMG0_T0LOAD_LO_REG (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::LOAD_LO))
+#define TIMG0_T0LOAD_HI_REG (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::LOAD_HI))
+#define TIMG0_T0LOAD_REG    (fastmillis_host::Reg(fastmillis_host::timg0[0], fastmillis_host::Reg::LOAD))
+
+#define TIMG0_T1CONFIG_REG  (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::CONFIG))
+#define TIMG0_T1LO_REG      (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::LO))
+#define TIMG0_T1HI_REG      (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::HI))
+#define TIMG0_T1UPDATE_REG  (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::UPDATE))
+#define TIMG0_T1LOAD_LO_REG (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::LOAD_LO))
+#define TIMG0_T1LOAD_HI_REG (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::LOAD_HI))
+#define TIMG0_T1LOAD_REG    (fastmillis_host::Reg(fastmillis_host::timg0[1], fastmillis_host::Reg::LOAD))
+
+/**************************************************************
+ *  Minimal stand-ins for the ESP32 / Arduino API used by the
+ *  timing code.
+ **************************************************************/
+
+static inline uint32_t xthal_get_ccount() { return fastmillis_host::ccount(); }
+
+#define NOP() fastmillis_host::nop()
+
+static inline uint32_t getCpuFrequencyMhz() { return fastmillis_host::cpu_mhz(); }
+
+static inline uint32_t xPortGetCoreID() { return fastmillis_host::core(); }
+
+static inline void delayMicroseconds( uint32_t us ) { fastmillis_host::delay_us( us ); }
+
+/*  init_TIMG0() configures the timers through the Arduino timer API.
+    Timers 0 and 1 map to TIMG0_T0 and TIMG0_T1.
+*/
+struct hw_timer_s;
+typedef struct hw_timer_s hw_timer_t;
+hw_timer_t* timerBegin( uint8_t num, uint16_t divider, bool countUp );
+
+/*  No interrupts on the host, critical sections only hold off the
+    simulated preemption, see set_preemption().
+*/
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux), fastmillis_host::critical_enter())
+#define portEXIT_CRITICAL(mux)  ((void)(mux), fastmillis_host::critical_exit())
@@ -0,0 +1,195 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ *  Time units without divisions
+ *
+ *  Durations and time points tagged with their unit (CPU cycles,
+ *  ns, µs, ms, s), converted with a multiply and a shift.
+ *
+ *  GCC already replaces a 32-bit division by a constant with a
+ *  multiply, but not a 64-bit one: fastmicros64() / 1000000 is a
+ *  call to __udivdi3, hundreds of cycles on the ESP32. Here the
+ *  reciprocal is worked out at compile time for 32 and 64 bit
+ *  values alike (Granlund & Montgomery, "Division by invariant
+ *  integers using multiplication", 1994), so a conversion costs
+ *  one 32x32 multiply, or four for 64 bits, and a few adds and
+ *  shifts. It is exact: same result as the division.
+ *
+ *      using namespace fastmillis_units;
+ *      TimePoint<Micros, uint64_t> t = now_micros64();
+ *      ...
+ *      Duration<Micros, uint64_t> d = now_micros64() - t;
+ *      uint32_t ms = d.to<Millis>().count;
+ *
+ *  Cycles are fastcycles() ticks, FASTCYCLES_MHZ per µs, like
+ *  MultiDelay.
+ *  Between units that aren't multiples of each other (ns and
+ *  cycles at 240MHz: 25ns = 6 cycles) it multiplies, then divides.
+ *  Going to a finer unit multiplies and may overflow Rep: use a
+ *  64-bit Rep for long durations. Time points with a 32-bit Rep
+ *  wrap around; differences and comparisons handle that, but
+ *  converting them to another unit only makes sense with 64 bits.
+ *
+ *  All of it is constexpr (C++11) and header only.
+ **************************************************************/
+
+#include <stdint.h>
+#include <type_traits>
+#include "fastmillis.h"
+
+namespace fastmillis_units {
+
+/*  Units, in ticks per second.
+*/
+struct Cycles  { static constexpr uint64_t hz = uint64_t(FASTCYCLES_MHZ) * 1000000; };
+struct Nanos   { static constexpr uint64_t hz = 1000000000; };
+struct Micros  { static constexpr uint64_t hz = 1000000; };
+struct Millis  { static constexpr uint64_t hz = 1000; };
+struct Seconds { static constexpr uint64_t hz = 1; };
+
+namespace detail {
+
+constexpr uint64_t gcd( uint64_t a, uint64_t b ) { return b ? gcd( b, a % b ) : a; }
+
+constexpr unsigned log2_ceil( uint64_t d ) { return d <= 1 ? 0 : 1 + log2_ceil( (d+1) >> 1 ); }
+
+/*  floor( r * 2^bits / d ), one quotient bit at a time (r < d).
+*/
+constexpr uint64_t long_div( uint64_t r, uint64_t d, unsigned bits, uint64_t q ) {
+    return bits == 0 ? q : long_div( 2*r >= d ? 2*r - d : 2*r, d, bits-1, (q << 1) | (2*r >= d) );
+}
+
+constexpr uint32_t mulhi( uint32_t a, uint32_t b ) {
+    return uint32_t(( uint64_t(a) * b ) >> 32 );
+}
+
+constexpr uint64_t mulhi_parts( uint64_t ll, uint64_t lh, uint64_t hl, uint64_t hh ) {
+    return hh + (lh >> 32) + (hl >> 32) + (((ll >> 32) + uint32_t(lh) + uint32_t(hl)) >> 32);
+}
+
+constexpr uint64_t mulhi( uint64_t a, uint64_t b ) {
+    return mulhi_parts( uint64_t(uint32_t(a)) * uint32_t(b), uint64_t(uint32_t(a)) * (b >> 32),
+                        (a >> 32) * uint32_t(b), (a >> 32) * (b >> 32) );
+}
+
+/*  x / D for any x of type Rep, D < 2^bits. With L = ceil(log2 D) and
+    M = floor( 2^bits * (2^L - D) / D ) + 1, which fits in Rep:
+        t = mulhi( x, M ),  x / D = ( t + (x-t)/2 ) >> (L-1)
+*/
+template< uint64_t D, class Rep >
+struct Divider {
+    static_assert( Rep(-1) > 0, "unsigned types only" );
+    static constexpr unsigned L = log2_ceil( D );
+    static constexpr Rep M = Rep( long_div( (uint64_t(1) << L) - D, D, sizeof(Rep)*8, 0 ) + 1 );
+
+    static constexpr Rep fix( Rep x, Rep t ) { return Rep( (t + Rep((x - t) >> 1)) >> (L ? L-1 : 0) ); }
+    static constexpr Rep div( Rep x ) {
+        return D == 1 ? x : (D & (D-1)) == 0 ? Rep( x >> L ) : fix( x, mulhi( x, M ));
+    }
+};
+
+template< class To, class From >
+struct Ratio {
+    static constexpr uint64_t g   = gcd( From::hz, To::hz );
+    static constexpr uint64_t num = To::hz / g;         // to = from * num / den
+    static constexpr uint64_t den = From::hz / g;
+};
+
+}   // namespace detail
+
+/*  v in From units, to To units, rounded down.
+*/
+template< class To, class From, class Rep >
+constexpr Rep convert( Rep v ) {
+    return detail::Divider< detail::Ratio<To,From>::den, Rep >::div( Rep( v * detail::Ratio<To,From>::num ));
+}
+
+template< class Unit, class Rep = uint32_t >
+struct Duration {
+    Rep count;
+
+    constexpr Duration() : count(0) {}
+    constexpr explicit Duration( Rep c ) : count(c) {}
+
+    template< class To >
+    constexpr Duration<To,Rep> to() const { return Duration<To,Rep>( convert<To,Unit>( count )); }
+
+    constexpr Duration operator+( Duration d ) const { return Duration( count + d.count ); }
+    constexpr Duration operator-( Duration d ) const { return Duration( count - d.count ); }
+    constexpr Duration operator*( Rep k ) const { return Duration( count * k ); }
+    Duration& operator+=( Duration d ) { count += d.count; return *this; }
+    Duration& operator-=( Duration d ) { count -= d.count; return *this; }
+
+    constexpr bool operator==( Duration d ) const { return count == d.count; }
+    constexpr bool operator!=( Duration d ) const { return count != d.count; }
+    constexpr bool operator< ( Duration d ) const { return count <  d.count; }
+    constexpr bool operator<=( Duration d ) const { return count <= d.count; }
+    constexpr bool operator> ( Duration d ) const { return count >  d.count; }
+    constexpr bool operator>=( Duration d ) const { return count >= d.count; }
+};
+
+template< class Unit, class Rep = uint32_t >
+struct TimePoint {
+    typedef typename std::make_signed<Rep>::type SRep;
+    Rep count;
+
+    constexpr TimePoint() : count(0) {}
+    constexpr explicit TimePoint( Rep c ) : count(c) {}
+
+    template< class To >
+    constexpr TimePoint<To,Rep> to() const { return TimePoint<To,Rep>( convert<To,Unit>( count )); }
+
+    constexpr Duration<Unit,Rep> operator-( TimePoint t ) const { return Duration<Unit,Rep>( count - t.count ); }
+    constexpr TimePoint operator+( Duration<Unit,Rep> d ) const { return TimePoint( count + d.count ); }
+    constexpr TimePoint operator-( Duration<Unit,Rep> d ) const { return TimePoint( count - d.count ); }
+    TimePoint& operator+=( Duration<Unit,Rep> d ) { count += d.count; return *this; }
+
+    // wraparound-safe, as long as the two are less than half the range apart
+    constexpr bool operator==( TimePoint t ) const { return count == t.count; }
+    constexpr bool operator!=( TimePoint t ) const { return count != t.count; }
+    constexpr bool before( TimePoint t ) const { return SRep( count - t.count ) < 0; }
+    constexpr bool after ( TimePoint t ) const { return SRep( count - t.count ) > 0; }
+};
+
+/*  The clocks. now_cycles() wraps every 17.9s at 240MHz, now_micros()
+    every 71 minutes, now_millis() every 49.7 days.
+*/
+static inline TimePoint<Cycles>           now_cycles()   { return TimePoint<Cycles>( fastcycles() ); }
+static inline TimePoint<Micros>           now_micros()   { return TimePoint<Micros>( fastmicros() ); }
+static inline TimePoint<Micros, uint64_t> now_micros64() { return TimePoint<Micros, uint64_t>( fastmicros64() ); }
+static inline TimePoint<Millis>           now_millis()   { return TimePoint<Millis>( fastmillis() ); }
+static inline TimePoint<Millis, uint64_t> now_millis64() { return TimePoint<Millis, uint64_t>( fastmillis64() ); }
+
+}   // namespace fastmillis_units
+
+/*  INTERRUPT SAFE, usable in interrupts and userland code
+    Seconds, from the 64-bit µs counter: no early rollover, wraps around
+    after 136 years.
+*/
+static inline uint32_t IRAM_ATTR fastseconds() {
+    return uint32_t( fastmillis_units::convert< fastmillis_units::Seconds, fastmillis_units::Micros >( fastmicros64() ));
+}
@@ -0,0 +1,196 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ *  Log-linear histogram profiler
+ *
+ *  Linear histograms are either too coarse for short runs or too big
+ *  for long ones. This one splits each power of two into 2^SUB_BITS
+ *  buckets, like HdrHistogram: values below 2^SUB_BITS are exact,
+ *  above that the relative error is at most 1/2^SUB_BITS (12.5% with
+ *  the default 3), and any 32-bit cycle count fits.
+ *
+ *  record() is a count-leading-zeros, a shift and an increment, with
+ *  no loop. Memory is fixed: (33-SUB_BITS) << SUB_BITS counters, 240
+ *  for SUB_BITS=3, so it can stay on in production.
+ *
+ *  Values are fastcycles() ticks, which stay right when the task moves
+ *  to the other core or the CPU clock changes; Scope measures a block
+ *  of code:
+ *
+ *      FastProfiler prof;
+ *      prof.begin( "onewire", "read_bit", FastClockInterface::cycles_per_second() );
+ *      {
+ *          FastProfiler::Scope s( prof );
+ *          ...
+ *      }
+ *      prof.dump( stdout );
+ *
+ *  Not ISR safe: record from one context only, or in a critical section.
+ **************************************************************/
+
+#include <stdio.h>
+#include "fastmillis.h"
+
+template< unsigned SUB_BITS = 3 >
+class LogHistogramProfiler {
+public:
+    static const unsigned SUB     = 1 << SUB_BITS;
+    static const unsigned BUCKETS = (33 - SUB_BITS) << SUB_BITS;
+
+    const char* name = "";
+    const char* what = "";
+    uint32_t    cycles_per_second = 0;
+
+    LogHistogramProfiler() { reset(); }
+
+    void begin( const char* _name, const char* _what, uint32_t _cycles_per_second ) {
+        name = _name;
+        what = _what;
+        cycles_per_second = _cycles_per_second;
+        reset();
+    }
+
+    void reset() {
+        for( unsigned i=0; i<BUCKETS; i++ )
+            _counts[i] = 0;
+        _count = 0;
+        _sum   = 0;
+        _min   = 0xFFFFFFFF;
+        _max   = 0;
+    }
+
+    static inline __attribute__((always_inline))
+    unsigned bucket( uint32_t v ) {
+        if( v < SUB )
+            return v;
+        unsigned shift = (31 - __builtin_clz( v )) - SUB_BITS;  // >= 0
+        return ((shift + 1) << SUB_BITS) + ((v >> shift) & (SUB-1));
+    }
+
+    /*  Smallest and largest value that land in bucket b.
+    */
+    static uint32_t bucket_low( unsigned b ) {
+        if( b < SUB )
+            return b;
+        unsigned shift = (b >> SUB_BITS) - 1;
+        return uint32_t( SUB + (b & (SUB-1)) ) << shift;
+    }
+
+    static uint32_t bucket_high( unsigned b ) {
+        if( b < SUB )
+            return b;
+        unsigned shift = (b >> SUB_BITS) - 1;
+        return bucket_low( b ) + ((uint32_t(1) << shift) - 1);
+    }
+
+    inline __attribute__((always_inline))
+    void record( uint32_t cycles ) {
+        _counts[ bucket( cycles ) ]++;
+        _count++;
+        _sum += cycles;
+        if( cycles < _min ) _min = cycles;
+        if( cycles > _max ) _max = cycles;
+    }
+
+    /*  Same name as the AceRoutine profilers.
+    */
+    void profileRun( uint32_t cycles ) { record( cycles ); }
+
+    uint32_t count() const { return _count; }
+    uint32_t min()   const { return _count ? _min : 0; }
+    uint32_t max()   const { return _max; }
+    uint32_t mean()  const { return _count ? _sum / _count : 0; }
+
+    /*  Value below which a fraction q (0..1) of the samples fall. Returns
+        the upper bound of the bucket, clamped to the true maximum, so it
+        never underestimates.
+    */
+    uint32_t percentile( float q ) const {
+        if( !_count ) return 0;
+        uint32_t target = uint32_t( q * _count + 0.5f );
+        if( target < 1 )      target = 1;
+        if( target > _count ) target = _count;
+        uint32_t seen = 0;
+        for( unsigned b=0; b<BUCKETS; b++ ) {
+            seen += _counts[b];
+            if( seen >= target ) {
+                uint32_t v = bucket_high( b );
+                return v < _max ? v : _max;
+            }
+        }
+        return _max;
+    }
+
+    float to_us( uint32_t cycles ) const {
+        return cycles_per_second ? cycles * 1e6f / cycles_per_second : cycles;
+    }
+
+    /*  One summary line, in µs if cycles_per_second is known:
+        name what n=1000 min=1.2 p50=1.5 p90=2.0 p99=3.1 p99.9=8.0 max=12.4 mean=1.6
+    */
+    void dump( FILE* out ) const {
+        fprintf( out, "%s %s n=%u min=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f mean=%.1f %s\n",
+            name, what, (unsigned)_count,
+            to_us( min() ), to_us( percentile( 0.5f )), to_us( percentile( 0.9f )),
+            to_us( percentile( 0.99f )), to_us( percentile( 0.999f )), to_us( max() ), to_us( mean() ),
+            cycles_per_second ? "us" : "cycles" );
+    }
+
+    /*  Non-empty buckets, for offline analysis:
+        #hist name what sub_bits=3 cps=240000000 n=1000 bucket:count bucket:count ...
+        bucket_low()/bucket_high() turn bucket numbers back into cycles.
+    */
+    void dump_buckets( FILE* out ) const {
+        fprintf( out, "#hist %s %s sub_bits=%u cps=%u n=%u", name, what, SUB_BITS, (unsigned)cycles_per_second, (unsigned)_count );
+        for( unsigned b=0; b<BUCKETS; b++ )
+            if( _counts[b] )
+                fprintf( out, " %u:%u", b, (unsigned)_counts[b] );
+        fputc( '\n', out );
+    }
+
+    /*  Records the cycles spent between construction and destruction.
+    */
+    class Scope {
+    public:
+        inline __attribute__((always_inline))
+        Scope( LogHistogramProfiler& p ) : _p(p), _start( fastcycles() ) {}
+
+        inline __attribute__((always_inline))
+        ~Scope() { _p.record( fastcycles() - _start ); }
+    private:
+        LogHistogramProfiler& _p;
+        uint32_t _start;
+    };
+
+private:
+    uint32_t    _counts[ BUCKETS ];
+    uint32_t    _count;
+    uint64_t    _sum;
+    uint32_t    _min, _max;
+};
+
+typedef LogHistogramProfiler<3> FastProfiler;
@@ -0,0 +1,261 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ * 	Timestamped sample ring, from an ISR to a task
+ *
+ *	A single producer, single consumer ring of (timestamp, value)
+ *	records, without locks or critical sections: push() is a few
+ *	loads and stores and one release store, so an IRAM ISR can
+ *	sample an ADC or a GPIO edge, timestamp it with fastmicros()
+ *	and hand it over, while a task drains the ring in batches.
+ *
+ *		static SampleRing< uint16_t, 1024 > adc;		// in DRAM, not PSRAM
+ *
+ *		void IRAM_ATTR adc_isr() { adc.push( read_adc() ); }
+ *
+ *		SampleRing< uint16_t, 1024 >::Span s;
+ *		while( adc.peek( s )) {							// in the task
+ *			uint32_t t = s.ts;
+ *			for( uint32_t i=0; i<s.count; i++ ) {
+ *				t = s.data[i].time( t );
+ *				process( t, s.data[i].value );
+ *			}
+ *			adc.consume( s.count );
+ *		}
+ *
+ *	peek() hands out the records in place, as many as are contiguous,
+ *	so a second peek() gets the rest after the ring wraps. When the
+ *	ring is full push() drops the new record and counts an overflow:
+ *	the consumer owns the records it hasn't consumed yet.
+ *
+ *	Timestamps are fastmicros(), 32 bits. With SAMPLE_RING_DELTA a
+ *	record keeps 16 bits, the time since the previous record: µs when
+ *	that is below 32768µs, otherwise ms, up to 32.7s, and those
+ *	records (counted as "coarse") are stamped up to 1ms early. With a
+ *	16-bit value that halves the record, from 8 bytes to 4. Times must
+ *	not go backwards.
+ *
+ *	The producer's and the consumer's indices live on cache lines of
+ *	their own, each side keeping a copy of the other's, so neither
+ *	reads the other's line unless the ring looks full or empty. The
+ *	ESP32's internal RAM has no data cache, but the two CPUs still
+ *	contend for the same bank on the same word.
+ *
+ *	One producer (an ISR, or a task) and one consumer: two ISRs on
+ *	different cores pushing to one ring need a ring each.
+ **************************************************************/
+
+#include "fastmillis.h"
+
+#ifndef SAMPLE_RING_CACHE_LINE
+#ifdef FASTMILLIS_HOST
+#define SAMPLE_RING_CACHE_LINE 64
+#else
+#define SAMPLE_RING_CACHE_LINE 32
+#endif
+#endif
+
+enum SampleRingLayout : uint8_t {
+	SAMPLE_RING_FULL,		// 32-bit timestamp per record
+	SAMPLE_RING_DELTA,		// 16-bit time since the previous record
+};
+
+template< class T, SampleRingLayout LAYOUT >
+struct SampleRecord;
+
+template< class T >
+struct SampleRecord< T, SAMPLE_RING_FULL > {
+	uint32_t	ts;
+	T			value;
+
+	/*	Timestamp of this record, from the one of the previous record.
+	*/
+	uint32_t time( uint32_t ) const { return ts; }
+
+	inline __attribute__((always_inline))
+	bool stamp( uint32_t& prev, uint32_t t ) {
+		ts = prev = t;
+		return true;
+	}
+};
+
+template< class T >
+struct SampleRecord< T, SAMPLE_RING_DELTA > {
+	uint16_t	dt;			// µs, or ms with the top bit set
+	T			value;
+
+	uint32_t time( uint32_t prev ) const {
+		return prev + ((dt & 0x8000) ? (dt & 0x7FFF) * 1000u : dt);
+	}
+
+	/*	Returns false if the stamp is coarse. "prev" moves to the time
+		the consumer will see, so errors don't add up.
+	*/
+	inline __attribute__((always_inline))
+	bool stamp( uint32_t& prev, uint32_t t ) {
+		uint32_t d = t - prev;
+		if( d < 0x8000 ) {
+			dt = d;
+			prev = t;
+			return true;
+		}
+		uint32_t ms = d / 1000;
+		if( ms > 0x7FFF ) ms = 0x7FFF;
+		dt = 0x8000 | ms;
+		prev += ms * 1000;
+		return false;
+	}
+};
+
+template< class T, uint32_t N, SampleRingLayout LAYOUT = SAMPLE_RING_FULL >
+class SampleRing {
+public:
+	static_assert( (N & (N-1)) == 0, "N must be a power of two" );
+	static const uint32_t MASK = N - 1;
+
+	typedef SampleRecord< T, LAYOUT > Record;
+
+	/*	Records handed out by peek(). "ts" is the timestamp before
+		data[0], for Record::time().
+	*/
+	struct Span {
+		Record*		data;
+		uint32_t	count;
+		uint32_t	ts;
+	};
+
+	SampleRing() { reset( 0 ); }
+
+	/*	Empties the ring, with no producer or consumer running. In the
+		delta layout "now" is where the timestamps start from.
+	*/
+	void reset( uint32_t now ) {
+		_p.head = _p.tail = 0;
+		_p.ts = now;
+		_p.pushed = _p.overflows = _p.coarse = 0;
+		_c.tail = _c.head = 0;
+		_c.ts = now;
+	}
+
+	/*	Producer. Returns false, and counts an overflow, if the ring is full.
+	*/
+	inline __attribute__((always_inline))
+	bool push( uint32_t ts, const T& value ) {
+		uint32_t head = _p.head;
+		if( head - _p.tail == N ) {
+			_p.tail = __atomic_load_n( &_c.tail, __ATOMIC_ACQUIRE );
+			if( head - _p.tail == N ) {
+				__atomic_store_n( &_p.overflows, _p.overflows + 1, __ATOMIC_RELAXED );
+				return false;
+			}
+		}
+		Record& r = _records[ head & MASK ];
+		if( !r.stamp( _p.ts, ts ))
+			__atomic_store_n( &_p.coarse, _p.coarse + 1, __ATOMIC_RELAXED );
+		r.value = value;
+		__atomic_store_n( &_p.pushed, _p.pushed + 1, __ATOMIC_RELAXED );
+		__atomic_store_n( &_p.head, head + 1, __ATOMIC_RELEASE );
+		return true;
+	}
+
+	inline __attribute__((always_inline))
+	bool push( const T& value ) { return push( fastmicros(), value ); }
+
+	/*	Consumer. Fills "s" with the oldest records, as many as are in one
+		piece, and returns false if there are none. They stay in the ring
+		until consume().
+	*/
+	bool peek( Span& s ) {
+		uint32_t tail = _c.tail;
+		if( _c.head == tail )
+			_c.head = __atomic_load_n( &_p.head, __ATOMIC_ACQUIRE );
+		uint32_t n = _c.head - tail;
+		uint32_t end = N - (tail & MASK);
+		s.data  = &_records[ tail & MASK ];
+		s.count = n < end ? n : end;
+		s.ts    = _c.ts;
+		return s.count;
+	}
+
+	/*	Frees the n oldest records, n at most what peek() returned.
+	*/
+	void consume( uint32_t n ) {
+		uint32_t tail = _c.tail;
+		if( LAYOUT == SAMPLE_RING_DELTA )
+			for( uint32_t i=0; i<n; i++ )
+				_c.ts = _records[ (tail + i) & MASK ].time( _c.ts );
+		else if( n )
+			_c.ts = _records[ (tail + n - 1) & MASK ].time( _c.ts );
+		__atomic_store_n( &_c.tail, tail + n, __ATOMIC_RELEASE );
+	}
+
+	/*	Consumer. Copies and frees one record, false if there are none.
+	*/
+	bool pop( uint32_t& ts, T& value ) {
+		Span s;
+		if( !peek( s ))
+			return false;
+		ts = s.data[0].time( s.ts );
+		value = s.data[0].value;
+		consume( 1 );
+		return true;
+	}
+
+	/*	Records waiting, from either side.
+	*/
+	uint32_t available() const {
+		return __atomic_load_n( &_p.head, __ATOMIC_ACQUIRE ) - __atomic_load_n( &_c.tail, __ATOMIC_ACQUIRE );
+	}
+
+	static constexpr uint32_t capacity() { return N; }
+
+	/*	Producer counters, written by the producer only.
+	*/
+	uint32_t pushed() const    { return __atomic_load_n( &_p.pushed, __ATOMIC_RELAXED ); }
+	uint32_t overflows() const { return __atomic_load_n( &_p.overflows, __ATOMIC_RELAXED ); }
+	uint32_t coarse() const    { return __atomic_load_n( &_p.coarse, __ATOMIC_RELAXED ); }
+
+private:
+	struct alignas( SAMPLE_RING_CACHE_LINE ) Producer {
+		uint32_t	head;			// records pushed, wraps; read by the consumer
+		uint32_t	tail;			// the consumer's, as last seen
+		uint32_t	ts;				// timestamp of the last record, as the consumer will see it
+		uint32_t	pushed;
+		uint32_t	overflows;
+		uint32_t	coarse;
+	};
+
+	struct alignas( SAMPLE_RING_CACHE_LINE ) Consumer {
+		uint32_t	tail;			// records consumed, wraps; read by the producer
+		uint32_t	head;			// the producer's, as last seen
+		uint32_t	ts;				// timestamp of the last consumed record
+	};
+
+	Producer	_p;
+	Consumer	_c;
+	alignas( SAMPLE_RING_CACHE_LINE ) Record _records[ N ];
+};
@@ -0,0 +1,204 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ * 	Periodic ticker, locked to absolute deadlines
+ *
+ *	Re-arming a Timeout or a Chrono from "now" after each period adds
+ *	the time the work took, and the ticker drifts. PeriodicTicker
+ *	keeps deadlines at begin + k*period, like MultiDelay does for
+ *	bit-banging: lateness in one period does not carry over to the
+ *	next, and a 1kHz loop does 3600000 periods an hour, exactly.
+ *
+ *		MicrosTicker t;
+ *		t.begin( 250 );							// 4kHz
+ *		for(;;) {
+ *			t.wait();							// sleeps, then spins to the µs
+ *			sample();
+ *		}
+ *
+ *	or, from a loop that does other things, if( t.due() ) sample();
+ *
+ *	A period is overrun when it starts one period or more late. With
+ *	TICKER_CATCH_UP the missed periods run back to back (at most
+ *	catch_up_limit of them, the rest are skipped), so counts stay
+ *	right. With TICKER_SKIP they are dropped, and the next deadline
+ *	stays on the grid. Either way "skipped" counts what was dropped.
+ *
+ *	MillisTicker counts fastmillis() ms and wraps around safely, with
+ *	periods up to 2^31 ms. MicrosTicker counts fastmicros64() µs;
+ *	its wait() is hybridDelayUntil(), so it lets other tasks run
+ *	then lands on the µs, for the 1-10kHz control loops. Lateness is
+ *	recorded per period, in the ticker's unit: max, mean and a power
+ *	of two histogram.
+ *
+ *	Not ISR safe: use a ticker from one task.
+ **************************************************************/
+
+#include <stdio.h>
+#include "fastmillis.h"
+
+enum TickerPolicy : uint8_t {
+	TICKER_CATCH_UP,		// run the missed periods
+	TICKER_SKIP,			// drop them
+};
+
+struct TickerMillisClock {
+	typedef uint32_t Time;
+	typedef int32_t  STime;
+	static const char* unit() { return "ms"; }
+	static Time now() { return fastmillis(); }
+
+	static void sleep_until( Time deadline ) {
+		STime left = deadline - now();
+		if( left > 1 )		// the current ms may be almost over
+			hybridDelayUntil( fastmicros64() + uint64_t( left - 1 ) * 1000 );
+	}
+};
+
+struct TickerMicrosClock {
+	typedef uint64_t Time;
+	typedef int64_t  STime;
+	static const char* unit() { return "us"; }
+	static Time now() { return fastmicros64(); }
+	static void sleep_until( Time deadline ) { hybridDelayUntil( deadline ); }
+};
+
+struct TickerStats {
+	uint32_t	ticks		= 0;		// periods run
+	uint32_t	overruns	= 0;		// periods started a period or more late
+	uint32_t	skipped		= 0;		// periods dropped
+	uint32_t	late_max	= 0;
+	uint64_t	late_total	= 0;
+	Pow2Histogram< 16 >	late_hist;	// [n]: 2^(n-1) <= late < 2^n, [0]: on time
+
+	void reset() { *this = TickerStats(); }
+
+	void record( uint32_t late ) {
+		ticks++;
+		late_total += late;
+		if( late > late_max ) late_max = late;
+		late_hist.record( late );
+	}
+};
+
+template< class Clock >
+class PeriodicTicker {
+public:
+	typedef typename Clock::Time  Time;
+	typedef typename Clock::STime STime;
+
+	TickerStats		stats;
+	uint32_t		catch_up_limit = 8;		// TICKER_CATCH_UP: periods run back to back, at most
+
+	/*	Starts ticking: the first period is due "period" from now, or
+		at "first" with begin_at(). The grid is first + k*period.
+	*/
+	void begin( uint32_t period, TickerPolicy policy = TICKER_SKIP ) {
+		begin_at( Clock::now() + period, period, policy );
+	}
+
+	void begin_at( Time first, uint32_t period, TickerPolicy policy = TICKER_SKIP ) {
+		_deadline = first;
+		_period   = period ? period : 1;
+		_policy   = policy;
+		_behind   = 0;
+		stats.reset();
+	}
+
+	/*	Changes the period from the next deadline on, keeping the phase
+		of the deadline already set.
+	*/
+	void set_period( uint32_t period ) { _period = period ? period : 1; }
+	void set_policy( TickerPolicy policy ) { _policy = policy; }
+
+	uint32_t period() const { return _period; }
+
+	/*	The deadline of the next period.
+	*/
+	Time deadline() const { return _deadline; }
+
+	/*	Time left until the next period, zero if it is due.
+	*/
+	uint32_t remaining() const {
+		STime r = _deadline - Clock::now();
+		return r > 0 ? r : 0;
+	}
+
+	/*	true once per period, when its deadline has passed. Moves on to
+		the next deadline and records how late this one was.
+	*/
+	bool due() {
+		STime late = Clock::now() - _deadline;
+		if( late < 0 )
+			return false;
+		uint64_t l = late;
+		uint32_t missed = l < _period ? 0 : l < 0xFFFFFFFF ? uint32_t( l ) / _period : uint32_t( l / _period );
+		if( missed && !_behind )
+			stats.overruns++;			// once, not again while catching up
+		uint32_t drop = _policy == TICKER_SKIP ? missed : missed > catch_up_limit ? missed - catch_up_limit : 0;
+		if( drop ) {
+			stats.skipped += drop;
+			_deadline += Time( drop ) * _period;
+			late -= STime( drop ) * _period;
+		}
+		_behind = missed - drop;
+		stats.record( uint64_t( late ) < 0xFFFFFFFF ? uint32_t( late ) : 0xFFFFFFFF );
+		_deadline += _period;
+		return true;
+	}
+
+	/*	Blocks until the next period is due, then same as due(). Returns
+		at once when it is already, for instance after an overrun with
+		TICKER_CATCH_UP.
+	*/
+	void wait() {
+		if( STime( _deadline - Clock::now() ) > 0 )
+			Clock::sleep_until( _deadline );
+		while( !due() )
+			;
+	}
+
+	/*	One line: counts, and lateness in the ticker's unit.
+	*/
+	void report( FILE* out, const char* name ) const {
+		const TickerStats& s = stats;
+		fprintf( out, "ticker %s period=%u%s ticks=%u overruns=%u skipped=%u late max=%u mean=%u hist(%s<2^n):",
+			name, (unsigned)_period, Clock::unit(), (unsigned)s.ticks, (unsigned)s.overruns, (unsigned)s.skipped,
+			(unsigned)s.late_max, (unsigned)(s.ticks ? s.late_total / s.ticks : 0), Clock::unit() );
+		s.late_hist.print( out );
+		fputc( '\n', out );
+	}
+
+private:
+	Time			_deadline = 0;
+	uint32_t		_period   = 1;
+	TickerPolicy	_policy   = TICKER_SKIP;
+	uint32_t		_behind   = 0;		// periods overdue at the last due()
+};
+
+typedef PeriodicTicker< TickerMillisClock > MillisTicker;
+typedef PeriodicTicker< TickerMicrosClock > MicrosTicker;
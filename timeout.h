@@ -29,6 +29,7 @@ SOFTWARE.
  **************************************************************/
 
 #include "fastmillis.h"
+#include "trace.h"
 
 class Timeout {
 public:
@@ -68,6 +69,7 @@ public:
 		int r = _end_millis - fastmillis();
 		if( r>0 )
 			return r;
+		TRACE_INSTANT( "timeout.expired" );
 		_expired = true;	// prevent wraparound
 		return 0;
 	}
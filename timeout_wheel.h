@@ -0,0 +1,247 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ * 	Hierarchical timing wheel, for lots of timeouts
+ *
+ *	Polling hundreds of Timeout objects with remaining() every loop
+ *	costs one fastmillis() and a compare each. Instead, register them
+ *	in a TimeoutWheel and call advance() once per loop: it finds the
+ *	expired ones and calls their callbacks.
+ *
+ *	set() and cancel() are O(1), advance() is amortised O(1) per
+ *	timeout plus O(elapsed ms / 64) to walk the wheel.
+ *
+ *	5 levels of 64 slots, 1ms per slot on the first level, cover 2^30 ms.
+ *	Longer timeouts are parked in the last level and cascaded down when
+ *	it comes around. Timeouts must be shorter than 2^31 ms (24.8 days).
+ *
+ *	Not ISR safe: call set(), cancel() and advance() from the same task.
+ *	Timeouts are intrusive and never allocated, so they must stay alive
+ *	while pending.
+ **************************************************************/
+
+#include "fastmillis.h"
+#include "trace.h"
+
+class TimeoutWheel;
+
+class WheelTimeout {
+public:
+	typedef void (*Callback)( WheelTimeout& timeout, void* arg );
+
+	Callback	callback;
+	void*		arg;
+
+	WheelTimeout( Callback cb = nullptr, void* cb_arg = nullptr ) : callback(cb), arg(cb_arg) {}
+
+	/*	true while waiting in a wheel, false once it expired or was cancelled.
+	*/
+	bool pending() const { return _pprev; }
+
+	/*	Returns time remaining in ms, zero if not pending.
+	*/
+	int32_t remaining() const {
+		if( !pending() ) return 0;
+		int32_t r = _end_millis - fastmillis();
+		return r > 0 ? r : 0;
+	}
+
+	uint32_t end_millis() const { return _end_millis; }
+
+private:
+	friend class TimeoutWheel;
+	uint32_t		_end_millis = 0;
+	WheelTimeout*	_next  = nullptr;
+	WheelTimeout**	_pprev = nullptr;	// points to whatever points to us, null if not in a wheel
+	uint16_t		_slot  = 0;
+};
+
+class TimeoutWheel {
+public:
+	static const unsigned BITS   = 6;
+	static const unsigned SIZE   = 1 << BITS;
+	static const unsigned LEVELS = 5;
+
+	TimeoutWheel() { begin( fastmillis() ); }
+
+	/*	Forgets all timeouts and restarts the wheel at "now".
+	*/
+	void begin( uint32_t now ) {
+		for( unsigned i=0; i<LEVELS*SIZE; i++ ) {
+			for( WheelTimeout* t = _slots[i]; t; t = t->_next )
+				t->_pprev = nullptr;
+			_slots[i] = nullptr;
+		}
+		for( unsigned i=0; i<LEVELS; i++ )
+			_occupied[i] = 0;
+		_now = now;
+		_count = 0;
+	}
+
+	/*	Arms (or re-arms) timeout t to expire timeout_ms from now.
+		Its callback will be called by advance().
+	*/
+	void set( WheelTimeout& t, uint32_t timeout_ms ) {
+		set_at( t, fastmillis() + timeout_ms );
+	}
+
+	void set_at( WheelTimeout& t, uint32_t end_millis ) {
+		cancel( t );
+		t._end_millis = end_millis;
+		insert( t );
+		_count++;
+	}
+
+	/*	Removes t from the wheel without calling its callback.
+	*/
+	void cancel( WheelTimeout& t ) {
+		if( !t.pending() ) return;
+		unlink( t );
+		_count--;
+	}
+
+	/*	Calls the callbacks of all timeouts expired by "now".
+		Callbacks may set() or cancel() any timeout, including their own.
+		Returns the number of callbacks called.
+	*/
+	uint32_t advance() { return advance( fastmillis() ); }
+
+	uint32_t advance( uint32_t now ) {
+		uint32_t fired = 0;
+		while( (int32_t)(now - _now) >= 0 ) {
+			if( !_count ) {
+				_now = now + 1;
+				break;
+			}
+
+			unsigned idx = _now & (SIZE-1);
+			if( !idx )
+				cascade( 1 );
+
+			/*	Nothing left in this turn of the first level: jump to the
+				next cascade, or to now+1, whichever comes first.
+			*/
+			if( !(_occupied[0] >> idx) ) {
+				uint32_t next = (_now | (SIZE-1)) + 1;
+				_now = (int32_t)(next - (now+1)) < 0 ? next : now + 1;
+				continue;
+			}
+
+			_now++;
+			fired += run_slot( idx );
+		}
+		return fired;
+	}
+
+	/*	Number of pending timeouts.
+	*/
+	uint32_t count() const { return _count; }
+
+private:
+	WheelTimeout*	_slots[ LEVELS*SIZE ] = {};
+	uint64_t		_occupied[ LEVELS ];	// one bit per non-empty slot
+	uint32_t		_now;					// next ms to process
+	uint32_t		_count;
+
+	void insert( WheelTimeout& t ) {
+		uint32_t end   = t._end_millis;
+		uint32_t delta = end - _now;
+		unsigned level;
+		if( (int32_t)delta < 0 ) {
+			level = 0;			// already late: run on next advance()
+			end   = _now;
+		} else {
+			for( level=0; level < LEVELS-1; level++ )
+				if( delta < (1u << (BITS*(level+1))) )
+					break;
+			if( delta >= (1u << (BITS*LEVELS)) )
+				end = _now + (1u << (BITS*LEVELS)) - 1;	// park it, cascade() will put it back
+		}
+		unsigned idx  = (end >> (BITS*level)) & (SIZE-1);
+		unsigned slot = level*SIZE + idx;
+
+		t._slot  = slot;
+		t._next  = _slots[slot];
+		t._pprev = &_slots[slot];
+		if( t._next ) t._next->_pprev = &t._next;
+		_slots[slot] = &t;
+		_occupied[level] |= uint64_t(1) << idx;
+	}
+
+	void unlink( WheelTimeout& t ) {
+		*t._pprev = t._next;
+		if( t._next ) t._next->_pprev = t._pprev;
+		t._next  = nullptr;
+		t._pprev = nullptr;
+		if( !_slots[t._slot] )
+			_occupied[t._slot / SIZE] &= ~(uint64_t(1) << (t._slot % SIZE));
+	}
+
+	/*	Detaches a slot into a local list, so callbacks can re-arm timeouts
+		into the same slot without confusing the loop.
+	*/
+	WheelTimeout* detach( unsigned slot ) {
+		WheelTimeout* list = _slots[slot];
+		_slots[slot] = nullptr;
+		_occupied[slot / SIZE] &= ~(uint64_t(1) << (slot % SIZE));
+		return list;
+	}
+
+	/*	Moves the timeouts of the current slot of "level" down to the
+		levels below, and does the same one level up on wraparound.
+	*/
+	void cascade( unsigned level ) {
+		for( ; level < LEVELS; level++ ) {
+			unsigned idx  = (_now >> (BITS*level)) & (SIZE-1);
+			WheelTimeout* list = detach( level*SIZE + idx );
+			if( list ) list->_pprev = &list;
+			while( list ) {
+				WheelTimeout& t = *list;
+				unlink( t );
+				insert( t );
+			}
+			if( idx )
+				break;
+		}
+	}
+
+	uint32_t run_slot( unsigned idx ) {
+		uint32_t fired = 0;
+		WheelTimeout* list = detach( idx );
+		if( list ) list->_pprev = &list;
+		while( list ) {
+			WheelTimeout& t = *list;
+			unlink( t );
+			_count--;
+			fired++;
+			TRACE_INSTANT_V( "wheel.expired", t._end_millis );
+			if( t.callback )
+				t.callback( t, t.arg );
+		}
+		return fired;
+	}
+};
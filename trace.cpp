@@ -0,0 +1,148 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "config.h"
+#include "fastmillis.h"
+#include "trace.h"
+
+#include <string.h>
+
+static_assert( (FASTMILLIS_TRACE_EVENTS & (FASTMILLIS_TRACE_EVENTS-1)) == 0, "FASTMILLIS_TRACE_EVENTS must be a power of two" );
+static_assert( sizeof(TraceEvent) == 12, "TraceEvent layout is part of the dump format" );
+
+struct TraceRing {
+    uint32_t    head;       // total events written, wraps
+    TraceEvent  events[ FASTMILLIS_TRACE_EVENTS ];
+};
+
+static TraceRing        trace_rings[ FASTMILLIS_TRACE_CORES ];
+static const char*      trace_names[ FASTMILLIS_TRACE_NAMES ];
+static uint16_t         trace_name_count;
+static volatile bool    trace_enabled = true;
+static portMUX_TYPE     trace_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t IRAM_ATTR trace_core() {
+    return xPortGetCoreID();
+}
+
+uint16_t trace_name( const char* name ) {
+    uint16_t id = 0;
+    portENTER_CRITICAL( &trace_mux );
+    for( uint16_t i=0; i<trace_name_count; i++ )
+        if( !strcmp( trace_names[i], name )) {
+            id = i + 1;
+            break;
+        }
+    if( !id && trace_name_count < FASTMILLIS_TRACE_NAMES ) {
+        trace_names[ trace_name_count++ ] = name;
+        id = trace_name_count;
+    }
+    portEXIT_CRITICAL( &trace_mux );
+    return id;
+}
+
+void IRAM_ATTR trace_event( uint8_t type, uint16_t name, int32_t value ) {
+    if( !trace_enabled || !name )
+        return;
+    TraceRing& r = trace_rings[ trace_core() ];
+    // Stamp before reserving, so the stamp is when the event happened even
+    // if an ISR comes in between. The two events may then be a few µs out
+    // of order in the ring, which trace2json allows for.
+    uint32_t ts = fastmicros();
+    // an ISR on the same core may preempt us, so reserve the slot atomically
+    uint32_t i = __atomic_fetch_add( &r.head, 1, __ATOMIC_RELAXED );
+    TraceEvent& e = r.events[ i & (FASTMILLIS_TRACE_EVENTS-1) ];
+    e.ts    = ts;
+    e.name  = name;
+    e.type  = type;
+    e.flags = 0;
+    e.value = value;
+}
+
+void trace_start() { trace_enabled = true; }
+void trace_stop()  { trace_enabled = false; }
+
+void trace_clear() {
+    for( unsigned c=0; c<FASTMILLIS_TRACE_CORES; c++ )
+        trace_rings[c].head = 0;
+}
+
+/*  Writes raw bytes, or hex with 32 bytes per line.
+*/
+class TraceWriter {
+public:
+    TraceWriter( FILE* out, bool hex ) : _out(out), _hex(hex) {}
+    ~TraceWriter() { if( _hex && _col ) fputc( '\n', _out ); }
+
+    void put( const void* data, size_t len ) {
+        if( !_hex ) {
+            fwrite( data, 1, len, _out );
+            return;
+        }
+        const uint8_t* p = (const uint8_t*)data;
+        while( len-- ) {
+            fprintf( _out, "%02x", *p++ );
+            if( ++_col == 32 ) {
+                fputc( '\n', _out );
+                _col = 0;
+            }
+        }
+    }
+    void u8( uint8_t v )   { put( &v, 1 ); }
+    void u16( uint16_t v ) { uint8_t b[2] = { uint8_t(v), uint8_t(v>>8) }; put( b, 2 ); }
+    void u32( uint32_t v ) { uint8_t b[4] = { uint8_t(v), uint8_t(v>>8), uint8_t(v>>16), uint8_t(v>>24) }; put( b, 4 ); }
+
+private:
+    FILE*       _out;
+    bool        _hex;
+    unsigned    _col = 0;
+};
+
+void trace_dump( FILE* out, bool hex ) {
+    TraceWriter w( out, hex );
+    w.put( "FMTR", 4 );
+    w.u8( 1 );
+    w.u8( FASTMILLIS_TRACE_CORES );
+    w.u16( trace_name_count );
+    for( uint16_t i=0; i<trace_name_count; i++ ) {
+        size_t len = strlen( trace_names[i] );
+        if( len > 255 ) len = 255;
+        w.u8( len );
+        w.put( trace_names[i], len );
+    }
+    for( unsigned c=0; c<FASTMILLIS_TRACE_CORES; c++ ) {
+        const TraceRing& r = trace_rings[c];
+        uint32_t head  = r.head;
+        uint32_t count = head < FASTMILLIS_TRACE_EVENTS ? head : FASTMILLIS_TRACE_EVENTS;
+        w.u32( count );
+        for( uint32_t i = head - count; i != head; i++ ) {
+            const TraceEvent& e = r.events[ i & (FASTMILLIS_TRACE_EVENTS-1) ];
+            w.u32( e.ts );
+            w.u16( e.name );
+            w.u8( e.type );
+            w.u8( e.flags );
+            w.u32( e.value );
+        }
+    }
+}
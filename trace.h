@@ -0,0 +1,148 @@
+/*
+MIT License
+
+Copyright (c) 2022 peufeu
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/**************************************************************
+ *  Event tracing
+ *
+ *  Each core gets a fixed-size ring of 12-byte events (begin, end,
+ *  instant, counter) timestamped with fastmicros(). Writers reserve a
+ *  slot with one atomic add on their own core's ring, so tracing works
+ *  from tasks and ISRs without locks. When a ring is full the oldest
+ *  events are overwritten.
+ *
+ *  Compiled out unless FASTMILLIS_TRACE is 1: the TRACE_*() macros
+ *  then expand to nothing.
+ *
+ *  Each call site resolves its name to an id before main(), from the
+ *  static constructors, so the macros in an IRAM ISR only read that id:
+ *  nothing touches the name, which is in flash, once the ISR runs.
+ *
+ *      TRACE_BEGIN( "onewire.reset" );
+ *      ...
+ *      TRACE_END( "onewire.reset" );
+ *      TRACE_COUNTER( "queue", n );
+ *
+ *  To look at it: trace_stop(), trace_dump() to a file (or the console
+ *  with hex=true), then on a PC run extras/trace2json.cpp to get a
+ *  Chrome trace (chrome://tracing, or ui.perfetto.dev).
+ **************************************************************/
+
+#include <stdio.h>
+#include "fastmillis.h"
+
+#ifndef FASTMILLIS_TRACE
+#define FASTMILLIS_TRACE 0
+#endif
+
+// events per core, must be a power of two
+#ifndef FASTMILLIS_TRACE_EVENTS
+#define FASTMILLIS_TRACE_EVENTS 512
+#endif
+
+#ifndef FASTMILLIS_TRACE_CORES
+#define FASTMILLIS_TRACE_CORES 2
+#endif
+
+#ifndef FASTMILLIS_TRACE_NAMES
+#define FASTMILLIS_TRACE_NAMES 64
+#endif
+
+// event types, same letters as the Chrome trace "ph" field
+enum TraceType : uint8_t {
+    TRACE_TYPE_BEGIN   = 'B',
+    TRACE_TYPE_END     = 'E',
+    TRACE_TYPE_INSTANT = 'i',
+    TRACE_TYPE_COUNTER = 'C',
+};
+
+struct TraceEvent {
+    uint32_t    ts;         // fastmicros()
+    uint16_t    name;       // index returned by trace_name()
+    uint8_t     type;       // TraceType
+    uint8_t     flags;
+    int32_t     value;
+};
+
+/*  Returns the id of an event name, registering it the first time.
+    The string must stay valid (use literals). Returns 0 if the table is full.
+    Not from an ISR: it compares names, which may be in flash.
+*/
+uint16_t trace_name( const char* name );
+
+/*  Records an event on the current core's ring. Usable from ISRs.
+*/
+void trace_event( uint8_t type, uint16_t name, int32_t value );
+
+void trace_start();
+void trace_stop();
+void trace_clear();
+
+/*  Writes names and events, oldest first. Call trace_stop() first, or
+    events written meanwhile may come out torn. hex=true writes the same
+    bytes as hex text, for the console. Format, little endian:
+
+    "FMTR" u8 version=1, u8 cores, u16 names
+    names times: u8 length, characters
+    cores times: u32 count, count times: u32 ts, u16 name, u8 type, u8 flags, i32 value
+*/
+void trace_dump( FILE* out, bool hex = false );
+
+#if FASTMILLIS_TRACE
+
+/*  Name id of a call site. The macro makes a local class per site, whose
+    str() returns the name; the id, a static member, is initialized with
+    the other globals, before any ISR can run.
+*/
+template< class Site >
+struct TraceSiteId {
+    static uint16_t id;
+};
+
+template< class Site >
+uint16_t TraceSiteId< Site >::id = trace_name( Site::str() );
+
+#define TRACE_EVENT_( type, name, value ) do { \
+    struct _trace_site { static const char* str() { return name; } }; \
+    trace_event( type, TraceSiteId< _trace_site >::id, value ); \
+  } while(0)
+
+#define TRACE_BEGIN( name )             TRACE_EVENT_( TRACE_TYPE_BEGIN,   name, 0 )
+#define TRACE_BEGIN_V( name, value )    TRACE_EVENT_( TRACE_TYPE_BEGIN,   name, value )
+#define TRACE_END( name )               TRACE_EVENT_( TRACE_TYPE_END,     name, 0 )
+#define TRACE_INSTANT( name )           TRACE_EVENT_( TRACE_TYPE_INSTANT, name, 0 )
+#define TRACE_INSTANT_V( name, value )  TRACE_EVENT_( TRACE_TYPE_INSTANT, name, value )
+#define TRACE_COUNTER( name, value )    TRACE_EVENT_( TRACE_TYPE_COUNTER, name, value )
+
+#else
+
+#define TRACE_BEGIN( name )             do {} while(0)
+#define TRACE_BEGIN_V( name, value )    do {} while(0)
+#define TRACE_END( name )               do {} while(0)
+#define TRACE_INSTANT( name )           do {} while(0)
+#define TRACE_INSTANT_V( name, value )  do {} while(0)
+#define TRACE_COUNTER( name, value )    do {} while(0)
+
+#endif